@@ -0,0 +1,292 @@
+/*
+ * Micro-benchmark for the on_rx/on_tx rewrite paths of pj-nat64.
+ *
+ * Builds a minimal pjsua endpoint, generates a corpus of INVITE, 200 OK and re-INVITE messages in several sizes and
+ * runs every message through the module for a set of nat64_options bitmaps. Lookups are answered by a stub resolver
+ * so no network is needed. The module source is included directly so the pjsip callbacks can be driven without a
+ * transport.
+ *
+ * Build:
+ *   cc -O2 -I. bench/pj-nat64-bench.c $(pkg-config --cflags --libs libpjproject) -o nat64-bench
+ * Run:
+ *   ./nat64-bench [iterations]
+ */
+#include <stdlib.h>
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+
+#define BENCH_DEFAULT_ITERATIONS    20000
+
+typedef enum bench_msg_type {
+    BENCH_INVITE,
+    BENCH_200_OK,
+    BENCH_REINVITE
+} bench_msg_type;
+
+typedef struct bench_msg {
+    const char*     name;
+    bench_msg_type  type;
+    unsigned        extra_hdrs;
+    unsigned        streams;
+} bench_msg;
+
+static const bench_msg corpus[] = {
+    { "INVITE small",       BENCH_INVITE,   0,  1 },
+    { "INVITE medium",      BENCH_INVITE,   8,  2 },
+    { "INVITE large",       BENCH_INVITE,   24, 3 },
+    { "200 OK small",       BENCH_200_OK,   0,  1 },
+    { "200 OK large",       BENCH_200_OK,   24, 3 },
+    { "re-INVITE medium",   BENCH_REINVITE, 8,  2 },
+    { "re-INVITE large",    BENCH_REINVITE, 16, 3 },
+};
+
+typedef struct bench_options {
+    const char*     name;
+    unsigned        options;
+} bench_options;
+
+static const bench_options option_sets[] = {
+    { "none",               0 },
+    { "out",                NAT64_REWRITE_OUTGOING_SDP },
+    { "in",                 NAT64_REWRITE_INCOMING_SDP },
+    { "in|route",           NAT64_REWRITE_INCOMING_SDP | NAT64_REWRITE_ROUTE_AND_CONTACT },
+    { "all",                NAT64_REWRITE_OUTGOING_SDP | NAT64_REWRITE_INCOMING_SDP | NAT64_REWRITE_ROUTE_AND_CONTACT },
+    { "all|parsed",         NAT64_REWRITE_OUTGOING_SDP | NAT64_REWRITE_INCOMING_SDP | NAT64_REWRITE_ROUTE_AND_CONTACT |
+                            NAT64_REWRITE_PARSED_SDP },
+};
+
+static const char* stream_names[] = { "audio", "video", "application" };
+
+//Print a message of the corpus, outgoing messages carry ipv6 media addresses and incoming ones ipv4
+static int build_message(char* buf, int size, const bench_msg* m, pj_bool_t outgoing)
+{
+    const char* ip_ver = outgoing ? "IP6" : "IP4";
+    const char* media_addr = outgoing ? "2001:db8:1000::25" : "198.51.100.25";
+    const char* contact_host = outgoing ? "[2001:db8:1000::25]" : "198.51.100.7";
+    char sdp[2048];
+    int sdp_len;
+    int len;
+    unsigned i;
+
+    sdp_len = pj_ansi_snprintf(sdp, sizeof(sdp),
+                               "v=0\r\n"
+                               "o=- 3724394400 %u IN %s %s\r\n"
+                               "s=pjmedia\r\n"
+                               "c=IN %s %s\r\n"
+                               "t=0 0\r\n",
+                               m->type == BENCH_REINVITE ? 3724394402u : 3724394401u,
+                               ip_ver, media_addr, ip_ver, media_addr);
+    for (i = 0; i < m->streams; i++) {
+        sdp_len += pj_ansi_snprintf(sdp + sdp_len, sizeof(sdp) - sdp_len,
+                                    "m=%s %u RTP/AVP 96 97 0 8 101\r\n"
+                                    "c=IN %s %s\r\n"
+                                    "b=TIAS:64000\r\n"
+                                    "a=rtcp:%u IN %s %s\r\n"
+                                    "a=sendrecv\r\n"
+                                    "a=rtpmap:96 opus/48000/2\r\n"
+                                    "a=fmtp:96 useinbandfec=1\r\n"
+                                    "a=rtpmap:97 speex/16000\r\n"
+                                    "a=rtpmap:101 telephone-event/8000\r\n"
+                                    "a=fmtp:101 0-16\r\n",
+                                    stream_names[i % PJ_ARRAY_SIZE(stream_names)], 4000 + i * 2,
+                                    ip_ver, media_addr, 4001 + i * 2, ip_ver, media_addr);
+    }
+
+    if (m->type == BENCH_200_OK) {
+        len = pj_ansi_snprintf(buf, size, "SIP/2.0 200 OK\r\n");
+    } else {
+        len = pj_ansi_snprintf(buf, size, "INVITE sip:bob@example.com SIP/2.0\r\n");
+    }
+    len += pj_ansi_snprintf(buf + len, size - len,
+                            "Via: SIP/2.0/TCP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKPj4f7a9c1e2b3d\r\n"
+                            "Max-Forwards: 70\r\n"
+                            "From: <sip:alice@example.com>;tag=8a1b2c3d4e5f\r\n"
+                            "To: <sip:bob@example.com>%s\r\n"
+                            "Call-ID: 5d1e7f0a-2b3c-4d5e-8f9a-0b1c2d3e4f5a\r\n"
+                            "CSeq: %d INVITE\r\n"
+                            "Contact: <sip:alice@%s:5060;ob>\r\n"
+                            "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, INFO, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+                            "Supported: replaces, 100rel, timer, norefersub\r\n"
+                            "User-Agent: pj-nat64-bench\r\n",
+                            m->type == BENCH_INVITE ? "" : ";tag=9f8e7d6c5b4a",
+                            m->type == BENCH_REINVITE ? 2 : 1, contact_host);
+    for (i = 0; i < m->extra_hdrs; i++) {
+        len += pj_ansi_snprintf(buf + len, size - len,
+                                "Record-Route: <sip:proxy%u.example.com:5060;transport=tcp;lr;ftag=8a1b2c3d4e5f>\r\n", i);
+    }
+    len += pj_ansi_snprintf(buf + len, size - len,
+                            "Content-Type: application/sdp\r\n"
+                            "Content-Length:  %d\r\n"
+                            "\r\n"
+                            "%s",
+                            sdp_len, sdp);
+    return len;
+}
+
+typedef struct bench_result {
+    pj_uint64_t nsec;
+    pj_uint64_t bytes_copied;
+    pj_uint64_t pool_bytes;
+} bench_result;
+
+static pj_status_t bench_tx(pj_pool_t* pool, const char* msg, int msg_len, unsigned iterations, bench_result* res)
+{
+    unsigned i;
+    for (i = 0; i < iterations; i++) {
+        pjsip_tx_data* tdata;
+        char* org_start;
+        pj_size_t pool_before;
+        pj_timestamp t0, t1;
+        char* copy;
+        pj_status_t status;
+
+        status = pjsip_endpt_create_tdata(pjsua_get_pjsip_endpt(), &tdata);
+        if (status != PJ_SUCCESS) {
+            return status;
+        }
+        pjsip_tx_data_add_ref(tdata);
+        copy = (char*)pj_pool_alloc(tdata->pool, msg_len + 1);
+        pj_memcpy(copy, msg, msg_len);
+        copy[msg_len] = '\0';
+        tdata->msg = pjsip_parse_msg(tdata->pool, copy, msg_len, NULL);
+        if (tdata->msg == NULL) {
+            pjsip_tx_data_dec_ref(tdata);
+            return PJSIP_EINVALIDMSG;
+        }
+
+        //Same order as pjsip: the parsed sdp module runs before the message is printed, mod-ipv6 after
+        pool_before = pj_pool_get_used_size(tdata->pool);
+        pj_get_timestamp(&t0);
+        ipv6_sdp_mod_on_tx(tdata);
+        pjsip_tx_data_encode(tdata);
+        org_start = tdata->buf.start;
+        ipv6_mod_on_tx(tdata);
+        pj_get_timestamp(&t1);
+
+        res->nsec += pj_elapsed_nanosec(&t0, &t1);
+        res->pool_bytes += pj_pool_get_used_size(tdata->pool) - pool_before;
+        if (tdata->buf.start != org_start) {
+            res->bytes_copied += tdata->buf.cur - tdata->buf.start;
+        }
+        pjsip_tx_data_dec_ref(tdata);
+    }
+    PJ_UNUSED_ARG(pool);
+    return PJ_SUCCESS;
+}
+
+static pj_status_t bench_rx(pj_pool_t* pool, const char* msg, int msg_len, unsigned iterations, bench_result* res)
+{
+    pjsip_rx_data* rdata = PJ_POOL_ZALLOC_T(pool, pjsip_rx_data);
+    pj_pool_t* rdata_pool = pjsua_pool_create("benchrx", 8000, 4000);
+    pjsip_transport transport;
+    unsigned i;
+
+    stub_transport_init(&transport, NULL);
+    rdata->tp_info.transport = &transport;
+    for (i = 0; i < iterations; i++) {
+        pj_size_t pool_before;
+        pj_timestamp t0, t1;
+        char* buf = rdata->pkt_info.packet;
+
+        //Every iteration stands for a new message, not a retransmission answered from the memo
+        rx_memo_flush();
+        pj_pool_reset(rdata_pool);
+        pj_bzero(&rdata->msg_info, sizeof(rdata->msg_info));
+        pj_bzero(&rdata->endpt_info, sizeof(rdata->endpt_info));
+        rdata->tp_info.pool = rdata_pool;
+        if (msg_len >= (int)sizeof(rdata->pkt_info.packet)) {
+            buf = (char*)pj_pool_alloc(rdata_pool, msg_len + 1);
+        }
+        pj_memcpy(buf, msg, msg_len);
+        buf[msg_len] = '\0';
+        rdata->pkt_info.len = msg_len;
+        rdata->msg_info.msg_buf = buf;
+        rdata->msg_info.len = msg_len;
+        if (pjsip_parse_rdata(buf, msg_len, rdata) == NULL) {
+            pj_pool_release(rdata_pool);
+            return PJSIP_EINVALIDMSG;
+        }
+
+        pool_before = pj_pool_get_used_size(rdata_pool);
+        pj_get_timestamp(&t0);
+        ipv6_mod_on_rx(rdata);
+        pj_get_timestamp(&t1);
+
+        res->nsec += pj_elapsed_nanosec(&t0, &t1);
+        res->pool_bytes += pj_pool_get_used_size(rdata_pool) - pool_before;
+        if (rdata->msg_info.msg_buf != buf) {
+            res->bytes_copied += rdata->msg_info.len;
+        }
+    }
+    pj_pool_release(rdata_pool);
+    return PJ_SUCCESS;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned iterations = argc > 1 ? (unsigned)atoi(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+    pjsua_config cfg;
+    pjsua_logging_config log_cfg;
+    pj_pool_t* pool;
+    pj_status_t status;
+    unsigned m, o, dir;
+
+    status = pjsua_create();
+    if (status != PJ_SUCCESS) {
+        return 1;
+    }
+    pjsua_config_default(&cfg);
+    pjsua_logging_config_default(&log_cfg);
+    log_cfg.level = 0;
+    log_cfg.console_level = 0;
+    status = pjsua_init(&cfg, &log_cfg, NULL);
+    if (status == PJ_SUCCESS) {
+        status = pj_nat64_enable_rewrite_module();
+    }
+    if (status != PJ_SUCCESS) {
+        pjsua_destroy();
+        return 1;
+    }
+    pj_nat64_set_resolver(&stub_getaddrinfo);
+    pool = pjsua_pool_create("bench", 16000, 4000);
+
+    printf("%-18s %-4s %6s  %-12s %10s %12s %12s\n", "message", "dir", "bytes", "options", "ns/msg", "copied/msg",
+           "pool/msg");
+    for (m = 0; m < PJ_ARRAY_SIZE(corpus); m++) {
+        for (dir = 0; dir < 2; dir++) {
+            char msg[PJSIP_MAX_PKT_LEN * 2];
+            pj_bool_t outgoing = dir == 0;
+            int msg_len = build_message(msg, sizeof(msg), &corpus[m], outgoing);
+
+            for (o = 0; o < PJ_ARRAY_SIZE(option_sets); o++) {
+                bench_result res;
+                pj_bzero(&res, sizeof(res));
+                pj_nat64_set_options((nat64_options)option_sets[o].options);
+                //Measure steady state, the first lookup for every address is not part of the numbers
+                pj_nat64_flush_cache();
+                if (outgoing) {
+                    bench_tx(pool, msg, msg_len, 1, &res);
+                } else {
+                    bench_rx(pool, msg, msg_len, 1, &res);
+                }
+                pj_bzero(&res, sizeof(res));
+
+                status = outgoing ? bench_tx(pool, msg, msg_len, iterations, &res) :
+                                    bench_rx(pool, msg, msg_len, iterations, &res);
+                if (status != PJ_SUCCESS) {
+                    printf("%-18s %-4s %6d  %-12s failed (%d)\n", corpus[m].name, outgoing ? "tx" : "rx", msg_len,
+                           option_sets[o].name, status);
+                    continue;
+                }
+                printf("%-18s %-4s %6d  %-12s %10lu %12lu %12lu\n", corpus[m].name, outgoing ? "tx" : "rx", msg_len,
+                       option_sets[o].name, (unsigned long)(res.nsec / iterations),
+                       (unsigned long)(res.bytes_copied / iterations), (unsigned long)(res.pool_bytes / iterations));
+            }
+        }
+    }
+
+    pj_pool_release(pool);
+    pj_nat64_disable_rewrite_module();
+    pjsua_destroy();
+    return 0;
+}
@@ -2,457 +2,4594 @@
 #include <pjsua-lib/pjsua_internal.h>
 #include "pj-nat64.h"
 
+/* Vectorized byte search for the rewrite hot path, set to 0 to only use the scalar search. */
+#ifndef NAT64_HAS_SIMD
+#   define NAT64_HAS_SIMD 1
+#endif
+
+#if NAT64_HAS_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#   include <immintrin.h>
+#   define NAT64_SIMD_X86 1
+#elif NAT64_HAS_SIMD && defined(__GNUC__) && defined(__aarch64__)
+#   include <arm_neon.h>
+#   define NAT64_SIMD_NEON 1
+#endif
+
 #define THIS_FILE "pj_nat64.c"
 
-static nat64_options module_options;
+//Module owned memory, created when the module is enabled
+static pj_pool_t* module_pool;
+
+/* Synthesis cache for resolve_or_synthesize_ipv4_to_ipv6. */
+#ifndef NAT64_CACHE_SIZE
+#   define NAT64_CACHE_SIZE                 32
+#endif
+#ifndef NAT64_CACHE_TTL_MSEC
+#   define NAT64_CACHE_TTL_MSEC             (300 * 1000)
+#endif
+#ifndef NAT64_CACHE_NEGATIVE_TTL_MSEC
+#   define NAT64_CACHE_NEGATIVE_TTL_MSEC    (30 * 1000)
+#endif
+
+typedef struct nat64_cache_entry {
+    char        key[PJ_MAX_HOSTNAME];
+    pj_size_t   key_len;
+    char        addr[PJ_INET6_ADDRSTRLEN];
+    pj_bool_t   negative;
+    pj_uint64_t expires_msec;
+    pj_uint64_t last_used;
+} nat64_cache_entry;
+
+static struct nat64_cache {
+    pj_mutex_t*         mutex;
+    nat64_cache_entry   entries[NAT64_CACHE_SIZE];
+    unsigned            count;
+    pj_uint64_t         use_counter;
+    pj_nat64_cache_stats stats;
+} synth_cache;
+
+/* Public ipv4 address each local ipv6 address is translated to by the NAT64, announced in outgoing sdp when no
+ * mapped address is configured. Learned from the Via of responses and optionally from a STUN server. */
+#ifndef NAT64_MAPPING_SIZE
+#   define NAT64_MAPPING_SIZE               8
+#endif
+#ifndef NAT64_MAPPING_TTL_MSEC
+#   define NAT64_MAPPING_TTL_MSEC           (600 * 1000)
+#endif
+#ifndef NAT64_STUN_REFRESH_MSEC
+#   define NAT64_STUN_REFRESH_MSEC          (120 * 1000)
+#endif
+#ifndef NAT64_STUN_TIMEOUT_MSEC
+#   define NAT64_STUN_TIMEOUT_MSEC          500
+#endif
+#define NAT64_STUN_ATTEMPTS                 3
+#define NAT64_STUN_DEFAULT_PORT             3478
+
+typedef struct nat64_mapping_entry {
+    pj_in6_addr local;
+    char        public_addr[PJ_INET_ADDRSTRLEN];
+    pj_uint64_t learned_msec;
+    pj_uint64_t expires_msec;
+} nat64_mapping_entry;
+
+static struct nat64_mapping_table {
+    pj_mutex_t*         mutex;
+    nat64_mapping_entry entries[NAT64_MAPPING_SIZE];
+    unsigned            count;
+    //host[:port] of the STUN server, empty when there is no background refresh
+    char                stun_server[PJ_MAX_HOSTNAME + 7];
+    pj_timer_entry      refresh_timer;
+    //Refresh timers scheduled or running their callback, the mutex must outlive them
+    unsigned            timer_armed;
+    //Latest received= of a REGISTER response per account while its configuration update is queued, so a burst of
+    //responses costs one update
+    char                mapped_addr[PJSUA_MAX_ACC][PJ_INET6_ADDRSTRLEN];
+    pj_bool_t           mapped_pending[PJSUA_MAX_ACC];
+} mapping_table;
+
+/* NAT64 prefix discovered with RFC 7050, used to synthesize ipv4 literals locally (RFC 6052). */
+typedef enum nat64_prefix_state {
+    NAT64_PREFIX_UNKNOWN,
+    NAT64_PREFIX_DISCOVERED,
+    NAT64_PREFIX_NONE
+} nat64_prefix_state;
+
+/* Rewrite policy applied to a message. The global policy comes from pj_nat64_set_options and
+ * pj_nat64_set_active_account, transport and account policies replace it for the messages on their transport. */
+typedef struct nat64_policy {
+    nat64_options       options;
+    //Address from the Via header of the account, empty if sdp nat rewrite is not allowed
+    pj_str_t            mapped_addr;
+    char                mapped_addr_buf[PJ_INET6_ADDRSTRLEN];
+    //Account whose registration refreshes mapped_addr, PJSUA_INVALID_ID for a fixed address
+    pjsua_acc_id        mapped_acc_id;
+    //Synthesis prefix configured for this policy, otherwise the discovered one is used
+    pj_bool_t           has_prefix;
+    pj_in6_addr         prefix;
+    unsigned            prefix_len;
+    //Version of the snapshot holding the policy, snapshots are reused so the address alone does not identify it
+    pj_uint32_t         version;
+} nat64_policy;
+
+//Policies by transport type, the ipv6 variants use the upper half
+#define NAT64_TRANSPORT_TYPES           32
+
+#ifndef NAT64_MAX_ACCOUNT_POLICIES
+#   define NAT64_MAX_ACCOUNT_POLICIES   16
+#endif
+//Open addressing index over the account policies, a power of two at least twice as large
+#define NAT64_POLICY_INDEX_SIZE         (NAT64_MAX_ACCOUNT_POLICIES * 2)
+
+typedef struct nat64_account_policy {
+    pjsua_acc_id        acc_id;
+    //Transport factory of the account, or the transport itself for udp
+    const void*         key;
+    nat64_policy        policy;
+} nat64_account_policy;
+
+#ifndef NAT64_MAX_PREWARM_HOSTS
+#   define NAT64_MAX_PREWARM_HOSTS      8
+#endif
+
+//Hosts pj_nat64_prewarm resolves, collected from pjsua_var in the context of the app
+typedef struct nat64_prewarm_hosts {
+    char                host[NAT64_MAX_PREWARM_HOSTS][PJ_MAX_HOSTNAME];
+    unsigned            count;
+} nat64_prewarm_hosts;
+
+/* Immutable configuration snapshot. Writers copy the active snapshot, change the copy and publish it with a single
+ * atomic pointer store. Readers take a reference once per message with config_acquire and never take a lock. The
+ * policies live inside the snapshot, so a retired snapshot is reused by a later update once no reader holds it. */
+typedef struct nat64_config {
+    nat64_policy        global;
+    pjsua_acc_id        acc_id;
+    nat64_prefix_state  prefix_state;
+    pj_in6_addr         prefix;
+    unsigned            prefix_len;
+    //Bit per entry of type_policy that holds a policy
+    pj_uint32_t         type_policy_set;
+    nat64_policy        type_policy[NAT64_TRANSPORT_TYPES];
+    nat64_account_policy acc_policy[NAT64_MAX_ACCOUNT_POLICIES];
+    unsigned            acc_policy_cnt;
+    //Index into acc_policy plus one, zero for an empty slot
+    pj_uint8_t          acc_policy_index[NAT64_POLICY_INDEX_SIZE];
+    //Options pj_nat64_set_auto_detect applies on ipv6 transports of a NAT64 network, 0 when detection is off
+    nat64_options       auto_options;
+    //The global policy with the options detection decided for ipv4 and ipv6 transports, rebuilt by every commit
+    nat64_policy        auto_policy[2];
+    nat64_prewarm_hosts prewarm_hosts;
+    //Bumped by every commit
+    pj_uint32_t         version;
+} nat64_config;
+
+//A snapshot with the number of readers holding it
+typedef struct nat64_config_slot {
+    nat64_config                cfg;
+    pj_uint32_t                 refs;
+    struct nat64_config_slot*   next_retired;
+} nat64_config_slot;
+
+//Used until the module is enabled, there are no readers before that
+static nat64_config_slot initial_config;
+static pj_bool_t initial_config_ready;
+static nat64_config_slot* active_config = &initial_config;
+//Whether a policy an ipv4 transport may get does anything, read without taking the snapshot
+static pj_bool_t config_ipv4_active;
+//Snapshots replaced by a later commit, reused once their readers are gone. Guarded by config_mutex.
+static nat64_config_slot* retired_configs;
+static pj_mutex_t* config_mutex;
+
+//All lookups go through this so a stub resolver can be plugged in
+static pj_nat64_getaddrinfo_cb resolver_cb = &pj_getaddrinfo;
+
+/* Runtime statistics. Counters are updated with relaxed atomics so the SIP threads never wait on each other. */
+#if defined(__GNUC__)
+#   define NAT64_ATOMIC_INC(var)        __atomic_fetch_add(&(var), 1, __ATOMIC_RELAXED)
+#   define NAT64_ATOMIC_DEC(var)        __atomic_fetch_sub(&(var), 1, __ATOMIC_RELEASE)
+#   define NAT64_ATOMIC_ADD(var, val)   __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#   define NAT64_ATOMIC_LOAD(var)       __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#   define NAT64_ATOMIC_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#   define NAT64_ATOMIC_ACQUIRE(var)    __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#   define NAT64_ATOMIC_RELEASE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#   define NAT64_ATOMIC_FENCE()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#   define NAT64_ATOMIC_INC(var)        ((var)++)
+#   define NAT64_ATOMIC_DEC(var)        ((var)--)
+#   define NAT64_ATOMIC_ADD(var, val)   ((var) += (val))
+#   define NAT64_ATOMIC_LOAD(var)       (var)
+#   define NAT64_ATOMIC_STORE(var, val) ((var) = (val))
+#   define NAT64_ATOMIC_ACQUIRE(var)    (var)
+#   define NAT64_ATOMIC_RELEASE(var, val) ((var) = (val))
+#   define NAT64_ATOMIC_FENCE()
+#endif
+
+static pj_nat64_stats module_stats;
+
+/* Trace ring of compact binary records, set NAT64_HAS_TRACE to 0 to compile it out. */
+#ifndef NAT64_HAS_TRACE
+#   define NAT64_HAS_TRACE                  1
+#endif
+//Must be a power of two
+#ifndef NAT64_TRACE_SIZE
+#   define NAT64_TRACE_SIZE                 256
+#endif
+
+#if NAT64_HAS_TRACE
+#   define NAT64_TRACE(expr)                expr
+#   define NAT64_TRACE_MSG_ID()             (NAT64_ATOMIC_INC(trace_ring.next_msg_id) + 1)
+
+/* Writers claim a slot with one atomic increment and publish the record by storing its position plus one in seq,
+ * a reader only keeps a copy if seq was the same before and after copying. */
+static struct nat64_trace_ring {
+    pj_uint32_t             head;
+    pj_uint32_t             next_msg_id;
+    struct {
+        pj_uint32_t             seq;
+        pj_nat64_trace_record   record;
+    } slot[NAT64_TRACE_SIZE];
+} trace_ring;
+#else
+#   define NAT64_TRACE(expr)
+#   define NAT64_TRACE_MSG_ID()             0
+#endif
+
+/* Background workers running blocking lookups off the SIP threads. */
+#ifndef NAT64_MAX_PENDING_JOBS
+#   define NAT64_MAX_PENDING_JOBS           32
+#endif
+#ifndef NAT64_WORKER_THREADS
+#   define NAT64_WORKER_THREADS             4
+#endif
+
+typedef void (*nat64_job_func)(void* arg);
+
+static struct nat64_worker {
+    pj_thread_t*    thread[NAT64_WORKER_THREADS];
+    unsigned        thread_cnt;
+    pj_sem_t*       sem;
+    pj_mutex_t*     mutex;
+    pj_bool_t       quit;
+    struct {
+        nat64_job_func  func;
+        void*           arg;
+    } jobs[NAT64_MAX_PENDING_JOBS];
+    unsigned        head;
+    unsigned        count;
+} worker;
+
+static pj_status_t worker_post(nat64_job_func func, void* arg);
+
+/* NAT64 prefix discovery runs one lookup at a time. mutex is held for the whole lookup so a concurrent caller waits
+ * for the running one and takes its result, pending is set while a background discovery is queued or running. */
+static struct nat64_prefix_discovery {
+    pj_mutex_t*     mutex;
+    pj_uint32_t     generation;
+    pj_bool_t       pending;
+} prefix_discovery;
+
+/* Happy Eyeballs (RFC 8305) connection race. */
+#ifndef NAT64_RACE_ATTEMPT_DELAY_MSEC
+#   define NAT64_RACE_ATTEMPT_DELAY_MSEC    250
+#endif
+#ifndef NAT64_RACE_TIMEOUT_MSEC
+#   define NAT64_RACE_TIMEOUT_MSEC          5000
+#endif
+
+//Longest replacement for one address, network and address type included
+#define REWRITE_MAX_REPLACEMENT (7 + PJ_INET6_ADDRSTRLEN)
+
+//One address to replace, offsets are relative to the start of the message
+typedef struct rewrite_site {
+    pj_size_t   start;
+    pj_size_t   end;
+    pj_size_t   text_len;
+    char        text[REWRITE_MAX_REPLACEMENT];
+} rewrite_site;
+
+typedef struct rewrite_sites {
+    pj_pool_t*      pool;
+    rewrite_site*   site;
+    unsigned        count;
+    unsigned        cap;
+} rewrite_sites;
+
+/* Per thread scratch arena of the rewrite engine. The replacements of a message are collected here first so the
+ * output can be allocated from the tdata/rdata pool once with its exact size, however large the message is. An
+ * arena lives as long as the module is enabled and only grows. */
+#define NAT64_SCRATCH_INITIAL_SITES 16
+
+typedef struct nat64_scratch {
+    rewrite_sites               sites;
+    //Lookup batches of the thread, one unless jobs of an earlier message were still queued for the next
+    struct nat64_lookup_batch*  batches;
+    //Set while a held back message is rewritten on the timer thread, which never waits for the resolver
+    pj_bool_t                   cache_only;
+    struct nat64_scratch*       next;
+} nat64_scratch;
+
+static struct nat64_scratch_list {
+    long            tls_id;
+    pj_mutex_t*     mutex;
+    nat64_scratch*  head;
+} scratch_arenas;
+
+static void lookup_batch_destroy(struct nat64_lookup_batch* batch);
+
+//Result of a message rewrite. Offsets are relative to buf.
+typedef struct rewrite_result {
+    char*       buf;
+    pj_size_t   len;
+    pj_size_t   cap;
+    pj_size_t   body_offset;
+    pj_size_t   body_len;
+    unsigned    replaced;
+} rewrite_result;
+
+/* Memo of recent incoming sdp rewrites. A retransmitted or forked response carrying the same sdp in the same
+ * transaction reuses the rewritten body instead of searching and resolving again. */
+#ifndef NAT64_RX_MEMO_SIZE
+#   define NAT64_RX_MEMO_SIZE               8
+#endif
+//Each entry has a pool of this size from the start, enough for a usual sdp body and its rewrite
+#ifndef NAT64_RX_MEMO_POOL_SIZE
+#   define NAT64_RX_MEMO_POOL_SIZE          4096
+#endif
+
+typedef struct nat64_rx_memo_entry {
+    //Owns the copies below, created when the module is enabled and reset when the entry is reused
+    pj_pool_t*          pool;
+    pj_bool_t           used;
+    const nat64_policy* policy;
+    pj_uint32_t         policy_version;
+    pj_str_t            call_id;
+    pj_int32_t          cseq;
+    pj_str_t            method;
+    pj_str_t            body;
+    //Empty if the body had nothing to rewrite
+    pj_str_t            rewritten;
+    unsigned            replaced;
+    pj_uint64_t         last_used;
+} nat64_rx_memo_entry;
+
+static struct nat64_rx_memo {
+    pj_mutex_t*         mutex;
+    nat64_rx_memo_entry entries[NAT64_RX_MEMO_SIZE];
+    pj_uint64_t         use_counter;
+} rx_memo;
+
+//Marks an outgoing message as handled, kept in the mod_data of the tdata
+typedef struct nat64_tx_memo {
+    const char*         buf;
+    const char*         info;
+} nat64_tx_memo;
+
+//Scratch arena of the calling thread, created the first time the thread rewrites a message. NULL if the module
+//is not enabled, the caller then collects the replacements in the message pool.
+static nat64_scratch* scratch_get()
+{
+    nat64_scratch* scratch;
+    pj_pool_t* pool;
+
+    if (scratch_arenas.mutex == NULL) {
+        return NULL;
+    }
+    scratch = (nat64_scratch*)pj_thread_local_get(scratch_arenas.tls_id);
+    if (scratch != NULL) {
+        return scratch;
+    }
+    pool = pjsua_pool_create("nat64scratch", 1024, 1024);
+    if (pool == NULL) {
+        return NULL;
+    }
+    scratch = PJ_POOL_ZALLOC_T(pool, nat64_scratch);
+    scratch->sites.pool = pool;
+    pj_mutex_lock(scratch_arenas.mutex);
+    scratch->next = scratch_arenas.head;
+    scratch_arenas.head = scratch;
+    pj_mutex_unlock(scratch_arenas.mutex);
+    pj_thread_local_set(scratch_arenas.tls_id, scratch);
+    return scratch;
+}
+
+static pj_status_t scratch_init()
+{
+    pj_status_t status = pj_thread_local_alloc(&scratch_arenas.tls_id);
+    if (status == PJ_SUCCESS) {
+        status = pj_mutex_create_simple(module_pool, "nat64scratch", &scratch_arenas.mutex);
+        if (status != PJ_SUCCESS) {
+            pj_thread_local_free(scratch_arenas.tls_id);
+        }
+    }
+    return status;
+}
+
+static void scratch_destroy()
+{
+    if (scratch_arenas.mutex == NULL) {
+        return;
+    }
+    while (scratch_arenas.head != NULL) {
+        nat64_scratch* scratch = scratch_arenas.head;
+        scratch_arenas.head = scratch->next;
+        lookup_batch_destroy(scratch->batches);
+        pj_pool_release(scratch->sites.pool);
+    }
+    pj_thread_local_free(scratch_arenas.tls_id);
+    pj_mutex_destroy(scratch_arenas.mutex);
+    scratch_arenas.mutex = NULL;
+}
+
+//Append a site, the array doubles when full. The old array stays in the pool, growth is rare once the arena has
+//seen the largest message.
+static rewrite_site* rewrite_sites_add(rewrite_sites* sites)
+{
+    if (sites->count == sites->cap) {
+        unsigned new_cap = sites->cap ? sites->cap * 2 : NAT64_SCRATCH_INITIAL_SITES;
+        rewrite_site* site = (rewrite_site*)pj_pool_alloc(sites->pool, new_cap * sizeof(rewrite_site));
+        if (sites->count > 0) {
+            pj_memcpy(site, sites->site, sites->count * sizeof(rewrite_site));
+        }
+        sites->site = site;
+        sites->cap = new_cap;
+    }
+    return &sites->site[sites->count++];
+}
+
+typedef const char* (*find_bytes_func)(const char* begin, const char* end, const char* needle, pj_size_t needle_len);
+
+//Returns the first occurrence of needle in [begin, end) or NULL
+static const char* find_bytes_scalar(const char* begin, const char* end, const char* needle, pj_size_t needle_len)
+{
+    const char* p = begin;
+    while (p + needle_len <= end) {
+        p = (const char*)memchr(p, needle[0], (end - p) - needle_len + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (pj_memcmp(p, needle, needle_len) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+//The vectorized versions compare a whole block against the first and the last byte of the needle at once and only
+//verify the positions where both match, the remainder shorter than a block is left to the scalar search.
+#if NAT64_SIMD_X86
+static const char* find_bytes_sse2(const char* begin, const char* end, const char* needle, pj_size_t needle_len)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    const char* p = begin;
+
+    while (p + needle_len - 1 + 16 <= end) {
+        __m128i eq_first = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i*)p));
+        __m128i eq_last = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i*)(p + needle_len - 1)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+        while (mask != 0) {
+            unsigned offset = (unsigned)__builtin_ctz(mask);
+            if (pj_memcmp(p + offset, needle, needle_len) == 0) {
+                return p + offset;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return find_bytes_scalar(p, end, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static const char* find_bytes_avx2(const char* begin, const char* end, const char* needle, pj_size_t needle_len)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    const char* p = begin;
+
+    while (p + needle_len - 1 + 32 <= end) {
+        __m256i eq_first = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)p));
+        __m256i eq_last = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i*)(p + needle_len - 1)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+        while (mask != 0) {
+            unsigned offset = (unsigned)__builtin_ctz(mask);
+            if (pj_memcmp(p + offset, needle, needle_len) == 0) {
+                return p + offset;
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return find_bytes_sse2(p, end, needle, needle_len);
+}
+#elif NAT64_SIMD_NEON
+static const char* find_bytes_neon(const char* begin, const char* end, const char* needle, pj_size_t needle_len)
+{
+    const uint8x16_t first = vdupq_n_u8((pj_uint8_t)needle[0]);
+    const uint8x16_t last = vdupq_n_u8((pj_uint8_t)needle[needle_len - 1]);
+    const char* p = begin;
+
+    while (p + needle_len - 1 + 16 <= end) {
+        uint8x16_t eq_first = vceqq_u8(first, vld1q_u8((const pj_uint8_t*)p));
+        uint8x16_t eq_last = vceqq_u8(last, vld1q_u8((const pj_uint8_t*)(p + needle_len - 1)));
+        uint8x16_t eq = vandq_u8(eq_first, eq_last);
+        if (vmaxvq_u8(eq) != 0) {
+            pj_uint8_t lanes[16];
+            unsigned offset;
+            vst1q_u8(lanes, eq);
+            for (offset = 0; offset < 16; offset++) {
+                if (lanes[offset] && pj_memcmp(p + offset, needle, needle_len) == 0) {
+                    return p + offset;
+                }
+            }
+        }
+        p += 16;
+    }
+    return find_bytes_scalar(p, end, needle, needle_len);
+}
+#endif
+
+static find_bytes_func find_bytes_impl;
+
+//Pick the widest search the cpu supports, done once
+static find_bytes_func select_find_bytes()
+{
+#if NAT64_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &find_bytes_avx2;
+    }
+    return &find_bytes_sse2;
+#elif NAT64_SIMD_NEON
+    return &find_bytes_neon;
+#else
+    return &find_bytes_scalar;
+#endif
+}
+
+static const char* find_bytes(const char* begin, const char* end, const char* needle, pj_size_t needle_len)
+{
+    if (find_bytes_impl == NULL) {
+        //Every thread computes the same value so a race here is harmless
+        find_bytes_impl = select_find_bytes();
+    }
+    if (needle_len == 0 || begin + needle_len > end) {
+        return needle_len == 0 ? begin : NULL;
+    }
+    return find_bytes_impl(begin, end, needle, needle_len);
+}
+
+//Locate the value of the Content-Length header (long or compact form) in the header section.
+//On success value_start points at the first char after the colon and whitespace and value_len covers
+//everything up to the end of the line (digits and any trailing padding).
+static pj_bool_t find_content_length_value(const char* hdr_start, const char* hdr_end,
+                                           const char** value_start, pj_size_t* value_len)
+{
+    const char* line = hdr_start;
+    while (line < hdr_end) {
+        const char* line_end = (const char*)memchr(line, '\n', hdr_end - line);
+        const char* p = NULL;
+        if (line_end == NULL) {
+            line_end = hdr_end;
+        }
+        if ((line_end - line) > 14 && pj_ansi_strnicmp(line, "Content-Length", 14) == 0) {
+            p = line + 14;
+        } else if ((line_end - line) > 1 && (line[0] == 'l' || line[0] == 'L') &&
+                   (line[1] == ':' || line[1] == ' ' || line[1] == '\t')) {
+            p = line + 1;
+        }
+        if (p != NULL) {
+            while (p < line_end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if (p < line_end && *p == ':') {
+                const char* v_end = line_end;
+                p++;
+                while (p < line_end && (*p == ' ' || *p == '\t')) {
+                    p++;
+                }
+                if (v_end > p && *(v_end - 1) == '\r') {
+                    v_end--;
+                }
+                *value_start = p;
+                *value_len = v_end - p;
+                return PJ_TRUE;
+            }
+        }
+        line = line_end + 1;
+    }
+    return PJ_FALSE;
+}
+
+//Take a reference on the active snapshot, it stays unchanged until config_release
+static const nat64_config* config_acquire()
+{
+    nat64_config_slot* slot;
+    for (;;) {
+        slot = NAT64_ATOMIC_ACQUIRE(active_config);
+        NAT64_ATOMIC_INC(slot->refs);
+        //Pairs with the fence in config_begin_update, either the writer sees the reference or we see that the
+        //snapshot was replaced
+        NAT64_ATOMIC_FENCE();
+        if (NAT64_ATOMIC_ACQUIRE(active_config) == slot) {
+            return &slot->cfg;
+        }
+        NAT64_ATOMIC_DEC(slot->refs);
+    }
+}
+
+static void config_release(const nat64_config* cfg)
+{
+    NAT64_ATOMIC_DEC(((nat64_config_slot*)cfg)->refs);
+}
+
+//Prefix state of the active snapshot
+static nat64_prefix_state config_prefix_state()
+{
+    const nat64_config* cfg = config_acquire();
+    nat64_prefix_state prefix_state = cfg->prefix_state;
+    config_release(cfg);
+    return prefix_state;
+}
+
+static pjsua_acc_id config_acc_id()
+{
+    const nat64_config* cfg = config_acquire();
+    pjsua_acc_id acc_id = cfg->acc_id;
+    config_release(cfg);
+    return acc_id;
+}
+
+//Defaults that are not zero, set before the first update or when the module is enabled
+static void config_init_defaults()
+{
+    if (!initial_config_ready) {
+        initial_config.cfg.acc_id = PJSUA_INVALID_ID;
+        initial_config.cfg.global.mapped_acc_id = PJSUA_INVALID_ID;
+        initial_config_ready = PJ_TRUE;
+    }
+}
+
+//Wait until no reader holds a snapshot, the caller made sure nobody takes a new reference
+static void config_wait_readers()
+{
+    nat64_config_slot* slot;
+    pj_bool_t busy;
+
+    for (;;) {
+        pj_mutex_lock(config_mutex);
+        busy = NAT64_ATOMIC_ACQUIRE(active_config->refs) != 0;
+        for (slot = retired_configs; slot != NULL && !busy; slot = slot->next_retired) {
+            busy = NAT64_ATOMIC_ACQUIRE(slot->refs) != 0;
+        }
+        pj_mutex_unlock(config_mutex);
+        if (!busy) {
+            return;
+        }
+        pj_thread_sleep(1);
+    }
+}
+
+//Point the mapped addresses of every policy at their own buffers after the snapshot was copied
+static void config_fix_mapped_addr(nat64_config* cfg)
+{
+    unsigned i;
+
+    cfg->global.mapped_addr.ptr = cfg->global.mapped_addr_buf;
+    for (i = 0; i < NAT64_TRANSPORT_TYPES; i++) {
+        cfg->type_policy[i].mapped_addr.ptr = cfg->type_policy[i].mapped_addr_buf;
+    }
+    for (i = 0; i < cfg->acc_policy_cnt; i++) {
+        cfg->acc_policy[i].policy.mapped_addr.ptr = cfg->acc_policy[i].policy.mapped_addr_buf;
+    }
+    cfg->auto_policy[0].mapped_addr.ptr = cfg->auto_policy[0].mapped_addr_buf;
+    cfg->auto_policy[1].mapped_addr.ptr = cfg->auto_policy[1].mapped_addr_buf;
+}
+
+//Start an update of the configuration, returns a private copy of the active snapshot. Must be followed by
+//config_commit. Writers are serialized, readers are never blocked.
+static nat64_config* config_begin_update()
+{
+    nat64_config_slot** link;
+    nat64_config_slot* slot = NULL;
+
+    if (config_mutex == NULL) {
+        //Module not enabled, nobody is reading
+        config_init_defaults();
+        return &initial_config.cfg;
+    }
+    pj_mutex_lock(config_mutex);
+    //Pairs with the fence in config_acquire, a reader that still sees a retired snapshot as active has its
+    //reference counted by now
+    NAT64_ATOMIC_FENCE();
+    for (link = &retired_configs; *link != NULL; link = &(*link)->next_retired) {
+        if (NAT64_ATOMIC_ACQUIRE((*link)->refs) == 0) {
+            slot = *link;
+            *link = slot->next_retired;
+            break;
+        }
+    }
+    if (slot == NULL) {
+        slot = PJ_POOL_ZALLOC_T(module_pool, nat64_config_slot);
+    }
+    slot->cfg = active_config->cfg;
+    config_fix_mapped_addr(&slot->cfg);
+    return &slot->cfg;
+}
+
+static unsigned policy_index_slot(const void* key)
+{
+    //Transports and factories are pool allocated, the low bits carry no information
+    return (unsigned)((((pj_size_t)key) >> 4) * 2654435761u) & (NAT64_POLICY_INDEX_SIZE - 1);
+}
+
+//A policy that rewrites something or follows the mapped address of an account
+static pj_bool_t policy_is_active(const nat64_policy* policy)
+{
+    return policy->options != 0 || policy->mapped_acc_id != PJSUA_INVALID_ID;
+}
+
+static void config_publish_ipv4_active(const nat64_config* cfg)
+{
+    pj_bool_t ipv4_active = cfg->auto_options == 0 && policy_is_active(&cfg->global);
+    unsigned i;
+
+    for (i = 0; i < NAT64_TRANSPORT_TYPES / 2; i++) {
+        ipv4_active |= (cfg->type_policy_set & (1u << i)) && policy_is_active(&cfg->type_policy[i]);
+    }
+    //Which family an account transport has is only known per message
+    for (i = 0; i < cfg->acc_policy_cnt; i++) {
+        ipv4_active |= policy_is_active(&cfg->acc_policy[i].policy);
+    }
+    NAT64_ATOMIC_STORE(config_ipv4_active, ipv4_active);
+}
+
+static void config_commit(nat64_config* cfg)
+{
+    nat64_config_slot* retired;
+    unsigned i;
+
+    pj_bzero(cfg->acc_policy_index, sizeof(cfg->acc_policy_index));
+    for (i = 0; i < cfg->acc_policy_cnt; i++) {
+        unsigned slot = policy_index_slot(cfg->acc_policy[i].key);
+        while (cfg->acc_policy_index[slot] != 0) {
+            slot = (slot + 1) & (NAT64_POLICY_INDEX_SIZE - 1);
+        }
+        cfg->acc_policy_index[slot] = (pj_uint8_t)(i + 1);
+    }
+    //The decision for ipv6 transports follows the prefix, which every discovery commits
+    for (i = 0; i < 2; i++) {
+        cfg->auto_policy[i] = cfg->global;
+        cfg->auto_policy[i].mapped_addr.ptr = cfg->auto_policy[i].mapped_addr_buf;
+    }
+    cfg->auto_policy[0].options = (nat64_options)0;
+    cfg->auto_policy[1].options = cfg->prefix_state == NAT64_PREFIX_DISCOVERED ? cfg->auto_options : (nat64_options)0;
+    cfg->version++;
+    cfg->global.version = cfg->version;
+    for (i = 0; i < NAT64_TRANSPORT_TYPES; i++) {
+        cfg->type_policy[i].version = cfg->version;
+    }
+    for (i = 0; i < cfg->acc_policy_cnt; i++) {
+        cfg->acc_policy[i].policy.version = cfg->version;
+    }
+    cfg->auto_policy[0].version = cfg->auto_policy[1].version = cfg->version;
+    config_publish_ipv4_active(cfg);
+    if (config_mutex == NULL) {
+        return;
+    }
+    retired = active_config;
+    NAT64_ATOMIC_RELEASE(active_config, (nat64_config_slot*)cfg);
+    retired->next_retired = retired_configs;
+    retired_configs = retired;
+    pj_mutex_unlock(config_mutex);
+}
+
+//Slot in type_policy, -1 for types outside the table
+static int transport_type_slot(int type)
+{
+    int base = type & ~PJSIP_TRANSPORT_IPV6;
+    if (base < 0 || base >= NAT64_TRANSPORT_TYPES / 2) {
+        return -1;
+    }
+    return base + ((type & PJSIP_TRANSPORT_IPV6) ? NAT64_TRANSPORT_TYPES / 2 : 0);
+}
+
+//Policy for a message sent or received on tp. Account policies are found through the factory of the transport,
+//or the transport itself for udp, then comes the policy of the transport type, the one detection decided for the
+//family of the transport and finally the global one.
+static const nat64_policy* policy_for_transport(const nat64_config* cfg, const pjsip_transport* tp)
+{
+    int type_slot;
+
+    if (tp == NULL) {
+        return &cfg->global;
+    }
+    if (cfg->acc_policy_cnt > 0) {
+        const void* key = tp->factory != NULL ? (const void*)tp->factory : (const void*)tp;
+        unsigned slot = policy_index_slot(key);
+        while (cfg->acc_policy_index[slot] != 0) {
+            const nat64_account_policy* entry = &cfg->acc_policy[cfg->acc_policy_index[slot] - 1];
+            if (entry->key == key) {
+                return &entry->policy;
+            }
+            slot = (slot + 1) & (NAT64_POLICY_INDEX_SIZE - 1);
+        }
+    }
+    type_slot = transport_type_slot(tp->key.type);
+    if (type_slot >= 0 && (cfg->type_policy_set & (1u << type_slot))) {
+        return &cfg->type_policy[type_slot];
+    }
+    if (cfg->auto_options != 0) {
+        return &cfg->auto_policy[(tp->key.type & PJSIP_TRANSPORT_IPV6) ? 1 : 0];
+    }
+    return &cfg->global;
+}
+
+//Bucket i holds durations below 2^i microseconds, the last bucket everything longer
+static void histogram_add(pj_nat64_histogram* histogram, const pj_timestamp* start)
+{
+    pj_timestamp end;
+    pj_uint32_t usec;
+    unsigned bucket = 0;
+
+    pj_get_timestamp(&end);
+    usec = pj_elapsed_usec(start, &end);
+    while (bucket < PJ_NAT64_HISTOGRAM_BUCKETS - 1 && usec >= (1u << bucket)) {
+        bucket++;
+    }
+    NAT64_ATOMIC_INC(histogram->count[bucket]);
+}
+
+#if NAT64_HAS_TRACE
+static void trace_add(const pj_nat64_trace_record* record)
+{
+    pj_uint32_t pos = NAT64_ATOMIC_INC(trace_ring.head);
+    pj_uint32_t* seq = &trace_ring.slot[pos & (NAT64_TRACE_SIZE - 1)].seq;
+
+    //Readers skip the slot while it is being written
+    NAT64_ATOMIC_STORE(*seq, 0);
+    NAT64_ATOMIC_FENCE();
+    trace_ring.slot[pos & (NAT64_TRACE_SIZE - 1)].record = *record;
+    NAT64_ATOMIC_RELEASE(*seq, pos + 1);
+}
+
+//Store an address in binary form, family stays 0 for anything but an ip literal
+static void trace_set_address(const pj_str_t* text, pj_uint8_t* family, pj_uint8_t* addr)
+{
+    if (text->slen > 0 && text->slen < PJ_INET6_ADDRSTRLEN) {
+        if (memchr(text->ptr, ':', text->slen) != NULL) {
+            if (pj_inet_pton(PJ_AF_INET6, text, addr) == PJ_SUCCESS) {
+                *family = 6;
+            }
+        } else if (pj_inet_pton(PJ_AF_INET, text, addr) == PJ_SUCCESS) {
+            *family = 4;
+        }
+    }
+}
+
+static void trace_address(pj_uint32_t msg_id, pj_bool_t outgoing, pj_uint32_t offset, const pj_str_t* old_addr,
+                          const char* new_addr, pj_size_t new_len)
+{
+    pj_nat64_trace_record record;
+    pj_timestamp now;
+    pj_str_t new_str;
+
+    pj_bzero(&record, sizeof(record));
+    pj_get_timestamp(&now);
+    record.msg_id = msg_id;
+    record.type = PJ_NAT64_TRACE_ADDRESS;
+    record.outgoing = (pj_uint8_t)outgoing;
+    record.offset = offset;
+    record.timestamp = now.u64;
+    trace_set_address(old_addr, &record.old_family, record.old_addr);
+    trace_set_address(pj_strset(&new_str, (char*)new_addr, new_len), &record.new_family, record.new_addr);
+    trace_add(&record);
+}
+
+static void trace_message(pj_uint32_t msg_id, pj_bool_t outgoing, pj_size_t len, unsigned replaced,
+                          const pj_timestamp* start)
+{
+    pj_nat64_trace_record record;
+    pj_timestamp now;
+
+    pj_bzero(&record, sizeof(record));
+    pj_get_timestamp(&now);
+    record.msg_id = msg_id;
+    record.type = PJ_NAT64_TRACE_MESSAGE;
+    record.outgoing = (pj_uint8_t)outgoing;
+    record.offset = (pj_uint32_t)len;
+    record.count = replaced;
+    record.usec = pj_elapsed_usec(start, &now);
+    record.timestamp = now.u64;
+    trace_add(&record);
+}
+
+static void trace_memo_hit(pj_uint32_t msg_id, pj_bool_t outgoing)
+{
+    pj_nat64_trace_record record;
+    pj_timestamp now;
+
+    pj_bzero(&record, sizeof(record));
+    pj_get_timestamp(&now);
+    record.msg_id = msg_id;
+    record.type = PJ_NAT64_TRACE_MEMO_HIT;
+    record.outgoing = (pj_uint8_t)outgoing;
+    record.timestamp = now.u64;
+    trace_add(&record);
+}
+#endif
+
+static pj_uint64_t now_msec()
+{
+    pj_time_val now;
+    pj_gettickcount(&now);
+    return (pj_uint64_t)PJ_TIME_VAL_MSEC(now);
+}
+
+//Look up host_or_ip in the synthesis cache. Returns PJ_TRUE on a valid hit, negative is set if the cached
+//result is a failed lookup in which case buf is left untouched.
+static pj_bool_t cache_lookup(const pj_str_t* host_or_ip, char* buf, int buf_len, pj_bool_t* negative)
+{
+    pj_bool_t found = PJ_FALSE;
+    pj_uint64_t now;
+    unsigned i;
+
+    if (synth_cache.mutex == NULL || host_or_ip->slen >= PJ_MAX_HOSTNAME) {
+        return PJ_FALSE;
+    }
+
+    now = now_msec();
+    pj_mutex_lock(synth_cache.mutex);
+    for (i = 0; i < synth_cache.count; i++) {
+        nat64_cache_entry* entry = &synth_cache.entries[i];
+        if (entry->key_len == (pj_size_t)host_or_ip->slen &&
+            pj_ansi_strnicmp(entry->key, host_or_ip->ptr, entry->key_len) == 0) {
+            if (entry->expires_msec <= now) {
+                //Expired, drop it by moving the last entry into its slot
+                synth_cache.entries[i] = synth_cache.entries[--synth_cache.count];
+                break;
+            }
+            entry->last_used = ++synth_cache.use_counter;
+            *negative = entry->negative;
+            if (!entry->negative) {
+                pj_ansi_snprintf(buf, buf_len, "%s", entry->addr);
+                synth_cache.stats.hits++;
+            } else {
+                synth_cache.stats.negative_hits++;
+            }
+            found = PJ_TRUE;
+            break;
+        }
+    }
+    if (!found) {
+        synth_cache.stats.misses++;
+    }
+    pj_mutex_unlock(synth_cache.mutex);
+    return found;
+}
+
+//Store a lookup result, addr is NULL for a failed lookup. The least recently used entry is evicted when full.
+static void cache_store(const pj_str_t* host_or_ip, const char* addr)
+{
+    nat64_cache_entry* entry = NULL;
+    unsigned i;
+
+    if (synth_cache.mutex == NULL || host_or_ip->slen >= PJ_MAX_HOSTNAME) {
+        return;
+    }
+
+    pj_mutex_lock(synth_cache.mutex);
+    for (i = 0; i < synth_cache.count; i++) {
+        if (synth_cache.entries[i].key_len == (pj_size_t)host_or_ip->slen &&
+            pj_ansi_strnicmp(synth_cache.entries[i].key, host_or_ip->ptr, host_or_ip->slen) == 0) {
+            //Another thread resolved the same host while we were waiting for the resolver
+            entry = &synth_cache.entries[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (synth_cache.count < NAT64_CACHE_SIZE) {
+            entry = &synth_cache.entries[synth_cache.count++];
+        } else {
+            entry = &synth_cache.entries[0];
+            for (i = 1; i < synth_cache.count; i++) {
+                if (synth_cache.entries[i].last_used < entry->last_used) {
+                    entry = &synth_cache.entries[i];
+                }
+            }
+            synth_cache.stats.evictions++;
+        }
+    }
+
+    pj_memcpy(entry->key, host_or_ip->ptr, host_or_ip->slen);
+    entry->key[host_or_ip->slen] = '\0';
+    entry->key_len = host_or_ip->slen;
+    entry->negative = (addr == NULL);
+    pj_ansi_snprintf(entry->addr, sizeof(entry->addr), "%s", addr ? addr : "");
+    entry->expires_msec = now_msec() + (addr ? NAT64_CACHE_TTL_MSEC : NAT64_CACHE_NEGATIVE_TTL_MSEC);
+    entry->last_used = ++synth_cache.use_counter;
+    pj_mutex_unlock(synth_cache.mutex);
+}
+
+//RFC 6052 section 2.2: the ipv4 address follows the prefix, skipping bits 64-71 which must be zero
+static void embed_ipv4_in_prefix(const pj_in6_addr* prefix, unsigned prefix_len, const pj_in_addr* ipv4,
+                                 pj_in6_addr* out)
+{
+    const pj_uint8_t* v4 = (const pj_uint8_t*)&ipv4->s_addr;
+    unsigned pos = prefix_len / 8;
+    unsigned i;
+
+    pj_bzero(out, sizeof(*out));
+    pj_memcpy(out->s6_addr, prefix->s6_addr, pos);
+    for (i = 0; i < 4; i++) {
+        if (pos == 8) {
+            pos++;
+        }
+        out->s6_addr[pos++] = v4[i];
+    }
+}
+
+static void extract_ipv4_from_prefix(const pj_in6_addr* addr, unsigned prefix_len, pj_in_addr* ipv4)
+{
+    pj_uint8_t* v4 = (pj_uint8_t*)&ipv4->s_addr;
+    unsigned pos = prefix_len / 8;
+    unsigned i;
+
+    for (i = 0; i < 4; i++) {
+        if (pos == 8) {
+            pos++;
+        }
+        v4[i] = addr->s6_addr[pos++];
+    }
+}
+
+//Find which of the RFC 6052 prefix lengths embeds one of the ipv4only.arpa well known addresses
+static pj_bool_t prefix_from_ipv4only_answer(const pj_in6_addr* addr, pj_in6_addr* prefix, unsigned* prefix_len)
+{
+    static const unsigned prefix_lengths[] = { 96, 64, 56, 48, 40, 32 };
+    unsigned i;
+
+    for (i = 0; i < PJ_ARRAY_SIZE(prefix_lengths); i++) {
+        pj_in_addr ipv4;
+        const pj_uint8_t* v4 = (const pj_uint8_t*)&ipv4.s_addr;
+        extract_ipv4_from_prefix(addr, prefix_lengths[i], &ipv4);
+        //192.0.0.170 and 192.0.0.171
+        if (v4[0] == 192 && v4[1] == 0 && v4[2] == 0 && (v4[3] == 170 || v4[3] == 171) &&
+            (prefix_lengths[i] == 96 || addr->s6_addr[8] == 0)) {
+            pj_bzero(prefix, sizeof(*prefix));
+            pj_memcpy(prefix->s6_addr, addr->s6_addr, prefix_lengths[i] / 8);
+            *prefix_len = prefix_lengths[i];
+            return PJ_TRUE;
+        }
+    }
+    return PJ_FALSE;
+}
+
+//Resolve ipv4only.arpa and commit the prefix it embeds, or that the network has none
+static pj_status_t prefix_lookup()
+{
+    pj_str_t ipv4only = pj_str("ipv4only.arpa");
+    pj_addrinfo ai[4];
+    unsigned count = PJ_ARRAY_SIZE(ai);
+    unsigned i;
+    nat64_config* cfg;
+
+    if (resolver_cb(PJ_AF_INET6, &ipv4only, &count, ai) != PJ_SUCCESS) {
+        count = 0;
+    }
+    for (i = 0; i < count; i++) {
+        pj_in6_addr prefix;
+        unsigned prefix_len;
+        if (ai[i].ai_addr.addr.sa_family == PJ_AF_INET6 &&
+            prefix_from_ipv4only_answer(&ai[i].ai_addr.ipv6.sin6_addr, &prefix, &prefix_len)) {
+            char prefix_buf[PJ_INET6_ADDRSTRLEN];
+            cfg = config_begin_update();
+            cfg->prefix = prefix;
+            cfg->prefix_len = prefix_len;
+            cfg->prefix_state = NAT64_PREFIX_DISCOVERED;
+            config_commit(cfg);
+            pj_inet_ntop(PJ_AF_INET6, &prefix, prefix_buf, sizeof(prefix_buf));
+            PJ_LOG(4, (THIS_FILE, "Discovered NAT64 prefix %s/%u", prefix_buf, prefix_len));
+            return PJ_SUCCESS;
+        }
+    }
+
+    PJ_LOG(4, (THIS_FILE, "No NAT64 prefix found, ipv4 literals will be synthesized by the resolver"));
+    cfg = config_begin_update();
+    cfg->prefix_state = NAT64_PREFIX_NONE;
+    config_commit(cfg);
+    return PJ_ENOTFOUND;
+}
+
+//Single flight discovery. A caller that had to wait for a discovery started before it takes that result, with
+//only_if_unknown the lookup is also skipped when the prefix is already known.
+static pj_status_t prefix_discover(pj_bool_t only_if_unknown)
+{
+    pj_uint32_t generation = NAT64_ATOMIC_LOAD(prefix_discovery.generation);
+    nat64_prefix_state prefix_state;
+    pj_status_t status;
+
+    if (prefix_discovery.mutex != NULL) {
+        pj_mutex_lock(prefix_discovery.mutex);
+    }
+    prefix_state = config_prefix_state();
+    if (generation != NAT64_ATOMIC_LOAD(prefix_discovery.generation) ||
+        (only_if_unknown && prefix_state != NAT64_PREFIX_UNKNOWN)) {
+        status = prefix_state == NAT64_PREFIX_DISCOVERED ? PJ_SUCCESS : PJ_ENOTFOUND;
+    } else {
+        status = prefix_lookup();
+        NAT64_ATOMIC_STORE(prefix_discovery.generation, generation + 1);
+    }
+    if (prefix_discovery.mutex != NULL) {
+        pj_mutex_unlock(prefix_discovery.mutex);
+    }
+    return status;
+}
+
+static void prewarm_if_active();
+
+//Runs on a background worker. With detection on, a prefix found here turns rewriting on for ipv6 transports.
+static void prefix_discovery_job(void* arg)
+{
+    const nat64_config* cfg;
+    pj_bool_t detected;
+
+    PJ_UNUSED_ARG(arg);
+    if (prefix_discover(PJ_TRUE) == PJ_SUCCESS) {
+        cfg = config_acquire();
+        detected = cfg->auto_policy[1].options != 0;
+        config_release(cfg);
+        if (detected) {
+            PJ_LOG(4, (THIS_FILE, "NAT64 prefix found, rewriting on for ipv6 transports"));
+            prewarm_if_active();
+        }
+    }
+    NAT64_ATOMIC_STORE(prefix_discovery.pending, PJ_FALSE);
+}
+
+//Start discovery on a background worker if the prefix is unknown, the caller never waits for the lookup
+static void prefix_discovery_start()
+{
+    if (config_prefix_state() != NAT64_PREFIX_UNKNOWN || worker.thread_cnt == 0 ||
+        NAT64_ATOMIC_LOAD(prefix_discovery.pending)) {
+        return;
+    }
+    NAT64_ATOMIC_STORE(prefix_discovery.pending, PJ_TRUE);
+    if (worker_post(&prefix_discovery_job, NULL) != PJ_SUCCESS) {
+        NAT64_ATOMIC_STORE(prefix_discovery.pending, PJ_FALSE);
+    }
+}
+
+//Synthesize locally if host_or_ip is an ipv4 literal and we know the prefix, either from the policy or discovered.
+//The first time it is needed after the module was enabled or the cache was flushed, discovery is started in the
+//background and the resolver answers until the prefix is known.
+static pj_bool_t synthesize_from_prefix(const nat64_policy* policy, const pj_str_t* host_or_ip, char* buf,
+                                        int buf_len)
+{
+    pj_in_addr ipv4;
+    pj_in6_addr ipv6;
+    const nat64_config* cfg;
+    nat64_prefix_state prefix_state;
+
+    if (pj_inet_pton(PJ_AF_INET, host_or_ip, &ipv4) != PJ_SUCCESS) {
+        return PJ_FALSE;
+    }
+    if (policy->has_prefix) {
+        embed_ipv4_in_prefix(&policy->prefix, policy->prefix_len, &ipv4, &ipv6);
+        return pj_inet_ntop(PJ_AF_INET6, &ipv6, buf, buf_len) == PJ_SUCCESS;
+    }
+    cfg = config_acquire();
+    prefix_state = cfg->prefix_state;
+    if (prefix_state == NAT64_PREFIX_DISCOVERED) {
+        embed_ipv4_in_prefix(&cfg->prefix, cfg->prefix_len, &ipv4, &ipv6);
+    }
+    config_release(cfg);
+    if (prefix_state == NAT64_PREFIX_UNKNOWN) {
+        prefix_discovery_start();
+    }
+    if (prefix_state != NAT64_PREFIX_DISCOVERED) {
+        return PJ_FALSE;
+    }
+    return pj_inet_ntop(PJ_AF_INET6, &ipv6, buf, buf_len) == PJ_SUCCESS;
+}
+
+//Synthesize locally or answer from the cache, returns PJ_FALSE if the resolver is needed
+static pj_bool_t synthesize_or_lookup_cache(const nat64_policy* policy, const pj_str_t* host_or_ip, char* buf,
+                                            int buf_len)
+{
+    pj_bool_t negative = PJ_FALSE;
+
+    if (synthesize_from_prefix(policy, host_or_ip, buf, buf_len)) {
+        NAT64_ATOMIC_INC(module_stats.local_syntheses);
+        return PJ_TRUE;
+    }
+    if (cache_lookup(host_or_ip, buf, buf_len, &negative)) {
+        if (negative) {
+            pj_ansi_snprintf(buf, buf_len, "%.*s", (int)host_or_ip->slen, host_or_ip->ptr);
+        }
+        return PJ_TRUE;
+    }
+    return PJ_FALSE;
+}
+
+//Ask the resolver and cache the answer, buf gets the original input if there is none
+static void resolve_with_resolver(const pj_str_t* host_or_ip, char* buf, int buf_len)
+{
+    unsigned int count = 1;
+    pj_addrinfo ai[1];
+    pj_timestamp start;
+
+    pj_get_timestamp(&start);
+    NAT64_ATOMIC_INC(module_stats.resolver_calls);
+    if (resolver_cb(PJ_AF_UNSPEC, host_or_ip, &count, ai) != PJ_SUCCESS) {
+        count = 0;
+    }
+    histogram_add(&module_stats.resolve_usec, &start);
+
+    if (count > 0) {
+        if (ai[0].ai_addr.addr.sa_family == PJ_AF_INET) {
+            pj_inet_ntop(PJ_AF_INET, &ai[0].ai_addr.ipv4.sin_addr, buf, buf_len);
+            cache_store(host_or_ip, buf);
+        } else if (ai[0].ai_addr.addr.sa_family == PJ_AF_INET6) {
+            pj_inet_ntop(PJ_AF_INET6, &ai[0].ai_addr.ipv6.sin6_addr, buf, buf_len);
+            cache_store(host_or_ip, buf);
+        } else {
+            PJ_LOG(1, (THIS_FILE, "Error: Unknown AF %d use original input", ai[0].ai_addr.addr.sa_family));
+            pj_ansi_snprintf(buf, buf_len, "%.*s", (int)host_or_ip->slen, host_or_ip->ptr);
+        }
+    } else {
+        PJ_LOG(1, (THIS_FILE, "Error: Synthesizing media ip failed, ai count = 0. Use original input"));
+        pj_ansi_snprintf(buf, buf_len, "%.*s", (int)host_or_ip->slen, host_or_ip->ptr);
+        NAT64_ATOMIC_INC(module_stats.resolver_failures);
+        cache_store(host_or_ip, NULL);
+    }
+}
+
+//Helper that will resolve or synthesize to ipv6. Output buffer will be null terminated
+static void resolve_or_synthesize_ipv4_to_ipv6(const nat64_policy* policy, pj_str_t* host_or_ip, char* buf,
+                                               int buf_len)
+{
+    nat64_scratch* scratch;
+
+    if (synthesize_or_lookup_cache(policy, host_or_ip, buf, buf_len)) {
+        return;
+    }
+    scratch = scratch_get();
+    if (scratch != NULL && scratch->cache_only) {
+        PJ_LOG(4, (THIS_FILE, "%.*s was not resolved while the message was held back, keep it", (int)host_or_ip->slen,
+                   host_or_ip->ptr));
+        pj_ansi_snprintf(buf, buf_len, "%.*s", (int)host_or_ip->slen, host_or_ip->ptr);
+        return;
+    }
+    resolve_with_resolver(host_or_ip, buf, buf_len);
+}
+
+/* Concurrent lookups of the hosts one message needs. The caller and the background workers take pending lookups
+ * from the batch, the caller only waits for lookups that are already running so it never depends on a free worker.
+ * The answers go to the synthesis cache where the rewrite picks them up. Batches are kept in the scratch arena of the
+ * thread and reused, a message does not create a pool, mutex and semaphore of its own. */
+#ifndef NAT64_MAX_BATCH_HOSTS
+#   define NAT64_MAX_BATCH_HOSTS            16
+#endif
+
+typedef enum nat64_lookup_state {
+    NAT64_LOOKUP_PENDING,
+    NAT64_LOOKUP_RUNNING,
+    NAT64_LOOKUP_DONE
+} nat64_lookup_state;
+
+typedef struct nat64_lookup {
+    struct nat64_lookup_batch*  batch;
+    pj_str_t                    host;
+    nat64_lookup_state          state;
+} nat64_lookup;
+
+typedef struct nat64_lookup_batch {
+    pj_mutex_t*     mutex;
+    pj_sem_t*       sem;
+    //Held by the caller and by every queued job, 0 when the batch is free for the next message of the thread
+    unsigned        ref;
+    unsigned        remaining;
+    pj_bool_t       waiting;
+    unsigned        count;
+    nat64_lookup    lookup[NAT64_MAX_BATCH_HOSTS];
+    struct nat64_lookup_batch* next;
+} nat64_lookup_batch;
+
+//Distinct hosts of a message that need the resolver
+typedef struct nat64_host_set {
+    pj_str_t        host[NAT64_MAX_BATCH_HOSTS];
+    unsigned        count;
+    //An ipv4 literal needs the NAT64 prefix which has not been discovered yet
+    pj_bool_t       discover_prefix;
+} nat64_host_set;
+
+//Like cache_lookup but without touching the statistics or the entry
+static pj_bool_t cache_contains(const pj_str_t* host_or_ip)
+{
+    pj_uint64_t now = now_msec();
+    pj_bool_t found = PJ_FALSE;
+    unsigned i;
+
+    if (synth_cache.mutex == NULL || host_or_ip->slen >= PJ_MAX_HOSTNAME) {
+        return PJ_FALSE;
+    }
+    pj_mutex_lock(synth_cache.mutex);
+    for (i = 0; i < synth_cache.count && !found; i++) {
+        const nat64_cache_entry* entry = &synth_cache.entries[i];
+        found = entry->key_len == (pj_size_t)host_or_ip->slen && entry->expires_msec > now &&
+                pj_ansi_strnicmp(entry->key, host_or_ip->ptr, entry->key_len) == 0;
+    }
+    pj_mutex_unlock(synth_cache.mutex);
+    return found;
+}
+
+//Add host unless it is already in the set or can be answered without the resolver
+static void host_set_add(const nat64_policy* policy, nat64_host_set* set, const pj_str_t* host)
+{
+    pj_in_addr ipv4;
+    unsigned i;
+
+    if (host->slen == 0 || set->count == NAT64_MAX_BATCH_HOSTS) {
+        return;
+    }
+    if (pj_inet_pton(PJ_AF_INET, host, &ipv4) == PJ_SUCCESS) {
+        nat64_prefix_state prefix_state = config_prefix_state();
+        if (policy->has_prefix || prefix_state == NAT64_PREFIX_DISCOVERED) {
+            return;
+        }
+        //Synthesized locally once the prefix is known, this message still goes to the resolver with the others
+        if (prefix_state == NAT64_PREFIX_UNKNOWN) {
+            set->discover_prefix = PJ_TRUE;
+        }
+    }
+    for (i = 0; i < set->count; i++) {
+        if (pj_stricmp(&set->host[i], host) == 0) {
+            return;
+        }
+    }
+    if (!cache_contains(host)) {
+        set->host[set->count++] = *host;
+    }
+}
+
+static void lookup_batch_release(nat64_lookup_batch* batch)
+{
+    pj_mutex_lock(batch->mutex);
+    batch->ref--;
+    pj_mutex_unlock(batch->mutex);
+}
+
+//Called once the workers are stopped and no job refers to the batches any more
+static void lookup_batch_destroy(nat64_lookup_batch* batches)
+{
+    while (batches != NULL) {
+        pj_sem_destroy(batches->sem);
+        pj_mutex_destroy(batches->mutex);
+        batches = batches->next;
+    }
+}
+
+//Run a pending lookup, the batch mutex is held on entry and on return
+static void lookup_run(nat64_lookup* lookup)
+{
+    nat64_lookup_batch* batch = lookup->batch;
+    char buf[PJ_INET6_ADDRSTRLEN];
+
+    lookup->state = NAT64_LOOKUP_RUNNING;
+    pj_mutex_unlock(batch->mutex);
+    resolve_with_resolver(&lookup->host, buf, sizeof(buf));
+    pj_mutex_lock(batch->mutex);
+    lookup->state = NAT64_LOOKUP_DONE;
+    batch->remaining--;
+    if (batch->waiting) {
+        batch->waiting = PJ_FALSE;
+        pj_sem_post(batch->sem);
+    }
+}
+
+static void lookup_job(void* arg)
+{
+    nat64_lookup* lookup = (nat64_lookup*)arg;
+    nat64_lookup_batch* batch = lookup->batch;
+
+    pj_mutex_lock(batch->mutex);
+    //The caller may have taken it already
+    if (lookup->state == NAT64_LOOKUP_PENDING) {
+        lookup_run(lookup);
+    }
+    pj_mutex_unlock(batch->mutex);
+    lookup_batch_release(batch);
+}
+
+//Fill a free batch of the calling thread with the hosts of set. A batch is free once the jobs of its last message
+//are done, a new one is only added while they are still queued. NULL if the module is not enabled.
+static nat64_lookup_batch* lookup_batch_acquire(const nat64_host_set* set)
+{
+    nat64_scratch* scratch = scratch_get();
+    nat64_lookup_batch* batch;
+    unsigned i;
+
+    if (scratch == NULL) {
+        return NULL;
+    }
+    for (batch = scratch->batches; batch != NULL; batch = batch->next) {
+        pj_mutex_lock(batch->mutex);
+        if (batch->ref == 0) {
+            break;
+        }
+        pj_mutex_unlock(batch->mutex);
+    }
+    if (batch == NULL) {
+        batch = PJ_POOL_ZALLOC_T(scratch->sites.pool, nat64_lookup_batch);
+        if (pj_mutex_create_simple(scratch->sites.pool, "nat64batch", &batch->mutex) != PJ_SUCCESS) {
+            return NULL;
+        }
+        if (pj_sem_create(scratch->sites.pool, "nat64batch", 0, NAT64_MAX_BATCH_HOSTS, &batch->sem) != PJ_SUCCESS) {
+            pj_mutex_destroy(batch->mutex);
+            return NULL;
+        }
+        batch->next = scratch->batches;
+        scratch->batches = batch;
+        pj_mutex_lock(batch->mutex);
+    }
+    batch->ref = 1;
+    batch->waiting = PJ_FALSE;
+    batch->count = batch->remaining = set->count;
+    for (i = 0; i < set->count; i++) {
+        batch->lookup[i].batch = batch;
+        batch->lookup[i].host = set->host[i];
+        batch->lookup[i].state = NAT64_LOOKUP_PENDING;
+    }
+    pj_mutex_unlock(batch->mutex);
+    return batch;
+}
+
+//Resolve every host of the set at the same time, returns when all answers are in the cache. A message then costs
+//one lookup round trip however many lines it has.
+static void resolve_host_set(const nat64_host_set* set)
+{
+    nat64_lookup_batch* batch = NULL;
+    char buf[PJ_INET6_ADDRSTRLEN];
+    unsigned i;
+
+    if (set->discover_prefix) {
+        prefix_discovery_start();
+    }
+    if (set->count > 1 && worker.thread_cnt > 0) {
+        batch = lookup_batch_acquire(set);
+    }
+    if (batch == NULL) {
+        for (i = 0; i < set->count; i++) {
+            resolve_with_resolver(&set->host[i], buf, sizeof(buf));
+        }
+        return;
+    }
+
+    //The caller runs the first lookup itself
+    for (i = 1; i < batch->count; i++) {
+        pj_mutex_lock(batch->mutex);
+        batch->ref++;
+        pj_mutex_unlock(batch->mutex);
+        if (worker_post(&lookup_job, &batch->lookup[i]) != PJ_SUCCESS) {
+            //Queue full, the caller picks it up below
+            pj_mutex_lock(batch->mutex);
+            batch->ref--;
+            pj_mutex_unlock(batch->mutex);
+        }
+    }
+    pj_mutex_lock(batch->mutex);
+    while (batch->remaining > 0) {
+        nat64_lookup* pending = NULL;
+        for (i = 0; i < batch->count && pending == NULL; i++) {
+            if (batch->lookup[i].state == NAT64_LOOKUP_PENDING) {
+                pending = &batch->lookup[i];
+            }
+        }
+        if (pending != NULL) {
+            lookup_run(pending);
+            continue;
+        }
+        batch->waiting = PJ_TRUE;
+        pj_mutex_unlock(batch->mutex);
+        pj_sem_wait(batch->sem);
+        pj_mutex_lock(batch->mutex);
+    }
+    pj_mutex_unlock(batch->mutex);
+    lookup_batch_release(batch);
+}
+
+//Remember that the NAT64 translates local to public, source names where it was learned for the log
+static void mapping_learn(const pj_in6_addr* local, const pj_in_addr* public_addr, const char* source)
+{
+    nat64_mapping_entry* entry = NULL;
+    char public_buf[PJ_INET_ADDRSTRLEN];
+    pj_uint64_t now;
+    unsigned i;
+
+    if (mapping_table.mutex == NULL ||
+        pj_inet_ntop(PJ_AF_INET, public_addr, public_buf, sizeof(public_buf)) != PJ_SUCCESS) {
+        return;
+    }
+    now = now_msec();
+    pj_mutex_lock(mapping_table.mutex);
+    for (i = 0; i < mapping_table.count; i++) {
+        if (pj_memcmp(&mapping_table.entries[i].local, local, sizeof(*local)) == 0) {
+            entry = &mapping_table.entries[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (mapping_table.count < NAT64_MAPPING_SIZE) {
+            entry = &mapping_table.entries[mapping_table.count++];
+        } else {
+            entry = &mapping_table.entries[0];
+            for (i = 1; i < mapping_table.count; i++) {
+                if (mapping_table.entries[i].learned_msec < entry->learned_msec) {
+                    entry = &mapping_table.entries[i];
+                }
+            }
+        }
+        entry->local = *local;
+        entry->public_addr[0] = '\0';
+    }
+    if (pj_ansi_strcmp(entry->public_addr, public_buf) != 0) {
+        char local_buf[PJ_INET6_ADDRSTRLEN];
+        pj_inet_ntop(PJ_AF_INET6, local, local_buf, sizeof(local_buf));
+        PJ_LOG(4, (THIS_FILE, "Learned public address %s for %s from %s", public_buf, local_buf, source));
+        pj_ansi_snprintf(entry->public_addr, sizeof(entry->public_addr), "%s", public_buf);
+    }
+    entry->learned_msec = now;
+    entry->expires_msec = now + NAT64_MAPPING_TTL_MSEC;
+    pj_mutex_unlock(mapping_table.mutex);
+}
+
+//Public address of local_addr. Without an entry for it the most recent one is used, the NAT64 normally translates
+//all addresses of the device to the same public address.
+static pj_bool_t mapping_lookup(const pj_str_t* local_addr, char* buf, int buf_len)
+{
+    const nat64_mapping_entry* found = NULL;
+    pj_in6_addr local;
+    pj_bool_t is_ipv6;
+    pj_uint64_t now;
+    unsigned i = 0;
+
+    if (mapping_table.mutex == NULL || NAT64_ATOMIC_LOAD(mapping_table.count) == 0) {
+        return PJ_FALSE;
+    }
+    is_ipv6 = pj_inet_pton(PJ_AF_INET6, local_addr, &local) == PJ_SUCCESS;
+    now = now_msec();
+    pj_mutex_lock(mapping_table.mutex);
+    while (i < mapping_table.count) {
+        const nat64_mapping_entry* entry = &mapping_table.entries[i];
+        if (entry->expires_msec <= now) {
+            mapping_table.entries[i] = mapping_table.entries[--mapping_table.count];
+            continue;
+        }
+        if (is_ipv6 && pj_memcmp(&entry->local, &local, sizeof(local)) == 0) {
+            found = entry;
+            break;
+        }
+        if (found == NULL || entry->learned_msec > found->learned_msec) {
+            found = entry;
+        }
+        i++;
+    }
+    if (found != NULL) {
+        pj_ansi_snprintf(buf, buf_len, "%s", found->public_addr);
+    }
+    pj_mutex_unlock(mapping_table.mutex);
+    return found != NULL;
+}
+
+//A response carries the address the server saw our request come from in received= of the top Via. When the Via
+//was sent from an ipv6 address and the server saw ipv4, that is what the NAT64 translated us to. Registrations
+//refresh it with every REGISTER response.
+static void mapping_learn_from_via(const pjsip_rx_data* rdata)
+{
+    const pjsip_via_hdr* via = rdata->msg_info.via;
+    const pj_str_t* local_host;
+    pj_in6_addr local;
+    pj_in_addr public_addr;
+
+    if (via == NULL || via->recvd_param.slen == 0 ||
+        pj_inet_pton(PJ_AF_INET, &via->recvd_param, &public_addr) != PJ_SUCCESS) {
+        return;
+    }
+    //pjsip puts the published name of the transport in the Via, which may be a hostname
+    local_host = &via->sent_by.host;
+    if (pj_inet_pton(PJ_AF_INET6, local_host, &local) != PJ_SUCCESS) {
+        //Without the transport there is no local address to pair the public one with
+        if (rdata->tp_info.transport == NULL) {
+            return;
+        }
+        local_host = &rdata->tp_info.transport->local_name.host;
+        if (pj_inet_pton(PJ_AF_INET6, local_host, &local) != PJ_SUCCESS) {
+            return;
+        }
+    }
+    mapping_learn(&local, &public_addr, "Via");
+}
+
+//Set the mapped address of policy if it takes it from account acc_id
+static void policy_set_mapped_addr(nat64_policy* policy, pjsua_acc_id acc_id, const pj_str_t* addr)
+{
+    if (policy->mapped_acc_id == acc_id) {
+        pj_memcpy(policy->mapped_addr_buf, addr->ptr, addr->slen);
+        policy->mapped_addr.slen = addr->slen;
+    }
+}
+
+//Publish the latest received= of account acc_id in every policy that takes its mapped address from the account.
+//An address recorded while the update was running is published by the next round.
+static void mapped_addr_update(pjsua_acc_id acc_id)
+{
+    char addr_buf[PJ_INET6_ADDRSTRLEN];
+    pj_bool_t done;
+    pj_str_t addr;
+    nat64_config* cfg;
+    unsigned i;
+
+    do {
+        cfg = config_begin_update();
+        pj_mutex_lock(mapping_table.mutex);
+        pj_ansi_snprintf(addr_buf, sizeof(addr_buf), "%s", mapping_table.mapped_addr[acc_id]);
+        pj_mutex_unlock(mapping_table.mutex);
+        addr = pj_str(addr_buf);
+        //The policies of detection are rebuilt from the global policy by the commit
+        policy_set_mapped_addr(&cfg->global, acc_id, &addr);
+        for (i = 0; i < NAT64_TRANSPORT_TYPES; i++) {
+            policy_set_mapped_addr(&cfg->type_policy[i], acc_id, &addr);
+        }
+        for (i = 0; i < cfg->acc_policy_cnt; i++) {
+            policy_set_mapped_addr(&cfg->acc_policy[i].policy, acc_id, &addr);
+        }
+        config_commit(cfg);
+        PJ_LOG(4, (THIS_FILE, "Mapped address of account %d is now %s", acc_id, addr_buf));
+        pj_mutex_lock(mapping_table.mutex);
+        done = pj_ansi_strcmp(mapping_table.mapped_addr[acc_id], addr_buf) == 0;
+        mapping_table.mapped_pending[acc_id] = !done;
+        pj_mutex_unlock(mapping_table.mutex);
+    } while (!done);
+}
+
+//Runs on a background worker
+static void mapped_addr_job(void* arg)
+{
+    mapped_addr_update((pjsua_acc_id)(pj_ssize_t)arg);
+}
+
+//pjsua takes the mapped address of an account from received= of its REGISTER response, do the same for the copy in
+//the snapshot so an app that set the account before it registered still gets the address. The SIP thread only
+//records the address, at most one configuration update per account is queued on the workers at a time.
+static void policy_refresh_mapped_addr(const nat64_policy* policy, const pjsip_rx_data* rdata)
+{
+    const pjsip_via_hdr* via = rdata->msg_info.via;
+    pjsua_acc_id acc_id = policy->mapped_acc_id;
+    const nat64_config* cfg;
+    pj_bool_t queue;
+
+    if (acc_id < 0 || acc_id >= PJSUA_MAX_ACC || mapping_table.mutex == NULL || via == NULL ||
+        via->recvd_param.slen == 0 || via->recvd_param.slen >= (pj_ssize_t)sizeof(policy->mapped_addr_buf) ||
+        pj_strcmp(&policy->mapped_addr, &via->recvd_param) == 0) {
+        return;
+    }
+    pj_mutex_lock(mapping_table.mutex);
+    queue = !mapping_table.mapped_pending[acc_id];
+    if (queue) {
+        //Nothing queued, the update before may have published the address since our snapshot was taken
+        cfg = config_acquire();
+        queue = pj_strcmp(&policy_for_transport(cfg, rdata->tp_info.transport)->mapped_addr, &via->recvd_param) != 0;
+        config_release(cfg);
+    }
+    if (queue || mapping_table.mapped_pending[acc_id]) {
+        pj_memcpy(mapping_table.mapped_addr[acc_id], via->recvd_param.ptr, via->recvd_param.slen);
+        mapping_table.mapped_addr[acc_id][via->recvd_param.slen] = '\0';
+        mapping_table.mapped_pending[acc_id] = PJ_TRUE;
+    }
+    pj_mutex_unlock(mapping_table.mutex);
+    if (queue && worker_post(&mapped_addr_job, (void*)(pj_ssize_t)acc_id) != PJ_SUCCESS) {
+        mapped_addr_update(acc_id);
+    }
+}
+
+//Send a STUN binding request (RFC 5389) to server over ipv6 and read the mapped address from the response. local
+//is set to the source address the request went out from.
+static pj_status_t stun_query_mapped_address(const pj_str_t* server, pj_uint16_t port, pj_in6_addr* local,
+                                             pj_in_addr* mapped)
+{
+    pj_pool_t* pool;
+    pj_sock_t sock = PJ_INVALID_SOCKET;
+    pj_sockaddr server_addr;
+    pj_sockaddr local_addr;
+    int local_addr_len = sizeof(local_addr);
+    pj_stun_msg* request = NULL;
+    pj_stun_msg* response = NULL;
+    pj_uint8_t request_buf[128];
+    pj_uint8_t response_buf[512];
+    pj_size_t request_len = 0;
+    unsigned attempt;
+    pj_status_t status;
+
+    pool = pjsua_pool_create("nat64stun", 1024, 1024);
+    if (pool == NULL) {
+        return PJ_ENOMEM;
+    }
+    status = pj_sockaddr_init(PJ_AF_INET6, &server_addr, server, port);
+    if (status == PJ_SUCCESS) {
+        status = pj_sock_socket(PJ_AF_INET6, pj_SOCK_DGRAM(), 0, &sock);
+    }
+    //A connected socket lets the kernel pick the source address the server will see translated
+    if (status == PJ_SUCCESS) {
+        status = pj_sock_connect(sock, &server_addr, pj_sockaddr_get_len(&server_addr));
+    }
+    if (status == PJ_SUCCESS) {
+        status = pj_sock_getsockname(sock, &local_addr, &local_addr_len);
+    }
+    if (status == PJ_SUCCESS) {
+        status = pj_stun_msg_create(pool, PJ_STUN_BINDING_REQUEST, PJ_STUN_MAGIC, NULL, &request);
+    }
+    if (status == PJ_SUCCESS) {
+        status = pj_stun_msg_encode(request, request_buf, sizeof(request_buf), 0, NULL, &request_len);
+    }
+    if (status == PJ_SUCCESS) {
+        status = PJ_ETIMEDOUT;
+    }
+    for (attempt = 0; status == PJ_ETIMEDOUT && attempt < NAT64_STUN_ATTEMPTS; attempt++) {
+        pj_time_val timeout = {NAT64_STUN_TIMEOUT_MSEC / 1000, NAT64_STUN_TIMEOUT_MSEC % 1000};
+        pj_ssize_t len = (pj_ssize_t)request_len;
+        pj_fd_set_t fds;
+
+        status = pj_sock_send(sock, request_buf, &len, 0);
+        if (status != PJ_SUCCESS) {
+            break;
+        }
+        PJ_FD_ZERO(&fds);
+        PJ_FD_SET(sock, &fds);
+        status = PJ_ETIMEDOUT;
+        if (pj_sock_select((int)sock + 1, &fds, NULL, NULL, &timeout) <= 0) {
+            continue;
+        }
+        len = sizeof(response_buf);
+        if (pj_sock_recv(sock, response_buf, &len, 0) != PJ_SUCCESS ||
+            pj_stun_msg_decode(pool, response_buf, len, PJ_STUN_IS_DATAGRAM | PJ_STUN_CHECK_PACKET, &response,
+                               NULL, NULL) != PJ_SUCCESS) {
+            continue;
+        }
+        //Anything but the answer to this request counts as lost
+        if (response->hdr.type == PJ_STUN_BINDING_RESPONSE &&
+            pj_memcmp(response->hdr.tsx_id, request->hdr.tsx_id, sizeof(request->hdr.tsx_id)) == 0) {
+            status = PJ_SUCCESS;
+        }
+    }
+    if (status == PJ_SUCCESS) {
+        const pj_stun_sockaddr_attr* attr;
+        attr = (const pj_stun_sockaddr_attr*)pj_stun_msg_find_attr(response, PJ_STUN_ATTR_XOR_MAPPED_ADDR, 0);
+        if (attr == NULL) {
+            //RFC 3489 servers
+            attr = (const pj_stun_sockaddr_attr*)pj_stun_msg_find_attr(response, PJ_STUN_ATTR_MAPPED_ADDR, 0);
+        }
+        if (attr != NULL && attr->sockaddr.addr.sa_family == PJ_AF_INET) {
+            *mapped = attr->sockaddr.ipv4.sin_addr;
+            *local = local_addr.ipv6.sin6_addr;
+        } else {
+            status = PJ_ENOTFOUND;
+        }
+    }
+    if (sock != PJ_INVALID_SOCKET) {
+        pj_sock_close(sock);
+    }
+    pj_pool_release(pool);
+    return status;
+}
+
+//Runs on a background worker
+static void stun_refresh_job(void* arg)
+{
+    char server[sizeof(mapping_table.stun_server)];
+    char ipv6_buf[PJ_INET6_ADDRSTRLEN];
+    pj_uint16_t port = NAT64_STUN_DEFAULT_PORT;
+    pj_str_t host;
+    pj_str_t ipv6;
+    pj_str_t port_str;
+    char* colon;
+    const nat64_config* cfg;
+    pj_in6_addr local;
+    pj_in_addr mapped;
+    pj_status_t status;
+
+    PJ_UNUSED_ARG(arg);
+    pj_mutex_lock(mapping_table.mutex);
+    pj_ansi_snprintf(server, sizeof(server), "%s", mapping_table.stun_server);
+    pj_mutex_unlock(mapping_table.mutex);
+    if (server[0] == '\0') {
+        return;
+    }
+    colon = strchr(server, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        port = (pj_uint16_t)pj_strtoul(pj_cstr(&port_str, colon + 1));
+    }
+    //An ipv4 server is only reachable through the NAT64, the request must go out over ipv6 to be translated
+    host = pj_str(server);
+    cfg = config_acquire();
+    resolve_or_synthesize_ipv4_to_ipv6(&cfg->global, &host, ipv6_buf, sizeof(ipv6_buf));
+    config_release(cfg);
+    if (strchr(ipv6_buf, ':') == NULL) {
+        PJ_LOG(4, (THIS_FILE, "No ipv6 address for STUN server %s, not behind a NAT64", server));
+        return;
+    }
+    ipv6 = pj_str(ipv6_buf);
+    status = stun_query_mapped_address(&ipv6, port, &local, &mapped);
+    if (status == PJ_SUCCESS) {
+        mapping_learn(&local, &mapped, "STUN");
+    } else {
+        PJ_LOG(3, (THIS_FILE, "STUN binding request to %s failed with %d", server, status));
+    }
+}
+
+//Must be called with the mapping mutex held
+static void stun_schedule_refresh(long delay_msec)
+{
+    pj_time_val delay = {delay_msec / 1000, delay_msec % 1000};
+
+    mapping_table.timer_armed -= pj_timer_heap_cancel(pjsip_endpt_get_timer_heap(pjsua_get_pjsip_endpt()),
+                                                      &mapping_table.refresh_timer);
+    if (mapping_table.stun_server[0] != '\0' &&
+        pjsip_endpt_schedule_timer(pjsua_get_pjsip_endpt(), &mapping_table.refresh_timer, &delay) == PJ_SUCCESS) {
+        mapping_table.timer_armed++;
+    }
+}
+
+//Runs on the pjsip thread polling the endpoint
+static void stun_on_refresh_timer(pj_timer_heap_t* timer_heap, pj_timer_entry* entry)
+{
+    PJ_UNUSED_ARG(timer_heap);
+    PJ_UNUSED_ARG(entry);
+    pj_mutex_lock(mapping_table.mutex);
+    if (mapping_table.stun_server[0] != '\0') {
+        if (worker_post(&stun_refresh_job, NULL) != PJ_SUCCESS) {
+            PJ_LOG(3, (THIS_FILE, "Workers busy, STUN refresh skipped"));
+        }
+        stun_schedule_refresh(NAT64_STUN_REFRESH_MSEC);
+    }
+    //Last touch of the mapping table, stun_stop may destroy the mutex as soon as this run is no longer counted
+    mapping_table.timer_armed--;
+    pj_mutex_unlock(mapping_table.mutex);
+}
+
+//Stop the background refresh and wait for a timer callback that is already running on another pjsip thread
+static void stun_stop()
+{
+    unsigned armed;
+
+    pj_mutex_lock(mapping_table.mutex);
+    mapping_table.stun_server[0] = '\0';
+    stun_schedule_refresh(0);
+    armed = mapping_table.timer_armed;
+    pj_mutex_unlock(mapping_table.mutex);
+    while (armed > 0) {
+        pj_thread_sleep(1);
+        pj_mutex_lock(mapping_table.mutex);
+        armed = mapping_table.timer_armed;
+        pj_mutex_unlock(mapping_table.mutex);
+    }
+}
+
+//The ipv4 address to announce instead of the local ipv6 address local_addr, buf receives a learned address
+static void get_outgoing_ipv4_address(const nat64_policy* policy, const pj_str_t* local_addr, char* buf,
+                                      int buf_len, pj_str_t* addr)
+{
+    if (policy->mapped_addr.slen)
+    {
+        PJ_LOG(4, (THIS_FILE, "Replace local ipv6 address with address from Via header (%.*s)",
+        policy->mapped_addr.slen, policy->mapped_addr.ptr));
+        *addr = policy->mapped_addr;
+    } else if (mapping_lookup(local_addr, buf, buf_len)) {
+        PJ_LOG(4, (THIS_FILE, "Replace local ipv6 address with learned public address %s", buf));
+        *addr = pj_str(buf);
+    } else {
+        //Nothing learned yet, replace with unroutable address so latching is used
+        *addr = pj_str("192.168.1.1");
+    }
+}
+
+//Format the replacement address for one IN IP4/IN IP6 occurrence into text, at least REWRITE_MAX_REPLACEMENT
+//bytes. with_type also writes the network and address type in front of it, ICE candidates only carry the address.
+//Returns the length written, 0 if there is no address to replace.
+static pj_size_t format_replacement_address(const nat64_policy* policy, pj_bool_t ipv6_to_ipv4, pj_str_t* org_addr,
+                                            pj_bool_t with_type, char* text)
+{
+    int len;
+    //"IN IP4 " at the end of a line, nothing to resolve
+    if (org_addr->slen == 0) {
+        return 0;
+    }
+    if (ipv6_to_ipv4) {
+        char ipv4_buf[PJ_INET_ADDRSTRLEN];
+        pj_str_t ipv4_addr;
+        get_outgoing_ipv4_address(policy, org_addr, ipv4_buf, sizeof(ipv4_buf), &ipv4_addr);
+        len = pj_ansi_snprintf(text, REWRITE_MAX_REPLACEMENT, "%s%.*s", with_type ? "IN IP4 " : "",
+                               (int)ipv4_addr.slen, ipv4_addr.ptr);
+    } else {
+        char ipv6_buf[PJ_INET6_ADDRSTRLEN];
+        const char* type = "";
+        resolve_or_synthesize_ipv4_to_ipv6(policy, org_addr, ipv6_buf, PJ_INET6_ADDRSTRLEN);
+        if (with_type) {
+            //Only claim IP6 if we actually got an ipv6 address back, otherwise the line stays ipv4
+            type = strchr(ipv6_buf, ':') != NULL ? "IN IP6 " : "IN IP4 ";
+        }
+        len = pj_ansi_snprintf(text, REWRITE_MAX_REPLACEMENT, "%s%s", type, ipv6_buf);
+    }
+    if (len < 0) {
+        len = 0;
+    }
+    return (pj_size_t)len < REWRITE_MAX_REPLACEMENT ? (pj_size_t)len : REWRITE_MAX_REPLACEMENT - 1;
+}
+
+//Find the connection address of an ICE candidate (RFC 8839 section 5.1), value points at the foundation right
+//after "candidate:". Only addresses of the family being replaced are returned, host names are left alone.
+static pj_bool_t find_candidate_address(const char* value, const char* end, pj_bool_t ipv6_to_ipv4,
+                                        const char** addr_start, const char** addr_end)
+{
+    const char* p = value;
+    unsigned field;
+    pj_str_t addr;
+    pj_in_addr ipv4;
+
+    //Skip foundation, component id, transport and priority
+    for (field = 0; field < 4; field++) {
+        while (p < end && *p != ' ' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+        if (p == end || *p != ' ') {
+            return PJ_FALSE;
+        }
+        while (p < end && *p == ' ') {
+            p++;
+        }
+    }
+    *addr_start = p;
+    while (p < end && *p != ' ' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    *addr_end = p;
+    if (*addr_end == *addr_start || (*addr_end - *addr_start) >= PJ_INET6_ADDRSTRLEN) {
+        return PJ_FALSE;
+    }
+    if (ipv6_to_ipv4) {
+        return memchr(*addr_start, ':', *addr_end - *addr_start) != NULL;
+    }
+    pj_strset(&addr, (char*)*addr_start, *addr_end - *addr_start);
+    return pj_inet_pton(PJ_AF_INET, &addr, &ipv4) == PJ_SUCCESS;
+}
+
+//Write the new Content-Length value over a field of value_len characters. If the value is shorter the field is
+//padded with spaces, if it is longer the field grows. Returns the number of bytes written.
+static pj_size_t write_content_length(char* dst, pj_size_t value_len, pj_size_t new_content_len)
+{
+#define CONTENT_LEN_BUF_SIZE 12
+    char new_content_len_buf[CONTENT_LEN_BUF_SIZE];
+    int digits = pj_ansi_snprintf(new_content_len_buf, CONTENT_LEN_BUF_SIZE, "%lu", (unsigned long)new_content_len);
+
+    PJ_LOG(4, (THIS_FILE, "Current Content-Length is: %.*s and new Content-Length is %s .",
+               (int)value_len, dst, new_content_len_buf));
+    pj_memcpy(dst, new_content_len_buf, digits);
+    if ((pj_size_t)digits < value_len) {
+        pj_memset(dst + digits, ' ', value_len - digits);
+        return value_len;
+    }
+    return digits;
+}
+
+static pj_size_t content_length_digits(pj_size_t content_len)
+{
+    pj_size_t digits = 1;
+    while (content_len >= 10) {
+        content_len /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+//Rewrite all connection, origin, rtcp and ICE candidate addresses in the sdp body of a printed SIP message,
+//multipart bodies included. A first pass collects the replacements in the scratch arena of the thread, the output
+//is then allocated from pool with its exact size and copied chunk by chunk between the replacements, with the
+//Content-Length header patched on the way. There is no limit on the message size and no fixed size copy.
+//The output buffer is at least min_cap bytes so pjsip can print an outgoing message into it again after it was
+//invalidated. Returns PJ_ENOTFOUND if there is nothing to rewrite.
+static pj_status_t rewrite_sdp_in_message(const nat64_policy* policy, pj_pool_t* pool, const char* msg,
+                                          pj_size_t msg_len, pj_bool_t ipv6_to_ipv4, pj_size_t min_cap,
+                                          pj_uint32_t msg_id, rewrite_result* result)
+{
+    const char* msg_end = msg + msg_len;
+    const char* token = ipv6_to_ipv4 ? "IN IP6 " : "IN IP4 ";
+    const pj_size_t token_len = 7;
+    const char* candidate = "a=candidate:";
+    const pj_size_t candidate_len = 12;
+    const char* body_start;
+    const char* token_hit;
+    const char* candidate_hit;
+    const char* last_end;
+    const char* cl_value = NULL;
+    pj_size_t cl_value_len = 0;
+    pj_size_t cl_len;
+    pj_size_t body_offset;
+    pj_size_t body_len;
+    pj_size_t out_len;
+    pj_size_t from;
+    char* out;
+    char* dst;
+    nat64_scratch* scratch;
+    rewrite_sites local_sites;
+    rewrite_sites* sites;
+    unsigned i;
+
+    //Sip message body starts after the first empty line
+    body_start = find_bytes(msg, msg_end, "\r\n\r\n", 4);
+    if (body_start == NULL) {
+        return PJ_ENOTFOUND;
+    }
+    body_start += 4;
+    body_offset = body_start - msg;
+
+    //Connection, origin and rtcp addresses follow the IN IP4/IN IP6 token, ICE candidates have their own syntax
+    token_hit = find_bytes(body_start, msg_end, token, token_len);
+    candidate_hit = find_bytes(body_start, msg_end, candidate, candidate_len);
+    if (token_hit == NULL && candidate_hit == NULL) {
+        return PJ_ENOTFOUND;
+    }
+
+    if (!find_content_length_value(msg, body_start, &cl_value, &cl_value_len)) {
+        PJ_LOG(1, (THIS_FILE,
+                   "Error: Could not find Content-Length header. The correct length can not be set. This must never happen."));
+        return PJ_EINVAL;
+    }
+
+    scratch = scratch_get();
+    if (scratch != NULL) {
+        sites = &scratch->sites;
+    } else {
+        pj_bzero(&local_sites, sizeof(local_sites));
+        local_sites.pool = pool;
+        sites = &local_sites;
+    }
+    sites->count = 0;
+
+    body_len = msg_len - body_offset;
+    last_end = msg;
+    while (token_hit != NULL || candidate_hit != NULL) {
+        const char* replace_start;
+        const char* addr_start;
+        const char* addr_end;
+        pj_bool_t with_type;
+        pj_str_t org_addr;
+        rewrite_site* site;
+
+        if (candidate_hit == NULL || (token_hit != NULL && token_hit < candidate_hit)) {
+            replace_start = token_hit;
+            addr_start = token_hit + token_len;
+            addr_end = addr_start;
+            while (addr_end < msg_end && *addr_end != '\r' && *addr_end != '\n' && *addr_end != ' ' && *addr_end != '/') {
+                addr_end++;
+            }
+            with_type = PJ_TRUE;
+            token_hit = find_bytes(addr_end, msg_end, token, token_len);
+        } else {
+            const char* value = candidate_hit + candidate_len;
+            candidate_hit = find_bytes(value, msg_end, candidate, candidate_len);
+            if (!find_candidate_address(value, msg_end, ipv6_to_ipv4, &addr_start, &addr_end)) {
+                continue;
+            }
+            replace_start = addr_start;
+            with_type = PJ_FALSE;
+        }
+        if (replace_start < last_end) {
+            continue;
+        }
+        pj_strset(&org_addr, (char*)addr_start, addr_end - addr_start);
+        PJ_LOG(5, (THIS_FILE, "Extracted %s address as %.*s", ipv6_to_ipv4 ? "ip6" : "ip4", (int)org_addr.slen, org_addr.ptr));
+
+        site = rewrite_sites_add(sites);
+        site->start = replace_start - msg;
+        site->end = addr_end - msg;
+        site->text_len = format_replacement_address(policy, ipv6_to_ipv4, &org_addr, with_type, site->text);
+        if (site->text_len == 0) {
+            sites->count--;
+            continue;
+        }
+        NAT64_TRACE(trace_address(msg_id, ipv6_to_ipv4, (pj_uint32_t)(addr_start - msg), &org_addr,
+                                  site->text + (addr_start - replace_start),
+                                  site->text_len - (addr_start - replace_start)));
+        body_len = body_len + site->text_len - (site->end - site->start);
+        last_end = addr_end;
+    }
+    if (sites->count == 0) {
+        return PJ_ENOTFOUND;
+    }
+
+    cl_len = content_length_digits(body_len);
+    if (cl_len > cl_value_len) {
+        PJ_LOG(4, (THIS_FILE, "Updated content length needs %lu more bytes", (unsigned long)(cl_len - cl_value_len)));
+        NAT64_ATOMIC_INC(module_stats.content_length_growth);
+    } else {
+        cl_len = cl_value_len;
+    }
+    out_len = (cl_value - msg) + cl_len + (body_start - (cl_value + cl_value_len)) + body_len;
+    out = (char*)pj_pool_alloc(pool, PJ_MAX(out_len, min_cap) + 1);
+
+    //The Content-Length value is in the headers, before every replacement
+    dst = out;
+    pj_memcpy(dst, msg, cl_value - msg);
+    dst += cl_value - msg;
+    dst += write_content_length(dst, cl_value_len, body_len);
+    from = (cl_value - msg) + cl_value_len;
+    for (i = 0; i < sites->count; i++) {
+        const rewrite_site* site = &sites->site[i];
+        pj_memcpy(dst, msg + from, site->start - from);
+        dst += site->start - from;
+        pj_memcpy(dst, site->text, site->text_len);
+        dst += site->text_len;
+        from = site->end;
+    }
+    pj_memcpy(dst, msg + from, msg_len - from);
+    dst += msg_len - from;
+    *dst = '\0';
+    pj_assert((pj_size_t)(dst - out) == out_len);
+
+    result->buf = out;
+    result->len = out_len;
+    result->cap = PJ_MAX(out_len, min_cap);
+    result->body_offset = out_len - body_len;
+    result->body_len = body_len;
+    result->replaced = sites->count;
+    return PJ_SUCCESS;
+}
+
+//Build a rewritten incoming message from the original headers and an already rewritten body
+static pj_status_t assemble_with_body(pj_pool_t* pool, const char* msg, pj_size_t body_offset, const pj_str_t* body,
+                                      rewrite_result* result)
+{
+    const char* cl_value = NULL;
+    pj_size_t cl_value_len = 0;
+    pj_size_t cl_len;
+    pj_size_t out_len;
+    char* out;
+    char* dst;
+
+    if (!find_content_length_value(msg, msg + body_offset, &cl_value, &cl_value_len)) {
+        return PJ_EINVAL;
+    }
+    cl_len = PJ_MAX(content_length_digits(body->slen), cl_value_len);
+    out_len = body_offset - cl_value_len + cl_len + body->slen;
+    out = (char*)pj_pool_alloc(pool, out_len + 1);
+
+    dst = out;
+    pj_memcpy(dst, msg, cl_value - msg);
+    dst += cl_value - msg;
+    dst += write_content_length(dst, cl_value_len, body->slen);
+    pj_memcpy(dst, cl_value + cl_value_len, (msg + body_offset) - (cl_value + cl_value_len));
+    dst += (msg + body_offset) - (cl_value + cl_value_len);
+    pj_memcpy(dst, body->ptr, body->slen);
+    out[out_len] = '\0';
+
+    result->buf = out;
+    result->len = out_len;
+    result->cap = out_len;
+    result->body_offset = out_len - body->slen;
+    result->body_len = body->slen;
+    return PJ_SUCCESS;
+}
+
+static pj_bool_t rx_memo_matches(const nat64_rx_memo_entry* entry, const nat64_policy* policy,
+                                 const pjsip_rx_data* rdata)
+{
+    const pjsip_msg_body* body = rdata->msg_info.msg->body;
+    return entry->used && entry->policy == policy && entry->policy_version == policy->version &&
+           entry->cseq == rdata->msg_info.cseq->cseq &&
+           entry->body.slen == (pj_ssize_t)body->len &&
+           pj_strcmp(&entry->call_id, &rdata->msg_info.cid->id) == 0 &&
+           pj_strcmp(&entry->method, &rdata->msg_info.cseq->method.name) == 0 &&
+           pj_memcmp(entry->body.ptr, body->data, body->len) == 0;
+}
+
+//Look up the rewrite of the same body in the same transaction, from an earlier retransmission or fork. Returns
+//PJ_TRUE on a hit, result->replaced is 0 if that body had nothing to rewrite.
+static pj_bool_t rx_memo_lookup(const nat64_policy* policy, pjsip_rx_data* rdata, rewrite_result* result)
+{
+    pj_bool_t found = PJ_FALSE;
+    unsigned i;
+
+    if (rx_memo.mutex == NULL || rdata->msg_info.cid == NULL || rdata->msg_info.cseq == NULL) {
+        return PJ_FALSE;
+    }
+    pj_mutex_lock(rx_memo.mutex);
+    for (i = 0; i < NAT64_RX_MEMO_SIZE; i++) {
+        nat64_rx_memo_entry* entry = &rx_memo.entries[i];
+        if (rx_memo_matches(entry, policy, rdata)) {
+            entry->last_used = ++rx_memo.use_counter;
+            result->replaced = entry->replaced;
+            found = entry->replaced == 0 ||
+                    assemble_with_body(rdata->tp_info.pool, rdata->msg_info.msg_buf,
+                                       (char*)rdata->msg_info.msg->body->data - rdata->msg_info.msg_buf,
+                                       &entry->rewritten, result) == PJ_SUCCESS;
+            break;
+        }
+    }
+    pj_mutex_unlock(rx_memo.mutex);
+    return found;
+}
+
+//Remember the outcome of an incoming rewrite, result is NULL if there was nothing to rewrite. The least recently
+//used entry is replaced.
+static void rx_memo_store(const nat64_policy* policy, const pjsip_rx_data* rdata, const rewrite_result* result)
+{
+    const pjsip_msg_body* body = rdata->msg_info.msg->body;
+    nat64_rx_memo_entry* entry;
+    pj_pool_t* pool;
+    pj_str_t str;
+    unsigned i;
+
+    if (rx_memo.mutex == NULL || rdata->msg_info.cid == NULL || rdata->msg_info.cseq == NULL) {
+        return;
+    }
+    pj_mutex_lock(rx_memo.mutex);
+    entry = &rx_memo.entries[0];
+    for (i = 0; i < NAT64_RX_MEMO_SIZE; i++) {
+        if (!rx_memo.entries[i].used) {
+            entry = &rx_memo.entries[i];
+            break;
+        }
+        if (rx_memo.entries[i].last_used < entry->last_used) {
+            entry = &rx_memo.entries[i];
+        }
+    }
+    //Only a body larger than the pool makes it grow, the reset keeps the first block
+    pool = entry->pool;
+    pj_pool_reset(pool);
+    pj_bzero(entry, sizeof(*entry));
+    entry->pool = pool;
+    entry->used = PJ_TRUE;
+    entry->policy = policy;
+    entry->policy_version = policy->version;
+    entry->cseq = rdata->msg_info.cseq->cseq;
+    pj_strdup(pool, &entry->call_id, &rdata->msg_info.cid->id);
+    pj_strdup(pool, &entry->method, &rdata->msg_info.cseq->method.name);
+    pj_strset(&str, (char*)body->data, body->len);
+    pj_strdup(pool, &entry->body, &str);
+    if (result != NULL) {
+        pj_strset(&str, result->buf + result->body_offset, result->body_len);
+        pj_strdup(pool, &entry->rewritten, &str);
+        entry->replaced = result->replaced;
+    }
+    entry->last_used = ++rx_memo.use_counter;
+    pj_mutex_unlock(rx_memo.mutex);
+}
+
+static void rx_memo_flush()
+{
+    unsigned i;
+    if (rx_memo.mutex == NULL) {
+        return;
+    }
+    pj_mutex_lock(rx_memo.mutex);
+    for (i = 0; i < NAT64_RX_MEMO_SIZE; i++) {
+        rx_memo.entries[i].used = PJ_FALSE;
+    }
+    pj_mutex_unlock(rx_memo.mutex);
+}
+
+//The pools of the entries are created once here, the SIP threads only reset them
+static pj_status_t rx_memo_init()
+{
+    unsigned i;
+    pj_status_t status = pj_mutex_create_simple(module_pool, "nat64memo", &rx_memo.mutex);
+
+    for (i = 0; i < NAT64_RX_MEMO_SIZE && status == PJ_SUCCESS; i++) {
+        pj_bzero(&rx_memo.entries[i], sizeof(rx_memo.entries[i]));
+        rx_memo.entries[i].pool = pjsua_pool_create("nat64memo", NAT64_RX_MEMO_POOL_SIZE, NAT64_RX_MEMO_POOL_SIZE);
+        if (rx_memo.entries[i].pool == NULL) {
+            status = PJ_ENOMEM;
+        }
+    }
+    return status;
+}
+
+static void rx_memo_destroy()
+{
+    unsigned i;
+    for (i = 0; i < NAT64_RX_MEMO_SIZE; i++) {
+        if (rx_memo.entries[i].pool != NULL) {
+            pj_pool_release(rx_memo.entries[i].pool);
+        }
+        pj_bzero(&rx_memo.entries[i], sizeof(rx_memo.entries[i]));
+    }
+    if (rx_memo.mutex != NULL) {
+        pj_mutex_destroy(rx_memo.mutex);
+        rx_memo.mutex = NULL;
+    }
+}
+
+//A retransmission sends the same tdata again without printing it. It is recognised by the buffer and by the info
+//string, which pjsip_tx_data_invalidate_msg resets whenever the message has to be printed again.
+static pj_bool_t tx_memo_is_current(const pjsip_tx_data* tdata, int mod_id)
+{
+    const nat64_tx_memo* memo = (const nat64_tx_memo*)tdata->mod_data[mod_id];
+    return memo != NULL && tdata->info != NULL && memo->info == tdata->info && memo->buf == tdata->buf.start;
+}
+
+static void tx_memo_store(pjsip_tx_data* tdata, int mod_id)
+{
+    nat64_tx_memo* memo = (nat64_tx_memo*)tdata->mod_data[mod_id];
+    if (memo == NULL) {
+        memo = PJ_POOL_ALLOC_T(tdata->pool, nat64_tx_memo);
+        tdata->mod_data[mod_id] = memo;
+    }
+    memo->buf = tdata->buf.start;
+    memo->info = pjsip_tx_data_get_info(tdata);
+}
+
+//For outgoing messages carrying sdp
+static unsigned replace_sdp_ipv6_with_ipv4(const nat64_policy* policy, pjsip_tx_data *tdata, pj_uint32_t msg_id)
+{
+    rewrite_result result;
+    pj_status_t status;
+
+    status = rewrite_sdp_in_message(policy, tdata->pool, tdata->buf.start, tdata->buf.cur - tdata->buf.start,
+                                    PJ_TRUE, tdata->buf.end - tdata->buf.start, msg_id, &result);
+    if (status == PJ_ENOTFOUND) {
+        return 0;
+    } else if (status != PJ_SUCCESS) {
+        PJ_LOG(1, (THIS_FILE, "Error: Rewriting of the outgoing sdp failed. Leave outgoing buffer as is"));
+        NAT64_ATOMIC_INC(module_stats.rewrite_failures);
+        return 0;
+    }
+
+    //The rewritten message lives in the tdata pool, let pjsip send it from there. It is not bound by
+    //PJSIP_MAX_PKT_LEN so large TCP/TLS messages are rewritten as a whole.
+    tdata->buf.start = result.buf;
+    tdata->buf.cur = result.buf + result.len;
+    tdata->buf.end = result.buf + result.cap;
+    PJ_LOG(4, (THIS_FILE,
+    "Replaced %u addresses in the outgoing sdp. pjsip will now send the modified TX packet.", result.replaced));
+    return result.replaced;
+}
+
+
+//For incoming messages carrying sdp
+static unsigned replace_sdp_ipv4_with_ipv6(const nat64_policy* policy, pjsip_rx_data *rdata, pj_uint32_t msg_id)
+{
+    rewrite_result result;
+    pj_status_t status;
+    pjsip_msg* msg = rdata->msg_info.msg;
+
+    if (rx_memo_lookup(policy, rdata, &result)) {
+        PJ_LOG(4, (THIS_FILE, "Same sdp already rewritten in this transaction, reuse it"));
+        NAT64_ATOMIC_INC(module_stats.memo_hits);
+        NAT64_TRACE(trace_memo_hit(msg_id, PJ_FALSE));
+        if (result.replaced == 0) {
+            return 0;
+        }
+    } else {
+        status = rewrite_sdp_in_message(policy, rdata->tp_info.pool, rdata->msg_info.msg_buf, rdata->msg_info.len,
+                                        PJ_FALSE, 0, msg_id, &result);
+        if (status == PJ_ENOTFOUND) {
+            rx_memo_store(policy, rdata, NULL);
+            return 0;
+        } else if (status != PJ_SUCCESS) {
+            PJ_LOG(1, (THIS_FILE, "Error: Rewriting of the incoming sdp failed. Leave incoming buffer as is"));
+            NAT64_ATOMIC_INC(module_stats.rewrite_failures);
+            return 0;
+        }
+        rx_memo_store(policy, rdata, &result);
+    }
+
+    //The parsed headers still point into the original packet which is untouched, only the message buffer,
+    //the body and the Content-Length are moved over to the rewritten copy in the rdata pool.
+    rdata->msg_info.msg_buf = result.buf;
+    rdata->msg_info.len = (int)result.len;
+    if (msg != NULL && msg->body != NULL) {
+        msg->body->data = result.buf + result.body_offset;
+        msg->body->len = (unsigned)result.body_len;
+    }
+    if (rdata->msg_info.clen != NULL) {
+        rdata->msg_info.clen->len = (int)result.body_len;
+    }
+    PJ_LOG(4, (THIS_FILE,
+    "Replaced %u addresses in the incoming sdp. pjsip will now print the modified rx packet.", result.replaced));
+    return result.replaced;
+}
+
+//Rewrite one address/address type pair of a parsed sdp. Returns PJ_TRUE if it was changed.
+static pj_bool_t rewrite_sdp_address(const nat64_policy* policy, pj_pool_t* pool, pj_str_t* addr_type, pj_str_t* addr,
+                                     pj_bool_t ipv6_to_ipv4)
+{
+    if (ipv6_to_ipv4) {
+        char ipv4_buf[PJ_INET_ADDRSTRLEN];
+        pj_str_t ipv4_addr;
+        if (pj_stricmp2(addr_type, "IP6") != 0) {
+            return PJ_FALSE;
+        }
+        get_outgoing_ipv4_address(policy, addr, ipv4_buf, sizeof(ipv4_buf), &ipv4_addr);
+        *addr_type = pj_str("IP4");
+        pj_strdup(pool, addr, &ipv4_addr);
+    } else {
+        char ipv6_buf[PJ_INET6_ADDRSTRLEN];
+        if (pj_stricmp2(addr_type, "IP4") != 0) {
+            return PJ_FALSE;
+        }
+        resolve_or_synthesize_ipv4_to_ipv6(policy, addr, ipv6_buf, PJ_INET6_ADDRSTRLEN);
+        if (strchr(ipv6_buf, ':') == NULL) {
+            return PJ_FALSE;
+        }
+        *addr_type = pj_str("IP6");
+        pj_strdup2(pool, addr, ipv6_buf);
+    }
+    return PJ_TRUE;
+}
+
+//Rewrite the address of an a=rtcp or a=candidate attribute of a parsed sdp. Returns PJ_TRUE if it was changed.
+static pj_bool_t rewrite_sdp_attr(const nat64_policy* policy, pj_pool_t* pool, pjmedia_sdp_attr* attr,
+                                  pj_bool_t ipv6_to_ipv4)
+{
+    const char* value = attr->value.ptr;
+    const char* value_end = attr->value.ptr + attr->value.slen;
+    const char* replace_start;
+    const char* addr_start;
+    const char* addr_end;
+    pj_str_t org_addr;
+    char text[REWRITE_MAX_REPLACEMENT];
+    pj_size_t text_len;
+    pj_size_t new_len;
+    char* new_value;
+
+    if (pj_stricmp2(&attr->name, "rtcp") == 0) {
+        //a=rtcp:port IN IP4 address
+        replace_start = find_bytes(value, value_end, ipv6_to_ipv4 ? "IN IP6 " : "IN IP4 ", 7);
+        if (replace_start == NULL) {
+            return PJ_FALSE;
+        }
+        addr_start = addr_end = replace_start + 7;
+        while (addr_end < value_end && *addr_end != ' ' && *addr_end != '\r' && *addr_end != '\n') {
+            addr_end++;
+        }
+    } else if (pj_stricmp2(&attr->name, "candidate") == 0) {
+        if (!find_candidate_address(value, value_end, ipv6_to_ipv4, &addr_start, &addr_end)) {
+            return PJ_FALSE;
+        }
+        replace_start = addr_start;
+    } else {
+        return PJ_FALSE;
+    }
+
+    pj_strset(&org_addr, (char*)addr_start, addr_end - addr_start);
+    text_len = format_replacement_address(policy, ipv6_to_ipv4, &org_addr, replace_start != addr_start, text);
+    if (text_len == 0) {
+        return PJ_FALSE;
+    }
+    new_len = (replace_start - value) + text_len + (value_end - addr_end);
+    new_value = (char*)pj_pool_alloc(pool, new_len + 1);
+    pj_memcpy(new_value, value, replace_start - value);
+    pj_memcpy(new_value + (replace_start - value), text, text_len);
+    pj_memcpy(new_value + (replace_start - value) + text_len, addr_end, value_end - addr_end);
+    new_value[new_len] = '\0';
+    pj_strset(&attr->value, new_value, new_len);
+    return PJ_TRUE;
+}
+
+//Rewrite the origin, all connection lines and the rtcp and ICE candidate attributes of a parsed sdp session
+static unsigned rewrite_sdp_session(const nat64_policy* policy, pj_pool_t* pool, pjmedia_sdp_session* sdp,
+                                    pj_bool_t ipv6_to_ipv4)
+{
+    unsigned replaced = 0;
+    unsigned i, j;
+
+    replaced += rewrite_sdp_address(policy, pool, &sdp->origin.addr_type, &sdp->origin.addr, ipv6_to_ipv4);
+    if (sdp->conn != NULL) {
+        replaced += rewrite_sdp_address(policy, pool, &sdp->conn->addr_type, &sdp->conn->addr, ipv6_to_ipv4);
+    }
+    for (i = 0; i < sdp->media_count; i++) {
+        pjmedia_sdp_media* media = sdp->media[i];
+        if (media->conn != NULL) {
+            replaced += rewrite_sdp_address(policy, pool, &media->conn->addr_type, &media->conn->addr, ipv6_to_ipv4);
+        }
+        for (j = 0; j < media->attr_count; j++) {
+            replaced += rewrite_sdp_attr(policy, pool, media->attr[j], ipv6_to_ipv4);
+        }
+    }
+    return replaced;
+}
+
+static pj_bool_t is_sdp_body(const pjsip_msg_body* body)
+{
+    return body != NULL && pj_stricmp2(&body->content_type.type, "application") == 0 &&
+           pj_stricmp2(&body->content_type.subtype, "sdp") == 0;
+}
+
+//Cheap classification of a parsed message before any buffer work, whatever the method. Only sdp bodies, on their
+//own or inside a multipart body, can carry addresses to rewrite. Messages without a body such as 100 Trying or
+//180 Ringing stop here after a couple of pointer checks.
+static pj_bool_t may_carry_sdp(const pjsip_msg* msg)
+{
+    if (msg == NULL || msg->body == NULL) {
+        return PJ_FALSE;
+    }
+    return is_sdp_body(msg->body) || pj_stricmp2(&msg->body->content_type.type, "multipart") == 0;
+}
+
+static pjsip_module ipv6_module;
+static pjsip_module ipv6_sdp_module;
+
+//Printer of the multipart bodies of pjsip, which does not export it. Taken from a body created when the module is
+//enabled, the multipart functions of pjsip may only be used on bodies printed by it.
+static int (*multipart_print_body)(pjsip_msg_body*, char*, pj_size_t);
+
+//Marks a tdata whose sdp is left to the buffer rewrite of mod-ipv6 after printing
+static int tx_buffer_rewrite_marker;
+
+//For outgoing messages before they are printed, the body is rewritten as a pjmedia_sdp_session
+static unsigned replace_parsed_sdp_ipv6_with_ipv4(const nat64_policy* policy, pjsip_tx_data *tdata, pj_uint32_t msg_id)
+{
+    pjsip_msg_body* multipart = NULL;
+    pjsip_msg_body** sdp_body = &tdata->msg->body;
+    pjsip_msg_body* body = tdata->msg->body;
+    pjmedia_sdp_session* sdp;
+    unsigned replaced;
+
+    //Addresses of a parsed sdp have no offset, only the message is traced
+    PJ_UNUSED_ARG(msg_id);
+
+    if (pj_stricmp2(&body->content_type.type, "multipart") == 0) {
+        //Only the sdp part is replaced, the other parts are left as they are
+        pjsip_media_type sdp_type;
+        pjsip_multipart_part* part;
+
+        if (body->print_body == &pjsip_print_text_body) {
+            //Application supplied the multipart body as text, parse it into its parts
+            multipart = pjsip_multipart_parse(tdata->pool, (char*)body->data, body->len, &body->content_type, 0);
+        } else if (multipart_print_body != NULL && body->print_body == multipart_print_body) {
+            multipart = body;
+        }
+        if (multipart == NULL) {
+            //Not a body pjsip can look into, rewrite the printed buffer instead
+            tdata->mod_data[ipv6_sdp_module.id] = &tx_buffer_rewrite_marker;
+            return 0;
+        }
+        pjsip_media_type_init2(&sdp_type, "application", "sdp");
+        part = pjsip_multipart_find_part(multipart, &sdp_type, NULL);
+        if (part == NULL) {
+            return 0;
+        }
+        sdp_body = &part->body;
+        body = part->body;
+    }
+    if (!is_sdp_body(body)) {
+        return 0;
+    }
+
+    if (body->print_body == &pjsip_print_text_body) {
+        //Application supplied the sdp as text, parse it once
+        if (pjmedia_sdp_parse(tdata->pool, (char*)body->data, body->len, &sdp) != PJ_SUCCESS) {
+            PJ_LOG(1, (THIS_FILE, "Error: Could not parse outgoing sdp. Leave outgoing body as is"));
+            NAT64_ATOMIC_INC(module_stats.rewrite_failures);
+            return 0;
+        }
+    } else {
+        //Body created with pjsip_create_sdp_body, work on a copy since the session may be shared with the negotiator
+        sdp = pjmedia_sdp_session_clone(tdata->pool, (const pjmedia_sdp_session*)body->data);
+    }
+
+    replaced = rewrite_sdp_session(policy, tdata->pool, sdp, PJ_TRUE);
+    if (replaced == 0) {
+        return 0;
+    }
+    if (pjsip_create_sdp_body(tdata->pool, sdp, sdp_body) != PJ_SUCCESS) {
+        PJ_LOG(1, (THIS_FILE, "Error: Could not create outgoing sdp body. Leave outgoing body as is"));
+        NAT64_ATOMIC_INC(module_stats.rewrite_failures);
+        return 0;
+    }
+    if (multipart != NULL) {
+        //A multipart body parsed from text replaces the original, a parsed one is already in place
+        tdata->msg->body = multipart;
+    }
+    //Make sure pjsip prints the message again if it has been printed before
+    pjsip_tx_data_invalidate_msg(tdata);
+    PJ_LOG(4, (THIS_FILE, "Replaced %u addresses in the outgoing sdp before printing", replaced));
+    return replaced;
+}
+
+//For incoming messages right after parsing. The session is parsed through pjsip_rdata_get_sdp_info which caches
+//it in the rdata, so the invite session picks up the rewritten addresses without the body being printed again.
+static unsigned replace_parsed_sdp_ipv4_with_ipv6(const nat64_policy* policy, pjsip_rx_data *rdata)
+{
+    pjsip_rdata_sdp_info* sdp_info = pjsip_rdata_get_sdp_info(rdata);
+    unsigned replaced;
+
+    if (sdp_info == NULL || sdp_info->sdp == NULL) {
+        return 0;
+    }
+    replaced = rewrite_sdp_session(policy, rdata->tp_info.pool, sdp_info->sdp, PJ_FALSE);
+    PJ_LOG(4, (THIS_FILE, "Replaced %u addresses in the incoming sdp", replaced));
+    return replaced;
+}
+
+//Sip uri of a Contact, Route or Record-Route header. NULL for any other header, for Contact: * and for other schemes.
+static pjsip_sip_uri* dialog_hdr_sip_uri(const pjsip_hdr* hdr)
+{
+    pjsip_uri* uri;
+
+    if (hdr->type == PJSIP_H_CONTACT) {
+        uri = ((const pjsip_contact_hdr*)hdr)->uri;
+    } else if (hdr->type == PJSIP_H_ROUTE || hdr->type == PJSIP_H_RECORD_ROUTE) {
+        uri = ((const pjsip_route_hdr*)hdr)->name_addr.uri;
+    } else {
+        return NULL;
+    }
+    if (uri == NULL) {
+        return NULL;
+    }
+    uri = (pjsip_uri*)pjsip_uri_get_uri(uri);
+    if (!PJSIP_URI_SCHEME_IS_SIP(uri) && !PJSIP_URI_SCHEME_IS_SIPS(uri)) {
+        return NULL;
+    }
+    return (pjsip_sip_uri*)uri;
+}
+
+//Collect the hosts of an incoming message the resolver is needed for: the connection, origin, rtcp and candidate
+//addresses of the sdp and the hosts of every Contact, Route and Record-Route header.
+static void collect_message_hosts(const nat64_policy* policy, const pjsip_rx_data* rdata, pj_bool_t sdp,
+                                  pj_bool_t headers, nat64_host_set* set)
+{
+    const pjsip_msg* msg = rdata->msg_info.msg;
+    const pjsip_hdr* hdr;
+    pj_str_t host;
+
+    if (sdp && msg->body != NULL && msg->body->data != NULL) {
+        const char* body = (const char*)msg->body->data;
+        const char* end = body + msg->body->len;
+        const char* hit = find_bytes(body, end, "IN IP4 ", 7);
+        while (hit != NULL) {
+            const char* addr_end = hit + 7;
+            while (addr_end < end && *addr_end != '\r' && *addr_end != '\n' && *addr_end != ' ' && *addr_end != '/') {
+                addr_end++;
+            }
+            host_set_add(policy, set, pj_strset(&host, (char*)hit + 7, addr_end - (hit + 7)));
+            hit = find_bytes(addr_end, end, "IN IP4 ", 7);
+        }
+        hit = find_bytes(body, end, "a=candidate:", 12);
+        while (hit != NULL) {
+            const char* addr_start;
+            const char* addr_end;
+            if (find_candidate_address(hit + 12, end, PJ_FALSE, &addr_start, &addr_end)) {
+                host_set_add(policy, set, pj_strset(&host, (char*)addr_start, addr_end - addr_start));
+            }
+            hit = find_bytes(hit + 12, end, "a=candidate:", 12);
+        }
+    }
+    if (headers) {
+        for (hdr = msg->hdr.next; hdr != &msg->hdr; hdr = hdr->next) {
+            pjsip_sip_uri* sip_uri = dialog_hdr_sip_uri(hdr);
+            if (sip_uri != NULL) {
+                host_set_add(policy, set, &sip_uri->host);
+            }
+        }
+    }
+}
+
+//Every Contact, Route and Record-Route header of an INVITE dialog message. According to pjsip the Route
+//headers have prio over the Contact header, the Record-Route headers become the route set of the dialog.
+static void replace_route_and_contact_ipv4_with_ipv6(const nat64_policy* policy, pjsip_rx_data *rdata,
+                                                     pj_uint32_t msg_id)
+{
+    pjsip_msg* msg = rdata->msg_info.msg;
+    pjsip_hdr* hdr;
+
+    for (hdr = msg->hdr.next; hdr != &msg->hdr; hdr = hdr->next) {
+        char ipv6_buf[PJ_INET6_ADDRSTRLEN] = {0};
+        pjsip_sip_uri* sip_uri = dialog_hdr_sip_uri(hdr);
+        if (sip_uri == NULL) {
+            continue;
+        }
+        PJ_LOG(4, (THIS_FILE, "Host in %.*s header is %.*s", (int)hdr->name.slen, hdr->name.ptr,
+                   (int)sip_uri->host.slen, sip_uri->host.ptr));
+        resolve_or_synthesize_ipv4_to_ipv6(policy, &sip_uri->host, ipv6_buf, PJ_INET6_ADDRSTRLEN);
+        NAT64_TRACE(trace_address(msg_id, PJ_FALSE, PJ_NAT64_TRACE_NO_OFFSET, &sip_uri->host, ipv6_buf,
+                                  strlen(ipv6_buf)));
+        pj_strdup2(rdata->tp_info.pool, &sip_uri->host, ipv6_buf);
+    }
+}
+
+//Run an outgoing rewrite and account for it in the statistics
+static void record_tx_rewrite(const nat64_policy* policy,
+                              unsigned (*rewrite)(const nat64_policy*, pjsip_tx_data*, pj_uint32_t),
+                              pjsip_tx_data *tdata)
+{
+    pj_uint32_t msg_id = NAT64_TRACE_MSG_ID();
+    pj_timestamp start;
+    unsigned replaced;
+
+    pj_get_timestamp(&start);
+    NAT64_ATOMIC_INC(module_stats.tx_inspected);
+    replaced = rewrite(policy, tdata, msg_id);
+    if (replaced > 0) {
+        NAT64_ATOMIC_INC(module_stats.tx_rewritten);
+        NAT64_ATOMIC_ADD(module_stats.addresses_replaced, replaced);
+    }
+    histogram_add(&module_stats.rewrite_usec, &start);
+    //The length is 0 for a parsed rewrite, the message is printed later
+    NAT64_TRACE(trace_message(msg_id, PJ_TRUE, tdata->buf.cur - tdata->buf.start, replaced, &start));
+}
+
+/* Incoming messages held back while their hosts are resolved, see NAT64_DEFER_RESOLUTION. A held message is a
+ * clone of the rdata, it is fed to the endpoint again from mod-ipv6 on from the timer of the entry, which fires
+ * right away once every lookup is done or after NAT64_DEFER_TIMEOUT_MSEC. */
+#ifndef NAT64_MAX_DEFERRED
+#   define NAT64_MAX_DEFERRED               8
+#endif
+#ifndef NAT64_DEFER_TIMEOUT_MSEC
+#   define NAT64_DEFER_TIMEOUT_MSEC         2000
+#endif
+
+typedef enum nat64_deferred_state {
+    NAT64_DEFERRED_WAITING,
+    NAT64_DEFERRED_READY,
+    NAT64_DEFERRED_TIMED_OUT
+} nat64_deferred_state;
+
+typedef struct nat64_deferred nat64_deferred;
+
+typedef struct nat64_deferred_lookup {
+    nat64_deferred*     deferred;
+    //Empty for the discovery of the NAT64 prefix
+    pj_str_t            host;
+    //Queued on the workers, otherwise it waits for the posted lookup of another message for the same host
+    pj_bool_t           posted;
+    pj_bool_t           done;
+    struct nat64_deferred_lookup* waiters;
+    struct nat64_deferred_lookup* next_waiter;
+} nat64_deferred_lookup;
+
+//Lives in the pool of the cloned rdata
+struct nat64_deferred {
+    pjsip_rx_data*          rdata;
+    nat64_deferred_lookup   lookup[NAT64_MAX_BATCH_HOSTS + 1];
+    unsigned                count;
+    unsigned                remaining;
+    //Held by the timer and by every posted or waiting lookup
+    unsigned                ref;
+    nat64_deferred_state    state;
+    pj_timer_entry          timer;
+};
+
+static struct nat64_deferred_queue {
+    pj_mutex_t*         mutex;
+    nat64_deferred*     entries[NAT64_MAX_DEFERRED];
+    unsigned            count;
+    //Timer callbacks injecting a message right now
+    unsigned            injecting;
+    //Set while the module is disabled, no message is held back or injected any more
+    pj_bool_t           stopping;
+} deferred_queue;
+
+static void deferred_release(nat64_deferred* deferred)
+{
+    pj_bool_t last;
+
+    pj_mutex_lock(deferred_queue.mutex);
+    last = --deferred->ref == 0;
+    pj_mutex_unlock(deferred_queue.mutex);
+    if (last) {
+        pjsip_rx_data_free_cloned(deferred->rdata);
+    }
+}
+
+//Must be called with the queue mutex held
+static void deferred_remove(nat64_deferred* deferred)
+{
+    unsigned i;
+    for (i = 0; i < deferred_queue.count; i++) {
+        if (deferred_queue.entries[i] == deferred) {
+            deferred_queue.entries[i] = deferred_queue.entries[--deferred_queue.count];
+            break;
+        }
+    }
+}
+
+//Runs on the pjsip thread polling the endpoint
+static void deferred_on_timer(pj_timer_heap_t* timer_heap, pj_timer_entry* entry)
+{
+    nat64_deferred* deferred = (nat64_deferred*)entry->user_data;
+    pjsip_process_rdata_param param;
+    pj_bool_t last;
+
+    PJ_UNUSED_ARG(timer_heap);
+    pj_mutex_lock(deferred_queue.mutex);
+    deferred_remove(deferred);
+    if (deferred_queue.stopping) {
+        //mod-ipv6 is going away, the message is dropped with the others. deferred_stop may destroy the mutex as
+        //soon as the queue is empty, so it is not locked again.
+        last = --deferred->ref == 0;
+        pj_mutex_unlock(deferred_queue.mutex);
+        if (last) {
+            pjsip_rx_data_free_cloned(deferred->rdata);
+        }
+        return;
+    }
+    if (deferred->state == NAT64_DEFERRED_WAITING) {
+        deferred->state = NAT64_DEFERRED_TIMED_OUT;
+        NAT64_ATOMIC_INC(module_stats.defer_timeouts);
+        PJ_LOG(2, (THIS_FILE, "Warning: Resolving the hosts of a held back message took too long, "
+                   "it goes on with its original addresses"));
+    }
+    deferred_queue.injecting++;
+    pj_mutex_unlock(deferred_queue.mutex);
+
+    //Start over at mod-ipv6, which finds the state of the message in its mod_data
+    pjsip_process_rdata_param_default(&param);
+    param.start_mod = &ipv6_module;
+    pjsip_endpt_process_rx_data(pjsua_get_pjsip_endpt(), deferred->rdata, &param, NULL);
+    pj_mutex_lock(deferred_queue.mutex);
+    last = --deferred->ref == 0;
+    deferred_queue.injecting--;
+    pj_mutex_unlock(deferred_queue.mutex);
+    if (last) {
+        pjsip_rx_data_free_cloned(deferred->rdata);
+    }
+}
+
+//Once every lookup is done the message goes on right away instead of at the timeout. If the timeout is already
+//firing it finds the message ready. Must be called with the queue mutex held.
+static void deferred_check_done(nat64_deferred* deferred)
+{
+    pj_time_val delay = {0, 0};
+
+    if (deferred->remaining > 0 || deferred->state != NAT64_DEFERRED_WAITING) {
+        return;
+    }
+    deferred->state = NAT64_DEFERRED_READY;
+    //No new timer while the module is disabled, deferred_flush cancels the one that is scheduled
+    if (!deferred_queue.stopping &&
+        pj_timer_heap_cancel(pjsip_endpt_get_timer_heap(pjsua_get_pjsip_endpt()), &deferred->timer) == 1) {
+        pjsip_endpt_schedule_timer(pjsua_get_pjsip_endpt(), &deferred->timer, &delay);
+    }
+}
+
+//Must be called with the queue mutex held
+static void deferred_lookup_done(nat64_deferred_lookup* lookup)
+{
+    lookup->done = PJ_TRUE;
+    lookup->deferred->remaining--;
+    deferred_check_done(lookup->deferred);
+}
+
+//Runs on a background worker
+static void deferred_lookup_job(void* arg)
+{
+    nat64_deferred_lookup* lookup = (nat64_deferred_lookup*)arg;
+    nat64_deferred_lookup* waiter;
+    nat64_deferred_lookup* next;
+    char buf[PJ_INET6_ADDRSTRLEN];
+
+    if (lookup->host.slen == 0) {
+        prefix_discover(PJ_TRUE);
+    } else {
+        resolve_with_resolver(&lookup->host, buf, sizeof(buf));
+    }
+    pj_mutex_lock(deferred_queue.mutex);
+    deferred_lookup_done(lookup);
+    for (waiter = lookup->waiters; waiter != NULL; waiter = waiter->next_waiter) {
+        deferred_lookup_done(waiter);
+    }
+    pj_mutex_unlock(deferred_queue.mutex);
+    //No waiter is added once the lookup is done
+    for (waiter = lookup->waiters; waiter != NULL; waiter = next) {
+        next = waiter->next_waiter;
+        deferred_release(waiter->deferred);
+    }
+    deferred_release(lookup->deferred);
+}
+
+//Is rdata a retransmission of the held back message. Must be called with the queue mutex held.
+static pj_bool_t deferred_is_retransmission(const nat64_deferred* deferred, const pjsip_rx_data* rdata)
+{
+    const pjsip_rx_data* held = deferred->rdata;
+
+    if (rdata->msg_info.via == NULL || rdata->msg_info.cseq == NULL || rdata->msg_info.cid == NULL ||
+        held->msg_info.via == NULL || held->msg_info.cseq == NULL || held->msg_info.cid == NULL) {
+        return PJ_FALSE;
+    }
+    if (held->msg_info.msg->type != rdata->msg_info.msg->type ||
+        (rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG &&
+         held->msg_info.msg->line.status.code != rdata->msg_info.msg->line.status.code)) {
+        return PJ_FALSE;
+    }
+    return held->msg_info.cseq->cseq == rdata->msg_info.cseq->cseq &&
+           pj_strcmp(&held->msg_info.cseq->method.name, &rdata->msg_info.cseq->method.name) == 0 &&
+           pj_strcmp(&held->msg_info.via->branch_param, &rdata->msg_info.via->branch_param) == 0 &&
+           pj_strcmp(&held->msg_info.cid->id, &rdata->msg_info.cid->id) == 0;
+}
+
+//A posted lookup of another held back message for host that is still running. Must be called with the queue
+//mutex held.
+static nat64_deferred_lookup* deferred_find_lookup(const pj_str_t* host)
+{
+    unsigned i, j;
+
+    for (i = 0; i < deferred_queue.count; i++) {
+        nat64_deferred* deferred = deferred_queue.entries[i];
+        for (j = 0; j < deferred->count; j++) {
+            nat64_deferred_lookup* lookup = &deferred->lookup[j];
+            if (lookup->posted && !lookup->done && lookup->host.slen == host->slen &&
+                pj_stricmp(&lookup->host, host) == 0) {
+                return lookup;
+            }
+        }
+    }
+    return NULL;
+}
+
+//A retransmission of a message that is held back goes no further, the held copy carries on for both. Otherwise
+//the transaction layer would see the request twice.
+static pj_bool_t deferred_absorb_retransmission(const pjsip_rx_data* rdata)
+{
+    pj_bool_t found = PJ_FALSE;
+    unsigned i;
+
+    if (deferred_queue.mutex == NULL || NAT64_ATOMIC_LOAD(deferred_queue.count) == 0) {
+        return PJ_FALSE;
+    }
+    pj_mutex_lock(deferred_queue.mutex);
+    for (i = 0; i < deferred_queue.count && !found; i++) {
+        found = deferred_is_retransmission(deferred_queue.entries[i], rdata);
+    }
+    pj_mutex_unlock(deferred_queue.mutex);
+    if (found) {
+        PJ_LOG(4, (THIS_FILE, "Retransmission of a held back message, dropped"));
+    }
+    return found;
+}
+
+//Hold back the message until the hosts are resolved. Fails if the queue is full, the caller then resolves in place.
+//A host another held back message is already waiting for is not asked for again.
+static pj_status_t defer_rx(pjsip_rx_data* rdata, const nat64_host_set* hosts)
+{
+    pj_time_val timeout = {NAT64_DEFER_TIMEOUT_MSEC / 1000, NAT64_DEFER_TIMEOUT_MSEC % 1000};
+    nat64_deferred* deferred;
+    pjsip_rx_data* clone;
+    pj_status_t status;
+    unsigned remaining;
+    unsigned count = 0;
+    unsigned i;
+
+    if (deferred_queue.mutex == NULL || worker.thread_cnt == 0 || NAT64_ATOMIC_LOAD(deferred_queue.stopping) ||
+        NAT64_ATOMIC_LOAD(deferred_queue.count) >= NAT64_MAX_DEFERRED) {
+        return PJ_ETOOMANY;
+    }
+    status = pjsip_rx_data_clone(rdata, 0, &clone);
+    if (status != PJ_SUCCESS) {
+        return status;
+    }
+    deferred = PJ_POOL_ZALLOC_T(clone->tp_info.pool, nat64_deferred);
+    deferred->rdata = clone;
+    deferred->state = NAT64_DEFERRED_WAITING;
+    deferred->ref = 1;
+    clone->endpt_info.mod_data[ipv6_module.id] = deferred;
+    pj_timer_entry_init(&deferred->timer, 0, deferred, &deferred_on_timer);
+    //Hosts are copied, the original rdata is reused by the transport as soon as we return
+    if (hosts->discover_prefix) {
+        deferred->lookup[count++].deferred = deferred;
+    }
+    for (i = 0; i < hosts->count; i++) {
+        deferred->lookup[count].deferred = deferred;
+        pj_strdup(clone->tp_info.pool, &deferred->lookup[count++].host, &hosts->host[i]);
+    }
+
+    pj_mutex_lock(deferred_queue.mutex);
+    if (deferred_queue.stopping || deferred_queue.count >= NAT64_MAX_DEFERRED ||
+        pjsip_endpt_schedule_timer(pjsua_get_pjsip_endpt(), &deferred->timer, &timeout) != PJ_SUCCESS) {
+        pj_mutex_unlock(deferred_queue.mutex);
+        pjsip_rx_data_free_cloned(clone);
+        return PJ_ETOOMANY;
+    }
+    for (i = 0; i < count; i++) {
+        nat64_deferred_lookup* lookup = &deferred->lookup[i];
+        nat64_deferred_lookup* running = deferred_find_lookup(&lookup->host);
+        if (running != NULL) {
+            //Another held back message, or an earlier copy of this one, already asked for the host
+            lookup->next_waiter = running->waiters;
+            running->waiters = lookup;
+        } else if (worker_post(&deferred_lookup_job, lookup) == PJ_SUCCESS) {
+            lookup->posted = PJ_TRUE;
+        } else {
+            //The workers are saturated. The lookup is left out, the rewrite only takes what is in the cache by
+            //then and never asks the resolver on the timer thread.
+            continue;
+        }
+        deferred->remaining++;
+        deferred->ref++;
+    }
+    deferred->count = count;
+    deferred_queue.entries[deferred_queue.count++] = deferred;
+    remaining = deferred->remaining;
+    deferred_check_done(deferred);
+    pj_mutex_unlock(deferred_queue.mutex);
+    NAT64_ATOMIC_INC(module_stats.rx_deferred);
+    PJ_LOG(4, (THIS_FILE, "Holding back incoming message until %u lookups are done", remaining));
+    return PJ_SUCCESS;
+}
+
+//No message is held back or injected from here on. Waits for a timer callback that is injecting one right now, it
+//would restart at mod-ipv6 after the module is unregistered. Called before the modules are unregistered.
+static void deferred_stop()
+{
+    unsigned injecting;
+
+    if (deferred_queue.mutex == NULL) {
+        return;
+    }
+    pj_mutex_lock(deferred_queue.mutex);
+    deferred_queue.stopping = PJ_TRUE;
+    injecting = deferred_queue.injecting;
+    pj_mutex_unlock(deferred_queue.mutex);
+    while (injecting > 0) {
+        pj_thread_sleep(1);
+        pj_mutex_lock(deferred_queue.mutex);
+        injecting = deferred_queue.injecting;
+        pj_mutex_unlock(deferred_queue.mutex);
+    }
+}
+
+//Drop the messages still held back, called after the workers have stopped. A timer that already fired drops its
+//message itself, wait until it took it out of the queue.
+static void deferred_flush()
+{
+    unsigned i;
+
+    if (deferred_queue.mutex == NULL) {
+        return;
+    }
+    pj_mutex_lock(deferred_queue.mutex);
+    for (i = 0; i < deferred_queue.count;) {
+        nat64_deferred* deferred = deferred_queue.entries[i];
+        if (pj_timer_heap_cancel(pjsip_endpt_get_timer_heap(pjsua_get_pjsip_endpt()), &deferred->timer) == 1) {
+            //Only the timer reference is left once the workers are gone
+            deferred_queue.entries[i] = deferred_queue.entries[--deferred_queue.count];
+            pjsip_rx_data_free_cloned(deferred->rdata);
+        } else {
+            i++;
+        }
+    }
+    while (deferred_queue.count > 0) {
+        pj_mutex_unlock(deferred_queue.mutex);
+        pj_thread_sleep(1);
+        pj_mutex_lock(deferred_queue.mutex);
+    }
+    pj_mutex_unlock(deferred_queue.mutex);
+}
+
+/* Lookups done ahead of the first call by pj_nat64_prewarm: the NAT64 prefix, the proxies and registrar of the
+ * active account and the media relays from pj_nat64_set_media_relays. The hosts are collected by the API calls of
+ * the app into the snapshot, the job and the SIP threads never read pjsua_var. */
+#ifndef NAT64_MAX_MEDIA_RELAYS
+#   define NAT64_MAX_MEDIA_RELAYS           4
+#endif
+
+static struct nat64_prewarm {
+    pj_mutex_t*     mutex;
+    char            relay[NAT64_MAX_MEDIA_RELAYS][PJ_MAX_HOSTNAME];
+    unsigned        relay_cnt;
+    pj_bool_t       queued;
+    //A successful registration warms up once, the next one only after pj_nat64_flush_cache
+    pj_bool_t       registered;
+} prewarm;
+
+static void prewarm_add_host(nat64_prewarm_hosts* hosts, const char* host, pj_size_t len)
+{
+    unsigned i;
+    if (len == 0 || len >= PJ_MAX_HOSTNAME || hosts->count == NAT64_MAX_PREWARM_HOSTS) {
+        return;
+    }
+    for (i = 0; i < hosts->count; i++) {
+        if (pj_ansi_strnicmp(hosts->host[i], host, len) == 0 && hosts->host[i][len] == '\0') {
+            return;
+        }
+    }
+    pj_memcpy(hosts->host[hosts->count], host, len);
+    hosts->host[hosts->count++][len] = '\0';
+}
+
+//Add the host of a proxy or registrar uri such as sip:my_host:5060;transport=TCP
+static void prewarm_add_uri(nat64_prewarm_hosts* hosts, const pj_str_t* uri)
+{
+    char buf[PJ_MAX_HOSTNAME + 64];
+    char host[PJ_MAX_HOSTNAME + 64];
+    const char* start = host;
+    const char* at;
+
+    //Ipv6 literals need no lookup
+    if (uri->slen == 0 || uri->slen >= (pj_ssize_t)sizeof(buf) || pj_memchr(uri->ptr, '[', uri->slen) != NULL) {
+        return;
+    }
+    pj_memcpy(buf, uri->ptr, uri->slen);
+    buf[uri->slen] = '\0';
+    if (pj_nat64_get_hostname_from_proxy_string(buf, host) != PJ_SUCCESS) {
+        //Without a port the host ends at the parameters
+        const char* colon = strchr(buf, ':');
+        pj_size_t len;
+        if (colon == NULL) {
+            return;
+        }
+        len = strcspn(colon + 1, ";>");
+        pj_memcpy(host, colon + 1, len);
+        host[len] = '\0';
+    }
+    at = strchr(host, '@');
+    if (at != NULL) {
+        start = at + 1;
+    }
+    prewarm_add_host(hosts, start, strlen(start));
+}
+
+//Collect the hosts of the proxies, the registrar of acc_id and the media relays. Only called from the API calls of
+//the app, the PJSUA lock is not held together with the config mutex.
+static void prewarm_collect_hosts(pjsua_acc_id acc_id, nat64_prewarm_hosts* hosts)
+{
+    unsigned i;
+
+    hosts->count = 0;
+    //pjsua is up once the module is enabled, which collects the hosts again
+    if (module_pool == NULL) {
+        return;
+    }
+    PJSUA_LOCK();
+    for (i = 0; i < pjsua_var.ua_cfg.outbound_proxy_cnt; i++) {
+        prewarm_add_uri(hosts, &pjsua_var.ua_cfg.outbound_proxy[i]);
+    }
+    if (acc_id != PJSUA_INVALID_ID && pjsua_acc_is_valid(acc_id)) {
+        const pjsua_acc_config* acc_cfg = &pjsua_var.acc[acc_id].cfg;
+        for (i = 0; i < acc_cfg->proxy_cnt; i++) {
+            prewarm_add_uri(hosts, &acc_cfg->proxy[i]);
+        }
+        prewarm_add_uri(hosts, &acc_cfg->reg_uri);
+    }
+    PJSUA_UNLOCK();
+    if (prewarm.mutex != NULL) {
+        pj_mutex_lock(prewarm.mutex);
+        for (i = 0; i < prewarm.relay_cnt; i++) {
+            prewarm_add_host(hosts, prewarm.relay[i], strlen(prewarm.relay[i]));
+        }
+        pj_mutex_unlock(prewarm.mutex);
+    }
+}
+
+//Collect the hosts for the active account and publish them in a new snapshot
+static void prewarm_update_hosts()
+{
+    nat64_prewarm_hosts hosts;
+    nat64_config* cfg;
+
+    prewarm_collect_hosts(config_acc_id(), &hosts);
+    cfg = config_begin_update();
+    cfg->prewarm_hosts = hosts;
+    config_commit(cfg);
+}
+
+//Runs on a background worker
+static void prewarm_job(void* arg)
+{
+    nat64_prewarm_hosts hosts;
+    pj_str_t host_str[NAT64_MAX_PREWARM_HOSTS];
+    nat64_host_set set;
+    const nat64_config* cfg;
+    unsigned i;
+
+    PJ_UNUSED_ARG(arg);
+    pj_mutex_lock(prewarm.mutex);
+    prewarm.queued = PJ_FALSE;
+    pj_mutex_unlock(prewarm.mutex);
+
+    //With the prefix known the ipv4 literals among the hosts need no lookup at all
+    prefix_discover(PJ_TRUE);
+    pj_bzero(&set, sizeof(set));
+    cfg = config_acquire();
+    hosts = cfg->prewarm_hosts;
+    for (i = 0; i < hosts.count; i++) {
+        host_str[i] = pj_str(hosts.host[i]);
+        host_set_add(&cfg->global, &set, &host_str[i]);
+    }
+    config_release(cfg);
+    resolve_host_set(&set);
+    PJ_LOG(4, (THIS_FILE, "Prewarm done, %u of %u hosts were not cached yet", set.count, hosts.count));
+}
+
+//Queue the job unless one is waiting to start already, it takes the hosts of the snapshot when it runs
+static pj_status_t prewarm_post()
+{
+    pj_status_t status = PJ_SUCCESS;
+
+    if (prewarm.mutex == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    pj_mutex_lock(prewarm.mutex);
+    if (!prewarm.queued) {
+        status = worker_post(&prewarm_job, NULL);
+        prewarm.queued = (status == PJ_SUCCESS);
+    }
+    pj_mutex_unlock(prewarm.mutex);
+    return status;
+}
+
+//Prewarm only when some policy rewrites, networks without NAT64 pay nothing
+static void prewarm_if_active()
+{
+    const nat64_config* cfg = config_acquire();
+    pj_bool_t active = cfg->global.options != 0 || cfg->auto_policy[1].options != 0 || cfg->acc_policy_cnt > 0;
+    unsigned i;
+
+    for (i = 0; !active && i < NAT64_TRANSPORT_TYPES; i++) {
+        active = (cfg->type_policy_set & (1u << i)) && cfg->type_policy[i].options != 0;
+    }
+    config_release(cfg);
+    if (active) {
+        prewarm_post();
+    }
+}
+
+//A successful registration is the last chance to warm up before the first call. Runs on the SIP thread, which only
+//queues the job with the hosts the app calls collected.
+static void prewarm_on_registered()
+{
+    pj_bool_t first;
+
+    if (prewarm.mutex == NULL) {
+        return;
+    }
+    pj_mutex_lock(prewarm.mutex);
+    first = !prewarm.registered;
+    prewarm.registered = PJ_TRUE;
+    pj_mutex_unlock(prewarm.mutex);
+    if (first) {
+        prewarm_post();
+    }
+}
+
+/* Automatic NAT64 detection from pj_nat64_set_auto_detect. The decision is kept per transport family in the
+ * snapshot: ipv4 transports never rewrite, ipv6 transports rewrite once the network is found to have a NAT64 prefix.
+ * Messages on both families can be in flight at the same time, neither changes what the other one gets. */
+
+//With detection on, probe the network for its prefix right away so the first ipv6 message after detection was
+//turned on or the network changed is already rewritten
+static void detector_start()
+{
+    const nat64_config* cfg = config_acquire();
+    pj_bool_t detect = cfg->auto_options != 0;
+
+    config_release(cfg);
+    if (detect) {
+        prefix_discovery_start();
+    }
+}
+
+//With detection on and the prefix still unknown, for instance because the probe could not be queued, the next
+//message on an ipv6 transport starts it. Costs a compare otherwise.
+static void detector_check(const nat64_config* cfg, const pjsip_transport* tp)
+{
+    if (cfg->auto_options != 0 && tp != NULL && (tp->key.type & PJSIP_TRANSPORT_IPV6) &&
+        cfg->prefix_state == NAT64_PREFIX_UNKNOWN) {
+        prefix_discovery_start();
+    }
+}
+
+//Rewrite an incoming message with policy, returns PJ_TRUE if the message was held back
+static pj_bool_t rx_rewrite(const nat64_policy* policy, pjsip_rx_data *rdata)
+{
+    pjsip_cseq_hdr *cseq = rdata->msg_info.cseq;
+    const nat64_deferred* deferred = (const nat64_deferred*)rdata->endpt_info.mod_data[ipv6_module.id];
+    pj_bool_t rewrite_sdp;
+    pj_bool_t rewrite_route_and_contact;
+    pj_bool_t registered = rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG && deferred == NULL && cseq != NULL &&
+                           cseq->method.id == PJSIP_REGISTER_METHOD &&
+                           rdata->msg_info.msg->line.status.code / 100 == 2;
+
+    if (registered) {
+        policy_refresh_mapped_addr(policy, rdata);
+    }
+    if (policy->options == 0) {
+        return PJ_FALSE;
+    }
+    if (deferred != NULL && deferred->state == NAT64_DEFERRED_TIMED_OUT) {
+        //Held back too long, rewriting now would block on the same lookups
+        return PJ_FALSE;
+    }
+    if ((policy->options & NAT64_DEFER_RESOLUTION) && deferred == NULL && deferred_absorb_retransmission(rdata)) {
+        return PJ_TRUE;
+    }
+    if (rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG && deferred == NULL) {
+        if ((policy->options & NAT64_REWRITE_OUTGOING_SDP) && policy->mapped_addr.slen == 0) {
+            mapping_learn_from_via(rdata);
+        }
+        if (registered) {
+            prewarm_on_registered();
+        }
+    }
+    //Any offer or answer, INVITE, UPDATE, PRACK, ACK or a reliable 183
+    rewrite_sdp = (policy->options & NAT64_REWRITE_INCOMING_SDP) && may_carry_sdp(rdata->msg_info.msg);
+    rewrite_route_and_contact = (policy->options & NAT64_REWRITE_ROUTE_AND_CONTACT) && cseq != NULL &&
+                                cseq->method.id == PJSIP_INVITE_METHOD;
+    if (rewrite_sdp || rewrite_route_and_contact) {
+        pj_uint32_t msg_id = NAT64_TRACE_MSG_ID();
+        nat64_scratch* scratch = NULL;
+        nat64_host_set hosts;
+        pj_timestamp start;
+        unsigned replaced = 0;
+        PJ_LOG(4, (THIS_FILE, "Incoming sdp or INVITE dialog. If they contain IPv4 addresses, we need to change to ipv6"));
+        if (deferred == NULL) {
+            //Look up every host the message needs in one concurrent batch before rewriting
+            pj_bzero(&hosts, sizeof(hosts));
+            collect_message_hosts(policy, rdata, rewrite_sdp, rewrite_route_and_contact, &hosts);
+            if ((hosts.count > 0 || hosts.discover_prefix) && (policy->options & NAT64_DEFER_RESOLUTION) &&
+                defer_rx(rdata, &hosts) == PJ_SUCCESS) {
+                //The clone comes back here once the hosts are resolved, this copy goes no further
+                return PJ_TRUE;
+            }
+        } else {
+            //Back from the timer, the lookups are done and whatever they did not answer keeps its address
+            scratch = scratch_get();
+        }
+        pj_get_timestamp(&start);
+        NAT64_ATOMIC_INC(module_stats.rx_inspected);
+        if (scratch != NULL) {
+            scratch->cache_only = PJ_TRUE;
+        } else if (deferred == NULL) {
+            resolve_host_set(&hosts);
+        }
+        if (rewrite_sdp) {
+            if (policy->options & NAT64_REWRITE_PARSED_SDP) {
+                replaced = replace_parsed_sdp_ipv4_with_ipv6(policy, rdata);
+            } else {
+                replaced = replace_sdp_ipv4_with_ipv6(policy, rdata, msg_id);
+            }
+        }
+        if (rewrite_route_and_contact) {
+            replace_route_and_contact_ipv4_with_ipv6(policy, rdata, msg_id);
+        }
+        if (scratch != NULL) {
+            scratch->cache_only = PJ_FALSE;
+        }
+        if (replaced > 0) {
+            NAT64_ATOMIC_INC(module_stats.rx_rewritten);
+            NAT64_ATOMIC_ADD(module_stats.addresses_replaced, replaced);
+        }
+        histogram_add(&module_stats.rewrite_usec, &start);
+        NAT64_TRACE(trace_message(msg_id, PJ_FALSE, rdata->msg_info.len, replaced, &start));
+    }
+
+    return PJ_FALSE;
+}
+
+//Checks made before the snapshot is taken, most messages have nothing for us
+static pj_bool_t transport_may_rewrite(const pjsip_transport* tp)
+{
+    return tp == NULL || (tp->key.type & PJSIP_TRANSPORT_IPV6) || NAT64_ATOMIC_LOAD(config_ipv4_active);
+}
+
+static pj_status_t ipv6_mod_on_rx(pjsip_rx_data *rdata)
+{
+    const pjsip_msg* msg = rdata->msg_info.msg;
+    const nat64_config* cfg;
+    pj_bool_t held;
+
+    //Responses carry the mapped address and the Via to learn from, INVITE dialogs get Route and Contact rewritten
+    if (!transport_may_rewrite(rdata->tp_info.transport) ||
+        (msg->body == NULL && msg->type != PJSIP_RESPONSE_MSG &&
+         (rdata->msg_info.cseq == NULL || rdata->msg_info.cseq->method.id != PJSIP_INVITE_METHOD))) {
+        return PJ_FALSE;
+    }
+    //The policy lives in the snapshot, hold it for the whole message
+    cfg = config_acquire();
+    detector_check(cfg, rdata->tp_info.transport);
+    held = rx_rewrite(policy_for_transport(cfg, rdata->tp_info.transport), rdata);
+    config_release(cfg);
+    return held;
+}
+
+pj_status_t ipv6_mod_on_tx(pjsip_tx_data *tdata)
+{
+    const nat64_config* cfg;
+    const nat64_policy* policy;
+
+    if (!may_carry_sdp(tdata->msg) || !transport_may_rewrite(tdata->tp_info.transport)) {
+        return PJ_SUCCESS;
+    }
+    cfg = config_acquire();
+    detector_check(cfg, tdata->tp_info.transport);
+    policy = policy_for_transport(cfg, tdata->tp_info.transport);
+    if ((policy->options & NAT64_REWRITE_OUTGOING_SDP) &&
+        (!(policy->options & NAT64_REWRITE_PARSED_SDP) ||
+         tdata->mod_data[ipv6_sdp_module.id] == &tx_buffer_rewrite_marker)) {
+        if (tx_memo_is_current(tdata, ipv6_module.id)) {
+            //Retransmission of a buffer we already rewrote
+            NAT64_ATOMIC_INC(module_stats.memo_hits);
+            NAT64_TRACE(trace_memo_hit(NAT64_TRACE_MSG_ID(), PJ_TRUE));
+        } else {
+            PJ_LOG(4, (THIS_FILE, "Outgoing sdp. If it contains IPv6 addresses, we need to change to ipv4"));
+            record_tx_rewrite(policy, replace_sdp_ipv6_with_ipv4, tdata);
+            tx_memo_store(tdata, ipv6_module.id);
+        }
+    }
+    config_release(cfg);
+    return PJ_SUCCESS;
+}
+
+//Runs before the message is printed by the transport layer
+static pj_status_t ipv6_sdp_mod_on_tx(pjsip_tx_data *tdata)
+{
+    const nat64_config* cfg;
+    const nat64_policy* policy;
+
+    if (!may_carry_sdp(tdata->msg) || !transport_may_rewrite(tdata->tp_info.transport)) {
+        return PJ_SUCCESS;
+    }
+    cfg = config_acquire();
+    detector_check(cfg, tdata->tp_info.transport);
+    policy = policy_for_transport(cfg, tdata->tp_info.transport);
+    if ((policy->options & NAT64_REWRITE_OUTGOING_SDP) && (policy->options & NAT64_REWRITE_PARSED_SDP)) {
+        //The body is replaced when rewritten, a retransmission still carries the body we left behind
+        if (tdata->mod_data[ipv6_sdp_module.id] == tdata->msg->body) {
+            NAT64_ATOMIC_INC(module_stats.memo_hits);
+            NAT64_TRACE(trace_memo_hit(NAT64_TRACE_MSG_ID(), PJ_TRUE));
+        } else {
+            record_tx_rewrite(policy, replace_parsed_sdp_ipv6_with_ipv4, tdata);
+            if (tdata->mod_data[ipv6_sdp_module.id] != &tx_buffer_rewrite_marker) {
+                tdata->mod_data[ipv6_sdp_module.id] = tdata->msg->body;
+            }
+        }
+    }
+    config_release(cfg);
+    return PJ_SUCCESS;
+}
+
+/* L1 rewrite module for sdp info.*/
+static pjsip_module ipv6_module = {
+    NULL, NULL,                     /* prev, next.      */
+    { "mod-ipv6", 8},                 /* Name.        */
+    -1,                             /* Id           */
+    0,/* Priority            */
+    NULL,                           /* load()       */
+    NULL,                           /* start()      */
+    NULL,                           /* stop()       */
+    NULL,                           /* unload()     */
+    &ipv6_mod_on_rx,                /* on_rx_request()  */
+    &ipv6_mod_on_rx,                /* on_rx_response() */
+    &ipv6_mod_on_tx,                /* on_tx_request.   */
+    &ipv6_mod_on_tx,                /* on_tx_response() */
+    NULL,                           /* on_tsx_state()   */
+};
+
+/* Rewrite module for parsed sdp, placed above the transport layer which prints the message.*/
+static pjsip_module ipv6_sdp_module = {
+    NULL, NULL,                     /* prev, next.      */
+    { "mod-ipv6-sdp", 12},          /* Name.        */
+    -1,                             /* Id           */
+    PJSIP_MOD_PRIORITY_TRANSPORT_LAYER + 1,/* Priority            */
+    NULL,                           /* load()       */
+    NULL,                           /* start()      */
+    NULL,                           /* stop()       */
+    NULL,                           /* unload()     */
+    NULL,                           /* on_rx_request()  */
+    NULL,                           /* on_rx_response() */
+    &ipv6_sdp_mod_on_tx,            /* on_tx_request.   */
+    &ipv6_sdp_mod_on_tx,            /* on_tx_response() */
+    NULL,                           /* on_tsx_state()   */
+};
+
+static int worker_thread(void* arg)
+{
+    PJ_UNUSED_ARG(arg);
+    for (;;) {
+        nat64_job_func func;
+        void* job_arg;
+
+        pj_sem_wait(worker.sem);
+        pj_mutex_lock(worker.mutex);
+        if (worker.count == 0) {
+            pj_bool_t quit = worker.quit;
+            pj_mutex_unlock(worker.mutex);
+            if (quit) {
+                break;
+            }
+            continue;
+        }
+        func = worker.jobs[worker.head].func;
+        job_arg = worker.jobs[worker.head].arg;
+        worker.head = (worker.head + 1) % NAT64_MAX_PENDING_JOBS;
+        worker.count--;
+        pj_mutex_unlock(worker.mutex);
+
+        func(job_arg);
+    }
+    return 0;
+}
+
+//Queue a job for the background workers. Jobs are started in order, up to NAT64_WORKER_THREADS at a time.
+static pj_status_t worker_post(nat64_job_func func, void* arg)
+{
+    if (worker.thread_cnt == 0) {
+        return PJ_EINVALIDOP;
+    }
+    pj_mutex_lock(worker.mutex);
+    if (worker.count == NAT64_MAX_PENDING_JOBS) {
+        pj_mutex_unlock(worker.mutex);
+        return PJ_ETOOMANY;
+    }
+    worker.jobs[(worker.head + worker.count) % NAT64_MAX_PENDING_JOBS].func = func;
+    worker.jobs[(worker.head + worker.count) % NAT64_MAX_PENDING_JOBS].arg = arg;
+    worker.count++;
+    pj_mutex_unlock(worker.mutex);
+    pj_sem_post(worker.sem);
+    return PJ_SUCCESS;
+}
+
+static void worker_stop();
+
+static pj_status_t worker_start()
+{
+    pj_status_t status;
+    worker.quit = PJ_FALSE;
+    worker.head = worker.count = 0;
+    worker.thread_cnt = 0;
+    status = pj_mutex_create_simple(module_pool, "nat64worker", &worker.mutex);
+    if (status == PJ_SUCCESS) {
+        status = pj_sem_create(module_pool, "nat64worker", 0, NAT64_MAX_PENDING_JOBS + NAT64_WORKER_THREADS,
+                               &worker.sem);
+    }
+    while (status == PJ_SUCCESS && worker.thread_cnt < NAT64_WORKER_THREADS) {
+        status = pj_thread_create(module_pool, "nat64worker", &worker_thread, NULL, 0, 0,
+                                  &worker.thread[worker.thread_cnt]);
+        if (status == PJ_SUCCESS) {
+            worker.thread_cnt++;
+        }
+    }
+    if (status != PJ_SUCCESS) {
+        //Stop the threads already running, the caller releases the rest with the pool
+        worker_stop();
+    }
+    return status;
+}
+
+//Runs the jobs already queued and stops the workers
+static void worker_stop()
+{
+    unsigned i;
+    if (worker.thread_cnt == 0) {
+        return;
+    }
+    pj_mutex_lock(worker.mutex);
+    worker.quit = PJ_TRUE;
+    pj_mutex_unlock(worker.mutex);
+    for (i = 0; i < worker.thread_cnt; i++) {
+        pj_sem_post(worker.sem);
+    }
+    for (i = 0; i < worker.thread_cnt; i++) {
+        pj_thread_join(worker.thread[i]);
+        pj_thread_destroy(worker.thread[i]);
+        worker.thread[i] = NULL;
+    }
+    worker.thread_cnt = 0;
+    pj_sem_destroy(worker.sem);
+    pj_mutex_destroy(worker.mutex);
+}
+
+pj_status_t pj_nat64_enable_rewrite_module()
+{
+    nat64_prewarm_hosts hosts;
+    pj_status_t status;
+    nat64_config* cfg;
+
+    if (module_pool == NULL) {
+        module_pool = pjsua_pool_create("nat64", 1024, 1024);
+        if (module_pool == NULL) {
+            return PJ_ENOMEM;
+        }
+        config_init_defaults();
+        if (multipart_print_body == NULL) {
+            pjsip_msg_body* multipart = pjsip_multipart_create(module_pool, NULL, NULL);
+            multipart_print_body = multipart != NULL ? multipart->print_body : NULL;
+        }
+        mapping_table.count = 0;
+        mapping_table.stun_server[0] = '\0';
+        prewarm.relay_cnt = 0;
+        prewarm.queued = PJ_FALSE;
+        prewarm.registered = PJ_FALSE;
+        prefix_discovery.pending = PJ_FALSE;
+        deferred_queue.stopping = PJ_FALSE;
+        mapping_table.timer_armed = 0;
+        pj_bzero(mapping_table.mapped_pending, sizeof(mapping_table.mapped_pending));
+        pj_bzero(mapping_table.mapped_addr, sizeof(mapping_table.mapped_addr));
+        pj_timer_entry_init(&mapping_table.refresh_timer, 0, NULL, &stun_on_refresh_timer);
+        status = pj_mutex_create_simple(module_pool, "nat64cache", &synth_cache.mutex);
+        if (status == PJ_SUCCESS) {
+            status = pj_mutex_create_simple(module_pool, "nat64cfg", &config_mutex);
+        }
+        if (status == PJ_SUCCESS) {
+            status = rx_memo_init();
+        }
+        if (status == PJ_SUCCESS) {
+            status = pj_mutex_create_simple(module_pool, "nat64defer", &deferred_queue.mutex);
+        }
+        if (status == PJ_SUCCESS) {
+            status = pj_mutex_create_simple(module_pool, "nat64mapping", &mapping_table.mutex);
+        }
+        if (status == PJ_SUCCESS) {
+            status = pj_mutex_create_simple(module_pool, "nat64prewarm", &prewarm.mutex);
+        }
+        if (status == PJ_SUCCESS) {
+            status = pj_mutex_create_simple(module_pool, "nat64prefix", &prefix_discovery.mutex);
+        }
+        if (status == PJ_SUCCESS) {
+            status = scratch_init();
+        }
+        if (status == PJ_SUCCESS) {
+            status = worker_start();
+        }
+        if (status != PJ_SUCCESS) {
+            scratch_destroy();
+            rx_memo_destroy();
+            pj_pool_release(module_pool);
+            module_pool = NULL;
+            synth_cache.mutex = NULL;
+            config_mutex = NULL;
+            deferred_queue.mutex = NULL;
+            mapping_table.mutex = NULL;
+            prewarm.mutex = NULL;
+            prefix_discovery.mutex = NULL;
+            return status;
+        }
+    }
+    prewarm_collect_hosts(config_acc_id(), &hosts);
+    cfg = config_begin_update();
+    cfg->global.options = (nat64_options)0;
+    cfg->auto_options = (nat64_options)0;
+    cfg->prewarm_hosts = hosts;
+    config_commit(cfg);
+    pj_nat64_flush_cache();
+    status = pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &ipv6_module);
+    if (status == PJ_SUCCESS) {
+        status = pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &ipv6_sdp_module);
+    }
+    return status;
+}
+
+pj_status_t pj_nat64_disable_rewrite_module()
+{
+    pj_status_t status;
+
+    deferred_stop();
+    status = pjsip_endpt_unregister_module(pjsua_get_pjsip_endpt(), &ipv6_module);
+    pjsip_endpt_unregister_module(pjsua_get_pjsip_endpt(), &ipv6_sdp_module);
+    if (module_pool != NULL) {
+        //No new refresh once the server is cleared, the mapping mutex lives until the running timer and the last
+        //job are done
+        stun_stop();
+        worker_stop();
+        pj_mutex_destroy(mapping_table.mutex);
+        mapping_table.mutex = NULL;
+        pj_mutex_destroy(prewarm.mutex);
+        prewarm.mutex = NULL;
+        pj_mutex_destroy(prefix_discovery.mutex);
+        prefix_discovery.mutex = NULL;
+        deferred_flush();
+        pj_mutex_destroy(deferred_queue.mutex);
+        deferred_queue.mutex = NULL;
+        scratch_destroy();
+        rx_memo_destroy();
+        //Nothing takes a new reference once the modules, workers and timers are gone. Wait for the ones still held,
+        //then go back to the static snapshot before the pool goes away.
+        config_wait_readers();
+        initial_config.cfg = active_config->cfg;
+        config_fix_mapped_addr(&initial_config.cfg);
+        //Transport and account policies refer to transports of this session
+        initial_config.cfg.type_policy_set = 0;
+        initial_config.cfg.acc_policy_cnt = 0;
+        initial_config.cfg.auto_options = (nat64_options)0;
+        pj_bzero(initial_config.cfg.acc_policy_index, sizeof(initial_config.cfg.acc_policy_index));
+        initial_config.refs = 0;
+        active_config = &initial_config;
+        config_publish_ipv4_active(&initial_config.cfg);
+        retired_configs = NULL;
+        pj_mutex_destroy(config_mutex);
+        config_mutex = NULL;
+        pj_mutex_destroy(synth_cache.mutex);
+        synth_cache.mutex = NULL;
+        synth_cache.count = 0;
+        pj_pool_release(module_pool);
+        module_pool = NULL;
+    }
+    return status;
+}
+
+void pj_nat64_set_options(nat64_options options)
+{
+    nat64_prewarm_hosts hosts;
+    nat64_config* cfg;
+
+    prewarm_collect_hosts(config_acc_id(), &hosts);
+    cfg = config_begin_update();
+    cfg->global.options = options;
+    //Options set by hand win over detection
+    cfg->auto_options = (nat64_options)0;
+    cfg->prewarm_hosts = hosts;
+    config_commit(cfg);
+    prewarm_if_active();
+}
+
+pj_status_t pj_nat64_set_auto_detect(nat64_options options)
+{
+    nat64_config* cfg;
+
+    if (module_pool == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    //The decision follows the prefix state of the snapshot, no flips of the global options
+    cfg = config_begin_update();
+    cfg->auto_options = options;
+    config_commit(cfg);
+    prewarm_if_active();
+    detector_start();
+    return PJ_SUCCESS;
+}
+
+//Resolve host into every A/AAAA address in the order of the resolver, on a NAT64 network each A record is followed
+//by its synthesized form
+static void resolve_all_addresses(const pj_str_t* host, pj_uint16_t port, pj_nat64_resolve_result* result)
+{
+    pj_addrinfo ai[PJ_NAT64_MAX_ADDRESSES];
+    unsigned count = PJ_ARRAY_SIZE(ai);
+    unsigned i, j;
+    const nat64_config* cfg;
+
+    result->count = 0;
+    result->winner = -1;
+    if (resolver_cb(PJ_AF_UNSPEC, host, &count, ai) != PJ_SUCCESS || count == 0) {
+        result->status = PJ_ENOTFOUND;
+        return;
+    }
+
+    prefix_discover(PJ_TRUE);
+    cfg = config_acquire();
+
+    for (i = 0; i < count && result->count < PJ_NAT64_MAX_ADDRESSES; i++) {
+        pj_sockaddr* addr = &ai[i].ai_addr;
+        pj_sockaddr synthesized;
+        pj_bool_t duplicate = PJ_FALSE;
+
+        if (addr->addr.sa_family != PJ_AF_INET6 && addr->addr.sa_family != PJ_AF_INET) {
+            continue;
+        }
+        result->addr[result->count++] = *addr;
+
+        //On a NAT64 network the A records are only reachable through their synthesized form
+        if (addr->addr.sa_family != PJ_AF_INET || cfg->prefix_state != NAT64_PREFIX_DISCOVERED ||
+            result->count == PJ_NAT64_MAX_ADDRESSES) {
+            continue;
+        }
+        pj_sockaddr_init(PJ_AF_INET6, &synthesized, NULL, 0);
+        embed_ipv4_in_prefix(&cfg->prefix, cfg->prefix_len, &addr->ipv4.sin_addr, &synthesized.ipv6.sin6_addr);
+        for (j = 0; j < count; j++) {
+            if (pj_sockaddr_cmp(&ai[j].ai_addr, &synthesized) == 0) {
+                duplicate = PJ_TRUE;
+                break;
+            }
+        }
+        if (!duplicate) {
+            result->addr[result->count++] = synthesized;
+        }
+    }
+    config_release(cfg);
+    for (i = 0; i < result->count; i++) {
+        pj_sockaddr_set_port(&result->addr[i], port);
+    }
+    result->status = result->count > 0 ? PJ_SUCCESS : PJ_ENOTFOUND;
+}
+
+//Order the addresses for connection attempts as RFC 8305 section 4: ipv6 first, then alternating between the
+//families. The order within each family is kept.
+static void order_for_happy_eyeballs(pj_nat64_resolve_result* result)
+{
+    pj_sockaddr ipv6[PJ_NAT64_MAX_ADDRESSES];
+    pj_sockaddr ipv4[PJ_NAT64_MAX_ADDRESSES];
+    unsigned ipv6_cnt = 0, ipv4_cnt = 0;
+    unsigned i, j, n;
+
+    for (i = 0; i < result->count; i++) {
+        if (result->addr[i].addr.sa_family == PJ_AF_INET6) {
+            ipv6[ipv6_cnt++] = result->addr[i];
+        } else {
+            ipv4[ipv4_cnt++] = result->addr[i];
+        }
+    }
+    for (i = 0, j = 0, n = 0; i < ipv6_cnt || j < ipv4_cnt;) {
+        if (i < ipv6_cnt) {
+            result->addr[n++] = ipv6[i++];
+        }
+        if (j < ipv4_cnt) {
+            result->addr[n++] = ipv4[j++];
+        }
+    }
+}
+
+static void replace_hostname_with_ip(char* proxy_hostname)
+{
+    pj_str_t hostname = pj_str(proxy_hostname);
+    pj_nat64_resolve_result result;
+    resolve_all_addresses(&hostname, 0, &result);
+
+    if (result.count > 0) {
+        if (result.addr[0].addr.sa_family == PJ_AF_INET) {
+            pj_inet_ntop(PJ_AF_INET, &result.addr[0].ipv4.sin_addr, proxy_hostname, PJ_MAX_HOSTNAME);
+        } else if (result.addr[0].addr.sa_family == PJ_AF_INET6) {
+            proxy_hostname[0] = '[';
+            pj_inet_ntop(PJ_AF_INET6, &result.addr[0].ipv6.sin6_addr, proxy_hostname+1, PJ_MAX_HOSTNAME);
+            strcat(proxy_hostname, "]");
+
+        }
+    }
+}
+
+pj_status_t pj_nat64_get_hostname_from_proxy_string(char* proxy, char* hostname_buf)
+{
+    pj_bool_t proxy_is_static_ip_v6_address = strchr(proxy, ']') != NULL ? PJ_TRUE : PJ_FALSE;
+    char* addr_start = strchr(proxy, ':');
+    char* addr_end = NULL;
+
+    if (addr_start != NULL) {
+        addr_start++;
+        if (proxy_is_static_ip_v6_address) {
+            addr_end = strstr(proxy, "]:");
+        } else {
+            addr_end = strstr(addr_start, ":");
+        }
+        if (addr_end != NULL) {
+            strncpy(hostname_buf, addr_start, addr_end-addr_start);
+            hostname_buf[addr_end - addr_start] = '\0';
+            return PJ_SUCCESS;
+        }
+    }
+    return PJ_EIGNORED;
+}
+
+pj_status_t pj_nat64_resolve_and_replace_hostname_with_ip_if_possible(char* proxy, char* resolved_proxy_buf)
+{
+    char hostname_buf[PJ_MAX_HOSTNAME];
+    pj_bool_t proxy_is_static_ip_v6_address = strchr(proxy, ']') != NULL ? PJ_TRUE : PJ_FALSE;
+    char* addr_start = strchr(proxy, ':');
+    char* addr_end = NULL;
+
+    if (addr_start != NULL) {
+        addr_start++;
+        if (proxy_is_static_ip_v6_address) {
+            addr_end = strstr(proxy, "]:");
+        } else {
+            addr_end = strstr(addr_start, ":");
+        }
+        if (addr_end != NULL) {
+            size_t len_sip_sips = addr_start - proxy;
+            size_t len_port_and_tail = strlen(proxy) - (addr_end -
+                                       proxy);
+            strncpy(hostname_buf, addr_start, addr_end-addr_start);
+            hostname_buf[addr_end - addr_start] = '\0';
+
+            replace_hostname_with_ip(hostname_buf);
+            pj_ansi_snprintf(resolved_proxy_buf, PJ_MAX_HOSTNAME, "%.*s%s%.*s",  (int)len_sip_sips,
+                             proxy, hostname_buf, (int)len_port_and_tail, addr_end);
+            return PJ_SUCCESS;
+        }
+    }
+    return PJ_EIGNORED;
+}
 
-static pjsua_acc_id active_add_id = PJSUA_INVALID_ID;
+//Copy the mapped address of the account so the SIP threads never read pjsua_var without the PJSUA lock. Later
+//registrations of the account refresh the copy through policy_refresh_mapped_addr.
+static void policy_copy_mapped_addr(nat64_policy* policy, pjsua_acc_id acc_id)
+{
+    policy->mapped_addr.ptr = policy->mapped_addr_buf;
+    policy->mapped_addr.slen = 0;
+    policy->mapped_acc_id = PJSUA_INVALID_ID;
+    if (acc_id != PJSUA_INVALID_ID && pjsua_var.acc[acc_id].cfg.allow_sdp_nat_rewrite) {
+        policy->mapped_acc_id = acc_id;
+    }
+    if (policy->mapped_acc_id != PJSUA_INVALID_ID && pjsua_var.acc[acc_id].reg_mapped_addr.slen > 0 &&
+        pjsua_var.acc[acc_id].reg_mapped_addr.slen < (pj_ssize_t)sizeof(policy->mapped_addr_buf)) {
+        pj_memcpy(policy->mapped_addr_buf, pjsua_var.acc[acc_id].reg_mapped_addr.ptr,
+                  pjsua_var.acc[acc_id].reg_mapped_addr.slen);
+        policy->mapped_addr.slen = pjsua_var.acc[acc_id].reg_mapped_addr.slen;
+    }
+}
 
-/* Syntax error handler for parser. */
-static void on_syntax_error(pj_scanner *scanner)
+void pj_nat64_set_active_account(pjsua_acc_id acc_id)
 {
-    PJ_UNUSED_ARG(scanner);
-    PJ_LOG(4, (THIS_FILE, "Scanner syntax error at %s", scanner->curptr));
-    PJ_THROW(PJ_EINVAL);
+    nat64_prewarm_hosts hosts;
+    nat64_config* cfg;
+
+    prewarm_collect_hosts(acc_id, &hosts);
+    cfg = config_begin_update();
+    cfg->acc_id = acc_id;
+    cfg->prewarm_hosts = hosts;
+    policy_copy_mapped_addr(&cfg->global, acc_id);
+    config_commit(cfg);
+    prewarm_if_active();
 }
 
-//Helper function to find a specific string using the scanner.
-//It returns the pointer to where the string is found and the number of chars parsed (i.e. not the length of the string)
-void scanner_find_string( pj_scanner *scanner, char* wanted, pj_str_t *result)
+void pj_nat64_policy_default(pj_nat64_policy* policy)
 {
-    pj_scan_state state;
-    pj_scan_save_state( scanner, &state);
-    do {
-        pj_scan_get_until_ch(scanner, wanted[0], result);
-        if (pj_scan_strcmp(scanner, wanted, (int)strlen(wanted)) == 0) {
-            //Found wanted string, update real scanner
-            unsigned steps_to_advance = (unsigned)(scanner->curptr - state.curptr);
-            pj_scan_restore_state(scanner, &state);
-            pj_scan_advance_n(scanner, steps_to_advance, PJ_FALSE);
-            result->ptr = scanner->curptr;
-            result->slen = steps_to_advance;
-            break;
-        } else {
-            pj_scan_advance_n(scanner, 1, PJ_FALSE);
-        }
+    pj_bzero(policy, sizeof(*policy));
+}
 
-        if (pj_scan_is_eof(scanner)) {
-            PJ_LOG(4, (THIS_FILE, "Scanner EOF"));
+//Build the internal form of a policy. Returns PJ_FALSE if the prefix is invalid.
+static pj_bool_t policy_create(const pj_nat64_policy* settings, pjsua_acc_id acc_id, nat64_policy* policy)
+{
+    pj_bzero(policy, sizeof(*policy));
+    policy->options = (nat64_options)settings->options;
+    if (settings->mapped_addr.slen > 0) {
+        if (settings->mapped_addr.slen >= (pj_ssize_t)sizeof(policy->mapped_addr_buf)) {
+            return PJ_FALSE;
+        }
+        pj_memcpy(policy->mapped_addr_buf, settings->mapped_addr.ptr, settings->mapped_addr.slen);
+        policy->mapped_addr.ptr = policy->mapped_addr_buf;
+        policy->mapped_addr.slen = settings->mapped_addr.slen;
+        policy->mapped_acc_id = PJSUA_INVALID_ID;
+    } else {
+        policy_copy_mapped_addr(policy, acc_id);
+    }
+    if (settings->prefix.slen > 0) {
+        switch (settings->prefix_len) {
+        case 32: case 40: case 48: case 56: case 64: case 96:
             break;
+        default:
+            return PJ_FALSE;
         }
-
-    } while (1);
+        if (pj_inet_pton(PJ_AF_INET6, &settings->prefix, &policy->prefix) != PJ_SUCCESS) {
+            return PJ_FALSE;
+        }
+        policy->prefix_len = settings->prefix_len;
+        policy->has_prefix = PJ_TRUE;
+    }
+    return PJ_TRUE;
 }
 
-static int calculate_new_content_length(char* buffer)
+pj_status_t pj_nat64_set_transport_policy(pjsip_transport_type_e type, const pj_nat64_policy* policy)
 {
-    char* body_delim = "\r\n\r\n"; //Sip message body starts with a newline and final empty line after sdp does not count
-    char* body_start = strstr(buffer, body_delim);
-    if (body_start != NULL) {
-        body_start = body_start + strlen(body_delim);
-        return (int)strlen(body_start);
+    int slot = transport_type_slot(type);
+    nat64_policy created;
+    nat64_config* cfg;
+
+    PJ_ASSERT_RETURN(slot >= 0, PJ_EINVAL);
+    if (module_pool == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    if (policy != NULL && !policy_create(policy, PJSUA_INVALID_ID, &created)) {
+        return PJ_EINVAL;
+    }
+    cfg = config_begin_update();
+    if (policy != NULL) {
+        cfg->type_policy[slot] = created;
+        cfg->type_policy[slot].mapped_addr.ptr = cfg->type_policy[slot].mapped_addr_buf;
+        cfg->type_policy_set |= 1u << slot;
     } else {
-        PJ_LOG(1, (THIS_FILE,
-                   "Error: Could not find Content-Length header. The correct length can not be set. This must never happen."));
-        return -1;
+        cfg->type_policy_set &= ~(1u << slot);
     }
+    config_commit(cfg);
+    return PJ_SUCCESS;
 }
 
-//Helper that will resolve or synthesize to ipv6. Output buffer will be null terminated
-static void resolve_or_synthesize_ipv4_to_ipv6(pj_str_t* host_or_ip, char* buf, int buf_len)
+pj_status_t pj_nat64_set_account_policy(pjsua_acc_id acc_id, const pj_nat64_policy* policy)
 {
-    unsigned int count = 1;
-    pj_addrinfo ai[1];
-    pj_getaddrinfo(PJ_AF_UNSPEC, host_or_ip, &count, ai);
+    pjsua_transport_id tp_id;
+    const void* key;
+    nat64_policy created;
+    nat64_config* cfg;
+    unsigned i;
 
-    if (count > 0) {
-        if (ai[0].ai_addr.addr.sa_family == PJ_AF_INET) {
-            pj_inet_ntop(PJ_AF_INET, &ai[0].ai_addr.ipv4.sin_addr, buf, PJ_INET_ADDRSTRLEN);
-        } else if (ai[0].ai_addr.addr.sa_family == PJ_AF_INET6) {
-            pj_inet_ntop(PJ_AF_INET6, &ai[0].ai_addr.ipv6.sin6_addr, buf,
-                         PJ_INET6_ADDRSTRLEN);
-        } else {
-            PJ_LOG(1, (THIS_FILE, "Error: Unknown AF %d use original input", ai[0].ai_addr.addr.sa_family));
-            pj_ansi_snprintf(buf, buf_len, "%.*s", (int)host_or_ip->slen, host_or_ip->ptr);
+    PJ_ASSERT_RETURN(acc_id >= 0 && acc_id < (pjsua_acc_id)PJ_ARRAY_SIZE(pjsua_var.acc), PJ_EINVAL);
+    if (module_pool == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    tp_id = pjsua_var.acc[acc_id].cfg.transport_id;
+    if (policy != NULL && (tp_id < 0 || tp_id >= (pjsua_transport_id)PJ_ARRAY_SIZE(pjsua_var.tpdata) ||
+                           pjsua_var.tpdata[tp_id].data.ptr == NULL)) {
+        //Messages can only be matched to an account through its transport
+        return PJ_EINVALIDOP;
+    }
+    key = policy != NULL ? pjsua_var.tpdata[tp_id].data.ptr : NULL;
+    if (policy != NULL && !policy_create(policy, acc_id, &created)) {
+        return PJ_EINVAL;
+    }
+
+    cfg = config_begin_update();
+    for (i = 0; i < cfg->acc_policy_cnt; i++) {
+        if (cfg->acc_policy[i].acc_id == acc_id) {
+            break;
+        }
+    }
+    if (policy == NULL) {
+        if (i < cfg->acc_policy_cnt) {
+            cfg->acc_policy[i] = cfg->acc_policy[--cfg->acc_policy_cnt];
+            cfg->acc_policy[i].policy.mapped_addr.ptr = cfg->acc_policy[i].policy.mapped_addr_buf;
         }
     } else {
-        PJ_LOG(1, (THIS_FILE, "Error: Synthesizing media ip failed, ai count = 0. Use original input"));
-        pj_ansi_snprintf(buf, buf_len, "%.*s", (int)host_or_ip->slen, host_or_ip->ptr);
+        //Unchanged copies are published on error, that is harmless
+        if (i == NAT64_MAX_ACCOUNT_POLICIES) {
+            config_commit(cfg);
+            return PJ_ETOOMANY;
+        }
+        cfg->acc_policy[i].acc_id = acc_id;
+        cfg->acc_policy[i].key = key;
+        cfg->acc_policy[i].policy = created;
+        cfg->acc_policy[i].policy.mapped_addr.ptr = cfg->acc_policy[i].policy.mapped_addr_buf;
+        if (i == cfg->acc_policy_cnt) {
+            cfg->acc_policy_cnt++;
+        }
     }
+    config_commit(cfg);
+    return PJ_SUCCESS;
 }
 
-static int update_content_length(char* buffer, pjsip_msg* msg)
+void pj_nat64_flush_cache()
 {
-#define CONTENT_LEN_BUF_SIZE 10
-    PJ_USE_EXCEPTION;
-    pj_scanner scanner;
-    pj_str_t result = {NULL, 0};
-    pj_str_t current_content_len;
-    char* content_length = "Content-Length";
-    char new_content_len_buf[CONTENT_LEN_BUF_SIZE];
-    int new_content_len = calculate_new_content_length(buffer);
-    if (new_content_len == -1) {
-        return -1;
+    nat64_config* cfg;
+    if (synth_cache.mutex == NULL) {
+        return;
     }
+    pj_mutex_lock(synth_cache.mutex);
+    synth_cache.count = 0;
+    pj_mutex_unlock(synth_cache.mutex);
+    rx_memo_flush();
+    //So is the public address, ask the STUN server right away instead of waiting for the next refresh
+    pj_mutex_lock(mapping_table.mutex);
+    mapping_table.count = 0;
+    stun_schedule_refresh(0);
+    pj_mutex_unlock(mapping_table.mutex);
+    //The prefix belongs to the network as well, discover it again when next needed
+    cfg = config_begin_update();
+    cfg->prefix_state = NAT64_PREFIX_UNKNOWN;
+    config_commit(cfg);
+    pj_mutex_lock(prewarm.mutex);
+    prewarm.registered = PJ_FALSE;
+    pj_mutex_unlock(prewarm.mutex);
+    //The new network starts cold, get the lookups of the first call done now
+    prewarm_if_active();
+    detector_start();
+}
 
-    //Step 1: Update the pjsip_msg to reflect the new body size (for incoming messages only)
-    if (msg != NULL) {
-        msg->body->len = (int)new_content_len;
+void pj_nat64_get_cache_stats(pj_nat64_cache_stats* stats)
+{
+    if (synth_cache.mutex == NULL) {
+        *stats = synth_cache.stats;
+        return;
     }
+    pj_mutex_lock(synth_cache.mutex);
+    *stats = synth_cache.stats;
+    stats->entries = synth_cache.count;
+    pj_mutex_unlock(synth_cache.mutex);
+}
+
+pj_status_t pj_nat64_discover_prefix()
+{
+    return prefix_discover(PJ_FALSE);
+}
+
+pj_status_t pj_nat64_get_prefix(char* prefix_buf, int buf_len, unsigned* prefix_len)
+{
+    const nat64_config* cfg = config_acquire();
+    pj_status_t status = PJ_ENOTFOUND;
 
-    //Step 2: Rewrite the buffer so the Content-Length header is correct
-    pj_scan_init(&scanner, buffer, strlen(buffer), 0, &on_syntax_error);
+    if (cfg->prefix_state == NAT64_PREFIX_DISCOVERED) {
+        *prefix_len = cfg->prefix_len;
+        status = pj_inet_ntop(PJ_AF_INET6, &cfg->prefix, prefix_buf, buf_len);
+    }
+    config_release(cfg);
+    return status;
+}
 
-    pj_ansi_snprintf(new_content_len_buf, CONTENT_LEN_BUF_SIZE, "%d", new_content_len);
+pj_status_t pj_nat64_set_stun_server(const pj_str_t* server)
+{
+    if (mapping_table.mutex == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    if (server != NULL && server->slen >= (pj_ssize_t)sizeof(mapping_table.stun_server)) {
+        return PJ_ENAMETOOLONG;
+    }
+    pj_mutex_lock(mapping_table.mutex);
+    if (server != NULL && server->slen > 0) {
+        pj_memcpy(mapping_table.stun_server, server->ptr, server->slen);
+        mapping_table.stun_server[server->slen] = '\0';
+    } else {
+        mapping_table.stun_server[0] = '\0';
+    }
+    stun_schedule_refresh(0);
+    pj_mutex_unlock(mapping_table.mutex);
+    return PJ_SUCCESS;
+}
 
-    PJ_TRY {
-        scanner_find_string(&scanner, content_length, &result);
+pj_status_t pj_nat64_prewarm()
+{
+    if (prewarm.mutex == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    //A job that has not started yet picks up the new hosts
+    prewarm_update_hosts();
+    return prewarm_post();
+}
 
-        pj_scan_get_until_chr(&scanner, "0123456789", &result);
+pj_status_t pj_nat64_set_media_relays(const pj_str_t relays[], unsigned count)
+{
+    unsigned i;
 
-        pj_scan_get_until_ch(&scanner, '\r', &result);
-        pj_strset(&current_content_len, result.ptr, result.slen);
-        PJ_LOG(4, (THIS_FILE, "Current Content-Length is: %.*s and new Content-Length is %d .", current_content_len.slen, current_content_len.ptr, new_content_len));
-        if (strlen(new_content_len_buf) <= current_content_len.slen)
-        {
-            int len_offset = (int)(result.ptr - scanner.begin);
-            PJ_LOG(4, (THIS_FILE, "Updated content length needs the same or less bytes, no need to do buffer copy"));
-            //even though scanner and buffer are in different memory locations the content is identical
-            pj_memset(buffer + len_offset, ' ', result.slen);
-            pj_memcpy(buffer + len_offset, new_content_len_buf, strlen(new_content_len_buf));
-        } else {
-            PJ_TODO(SUPPORT_GROWING_THE_BUFFER);
-            PJ_LOG(4, (THIS_FILE, "Updated content length needs more bytes than old one, we must do expand and copy. TODO"));
-        }
-    } PJ_CATCH_ANY {
-        PJ_LOG(4, (THIS_FILE, "Exception thrown when searching for Content-Length, incorrect value will be used. Must never happen."));
-    }
-    PJ_END;
-    pj_scan_fini(&scanner);
-    return new_content_len;
-}
-
-//For outgoing INVITE and 200 OK
-static void replace_sdp_ipv6_with_ipv4(pjsip_tx_data *tdata)
-{
-    PJ_USE_EXCEPTION;
-    pj_scanner scanner;
-    pj_str_t result = {NULL, 0};
-    char* org_buffer = tdata->buf.start;
-    char new_buffer[PJSIP_MAX_PKT_LEN];
-    char* walker_p = new_buffer;
-    pj_str_t ipv4_str = pj_str("IP4");
-    pj_str_t unroutable_host = pj_str("192.168.1.1");
-    pj_bzero(new_buffer, PJSIP_MAX_PKT_LEN);
-
-    PJ_LOG(4, (THIS_FILE, "**********Outgoing INVITE or 200 with IPv6 address*************"));
-
-    pj_scan_init(&scanner, org_buffer, strlen(org_buffer), 0, &on_syntax_error);
-
-    PJ_TRY {
-        do {
-            //Find instance of IP6
-            scanner_find_string(&scanner, "IP6", &result);
-            pj_memcpy(walker_p, (result.ptr - result.slen), result.slen);
-            walker_p = walker_p + result.slen;
-
-            //Replace with IP6
-            pj_memcpy(walker_p, ipv4_str.ptr, ipv4_str.slen);
-            walker_p = walker_p + ipv4_str.slen;
-            pj_scan_get_n(&scanner, (int)ipv4_str.slen, &result);
-
-            //Find start of IP address and copy (hopefully only 1 whitespace)
-            pj_scan_get_until_chr(&scanner, "0123456789abcdef", &result);
-            pj_memcpy(walker_p, result.ptr, result.slen);
-            walker_p = walker_p + result.slen;
-
-            //Extract IP address
-            pj_scan_get_until_ch( &scanner, '\r', &result);
-            PJ_LOG(4, (THIS_FILE, "Extracted ip6 address as %.*s", result.slen, result.ptr));
-
-            if (active_add_id != PJSUA_INVALID_ID && pjsua_var.acc[active_add_id].cfg.allow_sdp_nat_rewrite && pjsua_var.acc[active_add_id].reg_mapped_addr.slen)
-            {
-                PJ_LOG(4, (THIS_FILE, "Replace local ipv6 address with address from Via header (%.*s)",
-                pjsua_var.acc[active_add_id].reg_mapped_addr.slen, pjsua_var.acc[active_add_id].reg_mapped_addr.ptr));
-                pj_memcpy(walker_p, pjsua_var.acc[active_add_id].reg_mapped_addr.ptr,
-                pjsua_var.acc[active_add_id].reg_mapped_addr.slen);
-                walker_p = walker_p + pjsua_var.acc[active_add_id].reg_mapped_addr.slen;
-            } else {
-                //Replace with unroutable address so latching is used,
-                pj_memcpy(walker_p, unroutable_host.ptr, unroutable_host.slen);
-                walker_p = walker_p + unroutable_host.slen;
-            }
-            //In case this is the last occurance in the message, lets append the rest but do not advance walker_p in case there is more
-            //The scanner string is always null terminated so include the terminating character as well
-            pj_memcpy(walker_p, scanner.curptr, (scanner.end - scanner.curptr) +1);
-        } while (!pj_scan_is_eof(&scanner));
-
-
-    } PJ_CATCH_ANY {
-        if (strlen(new_buffer) > 0)
-        {
-            pj_memcpy(org_buffer, new_buffer, strlen(new_buffer));
-            org_buffer[strlen(new_buffer)] = '\0';
-            update_content_length(tdata->buf.start, NULL);
-            PJ_LOG(4, (THIS_FILE,
-            "We have successfully parsed the INVITE/200 OK until EOF. Replace tx buffer. pjsip will now send the modified TX packet."));
-            PJ_LOG(4, (THIS_FILE, "**********Modified outgoing INVITE or 200 with IPv6 address*************"));
-            PJ_LOG(4, (THIS_FILE, "%s", org_buffer));
-            PJ_LOG(4, (THIS_FILE, "***************************************************************"));
-        } else {
-            PJ_LOG(1, (THIS_FILE, "Error: Parsing of the outgoing INVITE/200 OK failed at %s. Leave incoming buffer as is", scanner.curptr));
+    if (prewarm.mutex == NULL) {
+        return PJ_EINVALIDOP;
+    }
+    if (count > NAT64_MAX_MEDIA_RELAYS) {
+        return PJ_ETOOMANY;
+    }
+    for (i = 0; i < count; i++) {
+        if (relays[i].slen >= PJ_MAX_HOSTNAME) {
+            return PJ_ENAMETOOLONG;
         }
-        pj_scan_fini(&scanner);
-        return;
     }
-    PJ_END;
-    pj_scan_fini(&scanner);
+    pj_mutex_lock(prewarm.mutex);
+    for (i = 0; i < count; i++) {
+        pj_memcpy(prewarm.relay[i], relays[i].ptr, relays[i].slen);
+        prewarm.relay[i][relays[i].slen] = '\0';
+    }
+    prewarm.relay_cnt = count;
+    pj_mutex_unlock(prewarm.mutex);
+    prewarm_update_hosts();
+    return PJ_SUCCESS;
+}
+
+pj_status_t pj_nat64_get_public_address(const pj_str_t* local_addr, char* buf, int buf_len)
+{
+    return mapping_lookup(local_addr, buf, buf_len) ? PJ_SUCCESS : PJ_ENOTFOUND;
 }
 
+void pj_nat64_set_resolver(pj_nat64_getaddrinfo_cb cb)
+{
+    resolver_cb = cb != NULL ? cb : &pj_getaddrinfo;
+}
 
-//For incoming INVITE and 200 OK
-static void replace_sdp_ipv4_with_ipv6(pjsip_rx_data *rdata)
+//Split sip:host:port;params into the host, without brackets for ipv6 literals, and the port
+static pj_status_t split_proxy_host_port(const char* proxy, char* host_buf, pj_uint16_t* port)
 {
-    PJ_USE_EXCEPTION;
-    pj_scanner scanner;
-    pj_str_t result = {NULL, 0};
-    char* org_buffer = rdata->msg_info.msg_buf;
-    char new_buffer[PJSIP_MAX_PKT_LEN];
-    char* walker_p = new_buffer;
-    pj_str_t ipv6_str = pj_str("IP6");
+    const char* host_end;
+    pj_size_t host_len;
+    pj_str_t port_str;
+
+    if (pj_nat64_get_hostname_from_proxy_string((char*)proxy, host_buf) != PJ_SUCCESS) {
+        return PJ_EIGNORED;
+    }
+    host_len = strlen(host_buf);
+    host_end = strstr(proxy, host_buf) + host_len;
+    if (host_buf[0] == '[') {
+        pj_memmove(host_buf, host_buf + 1, host_len);
+        host_end++;
+    }
+    *port = (pj_uint16_t)(*host_end == ':' ? pj_strtoul(pj_cstr(&port_str, host_end + 1)) : 0);
+    return PJ_SUCCESS;
+}
+
+typedef struct nat64_async_resolve {
+    pj_pool_t*                  pool;
+    char                        host[PJ_MAX_HOSTNAME];
+    pj_uint16_t                 port;
+    pj_nat64_resolve_result     result;
+    pj_nat64_resolve_cb         cb;
+    void*                       user_data;
+    pj_timer_entry              timer;
+} nat64_async_resolve;
 
-    pj_bzero(new_buffer, PJSIP_MAX_PKT_LEN);
+//Runs on the pjsip thread polling the endpoint
+static void async_resolve_on_timer(pj_timer_heap_t* timer_heap, pj_timer_entry* entry)
+{
+    nat64_async_resolve* req = (nat64_async_resolve*)entry->user_data;
+    PJ_UNUSED_ARG(timer_heap);
+    req->cb(req->user_data, &req->result);
+    pj_pool_release(req->pool);
+}
 
-    PJ_LOG(4, (THIS_FILE, "**********Incoming INVITE or 200 with IPv4 address*************"));
-    PJ_LOG(4, (THIS_FILE, "%s", org_buffer));
-    PJ_LOG(4, (THIS_FILE, "***************************************************************"));
+//Runs on the background worker
+static void async_resolve_job(void* arg)
+{
+    nat64_async_resolve* req = (nat64_async_resolve*)arg;
+    pj_str_t host = pj_str(req->host);
+    pj_time_val delay = {0, 0};
 
-    pj_scan_init(&scanner, org_buffer, strlen(org_buffer), 0, &on_syntax_error);
+    resolve_all_addresses(&host, req->port, &req->result);
+    pj_timer_entry_init(&req->timer, 0, req, &async_resolve_on_timer);
+    if (pjsip_endpt_schedule_timer(pjsua_get_pjsip_endpt(), &req->timer, &delay) != PJ_SUCCESS) {
+        PJ_LOG(1, (THIS_FILE, "Error: Could not schedule resolve callback for %s", req->host));
+        pj_pool_release(req->pool);
+    }
+}
 
-    PJ_TRY {
-        do {
-            //Find instance of IP4
-            scanner_find_string(&scanner, "IP4", &result);
-            pj_memcpy(walker_p, (result.ptr - result.slen), result.slen);
-            walker_p = walker_p + result.slen;
+pj_status_t pj_nat64_resolve_proxy_async(const char* proxy, void* user_data, pj_nat64_resolve_cb cb)
+{
+    nat64_async_resolve* req;
+    pj_pool_t* pool;
+    pj_status_t status;
 
-            //Replace with IP6
-            pj_memcpy(walker_p, ipv6_str.ptr, ipv6_str.slen);
-            walker_p = walker_p + ipv6_str.slen;
-            pj_scan_get_n(&scanner, (int)ipv6_str.slen, &result);
+    PJ_ASSERT_RETURN(proxy && cb, PJ_EINVAL);
+    if (worker.thread_cnt == 0) {
+        return PJ_EINVALIDOP;
+    }
 
-            //Find start of IP address and copy (hopefully only 1 whitespace)
-            pj_scan_get_until_chr(&scanner, "0123456789", &result);
-            pj_memcpy(walker_p, result.ptr, result.slen);
-            walker_p = walker_p + result.slen;
+    pool = pjsua_pool_create("nat64res", 512, 512);
+    if (pool == NULL) {
+        return PJ_ENOMEM;
+    }
+    req = PJ_POOL_ZALLOC_T(pool, nat64_async_resolve);
+    req->pool = pool;
+    req->cb = cb;
+    req->user_data = user_data;
+    status = split_proxy_host_port(proxy, req->host, &req->port);
+    if (status == PJ_SUCCESS) {
+        status = worker_post(&async_resolve_job, req);
+    }
+    if (status != PJ_SUCCESS) {
+        pj_pool_release(pool);
+    }
+    return status;
+}
 
-            //Extract IP address
-            pj_scan_get_until_ch( &scanner, '\r', &result);
-            PJ_LOG(4, (THIS_FILE, "Extracted ip4 address as %.*s", result.slen, result.ptr));
+typedef struct nat64_race nat64_race;
 
-            resolve_or_synthesize_ipv4_to_ipv6(&result, walker_p, (PJSIP_MAX_PKT_LEN - (int)strlen(walker_p)));
+typedef struct nat64_race_attempt {
+    nat64_race*         race;
+    int                 idx;
+    pj_activesock_t*    asock;
+} nat64_race_attempt;
 
-            //walker_p is now null terminated, reset it to point at the end of the current buffer (without null termination)
-            walker_p = walker_p + strlen(walker_p);
+struct nat64_race {
+    pj_pool_t*                  pool;
+    pj_grp_lock_t*              grp_lock;
+    pj_nat64_resolve_result     result;
+    nat64_race_attempt          attempt[PJ_NAT64_MAX_ADDRESSES];
+    unsigned                    started;
+    unsigned                    failed;
+    pj_bool_t                   done;
+    pj_bool_t                   reported;
+    pj_timer_entry              timer;
+    pj_nat64_resolve_cb         cb;
+    void*                       user_data;
+};
 
-            //In case this is the last occurance in the message, lets append the rest but do not advance walker_p in case there is more
-            //The scanner string is always null terminated so include the terminating character as well
-            pj_memcpy(walker_p, scanner.curptr, (scanner.end - scanner.curptr) +1);
-        } while (!pj_scan_is_eof(&scanner));
+enum { RACE_TIMER_NEXT_ATTEMPT = 1, RACE_TIMER_TIMEOUT = 2 };
 
+static void race_on_destroy(void* member)
+{
+    nat64_race* race = (nat64_race*)member;
+    pj_pool_release(race->pool);
+}
 
-    } PJ_CATCH_ANY {
-        if (strlen(new_buffer) > 0)
-        {
-            pj_memcpy(org_buffer, new_buffer, strlen(new_buffer));
-            org_buffer[strlen(new_buffer)] = '\0';
-            update_content_length(org_buffer, rdata->msg_info.msg);
-            PJ_LOG(4, (THIS_FILE,
-            "We have successfully parsed the INVITE/200 OK until EOF. Replace rx buffer. pjsip will now print the modified rx packet."));
-            //Update all internal packet sizes (body->len has already been updated by update_content_length)
-            rdata->pkt_info.len = strlen(rdata->pkt_info.packet);
-            rdata->msg_info.len = (int)rdata->pkt_info.len;
-            rdata->tp_info.transport->last_recv_len = rdata->pkt_info.len;
-        } else {
-            PJ_LOG(1, (THIS_FILE, "Error: Parsing of the incoming INVITE/200 OK failed at %s. Leave incoming buffer as is", scanner.curptr));
+//Close every outstanding attempt. The winning connection is closed as well, the transport makes its own.
+//Called with the group lock held.
+static void race_complete(nat64_race* race, int winner)
+{
+    unsigned i;
+    race->done = PJ_TRUE;
+    race->result.winner = winner;
+    pj_timer_heap_cancel_if_active(pjsip_endpt_get_timer_heap(pjsua_get_pjsip_endpt()), &race->timer, 0);
+    for (i = 0; i < race->started; i++) {
+        if (race->attempt[i].asock != NULL) {
+            pj_activesock_close(race->attempt[i].asock);
+            race->attempt[i].asock = NULL;
         }
-        pj_scan_fini(&scanner);
-        return;
     }
-    PJ_END;
-    pj_scan_fini(&scanner);
-    return;
 }
 
-static void replace_route_and_contact_ipv4_with_ipv6(pjsip_rx_data *rdata)
+//Report the result once, outside the group lock
+static void race_report_if_done(nat64_race* race)
 {
-    char ipv6_buf[PJ_INET6_ADDRSTRLEN] = {0} ;
-    pjsip_route_hdr* current_route_hdr = NULL;
+    pj_bool_t report;
+    pj_grp_lock_acquire(race->grp_lock);
+    report = race->done && !race->reported;
+    race->reported = PJ_TRUE;
+    pj_grp_lock_release(race->grp_lock);
 
-    pjsip_contact_hdr *current_contact_hdr = (pjsip_contact_hdr*)pjsip_msg_find_hdr( rdata->msg_info.msg, PJSIP_H_CONTACT,
-            NULL);
-    if (current_contact_hdr != NULL) {
-        pjsip_sip_uri * sip_uri = NULL;
-        sip_uri = (pjsip_sip_uri *)pjsip_uri_get_uri(current_contact_hdr->uri);
-        PJ_LOG(4, (THIS_FILE, "Host in Contact header is %.*s",sip_uri->host.slen, sip_uri->host.ptr));
+    if (report) {
+        race->cb(race->user_data, &race->result);
+        pj_grp_lock_dec_ref(race->grp_lock);
+    }
+}
 
-        resolve_or_synthesize_ipv4_to_ipv6(&sip_uri->host, ipv6_buf, PJ_INET6_ADDRSTRLEN);
-        pj_strdup2(rdata->tp_info.pool, &sip_uri->host, ipv6_buf);
+static pj_bool_t race_on_connect_complete(pj_activesock_t* asock, pj_status_t status);
+
+static void race_schedule(nat64_race* race, int id, unsigned msec)
+{
+    pj_time_val delay;
+    delay.sec = msec / 1000;
+    delay.msec = msec % 1000;
+    pj_timer_heap_cancel_if_active(pjsip_endpt_get_timer_heap(pjsua_get_pjsip_endpt()), &race->timer, 0);
+    pj_timer_heap_schedule_w_grp_lock(pjsip_endpt_get_timer_heap(pjsua_get_pjsip_endpt()), &race->timer, &delay,
+                                      id, race->grp_lock);
+}
+
+//Start the next connection attempt, called with the group lock held
+static void race_start_next(nat64_race* race)
+{
+    pj_activesock_cb asock_cb;
+
+    pj_bzero(&asock_cb, sizeof(asock_cb));
+    asock_cb.on_connect_complete = &race_on_connect_complete;
+    while (!race->done && race->started < race->result.count) {
+        nat64_race_attempt* attempt = &race->attempt[race->started];
+        pj_sockaddr* addr = &race->result.addr[race->started];
+        pj_activesock_cfg cfg;
+        pj_sock_t sock;
+        pj_status_t status;
+
+        attempt->race = race;
+        attempt->idx = (int)race->started++;
+        pj_activesock_cfg_default(&cfg);
+        cfg.grp_lock = race->grp_lock;
+
+        status = pj_sock_socket(addr->addr.sa_family, pj_SOCK_STREAM(), 0, &sock);
+        if (status == PJ_SUCCESS) {
+            status = pj_activesock_create(race->pool, sock, pj_SOCK_STREAM(), &cfg,
+                                          pjsip_endpt_get_ioqueue(pjsua_get_pjsip_endpt()),
+                                          &asock_cb, attempt, &attempt->asock);
+            if (status != PJ_SUCCESS) {
+                pj_sock_close(sock);
+            }
+        }
+        if (status == PJ_SUCCESS) {
+            status = pj_activesock_start_connect(attempt->asock, race->pool, addr, pj_sockaddr_get_len(addr));
+        }
+
+        if (status == PJ_SUCCESS) {
+            race_complete(race, attempt->idx);
+            return;
+        } else if (status == PJ_EPENDING) {
+            race_schedule(race, race->started < race->result.count ? RACE_TIMER_NEXT_ATTEMPT : RACE_TIMER_TIMEOUT,
+                          race->started < race->result.count ? NAT64_RACE_ATTEMPT_DELAY_MSEC : NAT64_RACE_TIMEOUT_MSEC);
+            return;
+        }
+
+        if (attempt->asock != NULL) {
+            pj_activesock_close(attempt->asock);
+            attempt->asock = NULL;
+        }
+        race->failed++;
     }
 
-    //This part is not tested since our messages does not contain Route headers.
-    //According to pjsip Route header has prio over the Contact header.
-    current_route_hdr = (pjsip_route_hdr*)pjsip_msg_find_hdr( rdata->msg_info.msg, PJSIP_H_ROUTE, NULL);
-    if (current_route_hdr != NULL) {
-        pjsip_sip_uri * sip_uri = NULL;
-        sip_uri = (pjsip_sip_uri *)pjsip_uri_get_uri(current_route_hdr->name_addr.uri);
-        PJ_LOG(4, (THIS_FILE, "Host in Route header is %.*s",sip_uri->host.slen, sip_uri->host.ptr));
-        resolve_or_synthesize_ipv4_to_ipv6(&sip_uri->host, ipv6_buf, PJ_INET6_ADDRSTRLEN);
-        pj_strdup2(rdata->tp_info.pool, &sip_uri->host, ipv6_buf);
+    if (!race->done && race->failed == race->result.count) {
+        race_complete(race, -1);
     }
 }
 
-
-static pj_status_t ipv6_mod_on_rx(pjsip_rx_data *rdata)
+static pj_bool_t race_on_connect_complete(pj_activesock_t* asock, pj_status_t status)
 {
+    nat64_race_attempt* attempt = (nat64_race_attempt*)pj_activesock_get_user_data(asock);
+    nat64_race* race = attempt->race;
 
-    pjsip_cseq_hdr *cseq = rdata->msg_info.cseq;
-    PJ_LOG(4, (THIS_FILE, "ipv6_mod_on_rx"));
+    pj_grp_lock_acquire(race->grp_lock);
+    if (attempt->asock == NULL) {
+        //Already closed by race_complete
+        pj_grp_lock_release(race->grp_lock);
+        return PJ_FALSE;
+    }
 
-    if (cseq != NULL && cseq->method.id == PJSIP_INVITE_METHOD) {
-        PJ_LOG(4, (THIS_FILE, "Incoming INVITE or 200 OK. If they contain IPv4 addresses, we need to change to ipv6"));
-        if (module_options & NAT64_REWRITE_INCOMING_SDP) {
-            replace_sdp_ipv4_with_ipv6(rdata);
-        }
-        if (module_options &  NAT64_REWRITE_ROUTE_AND_CONTACT) {
-            replace_route_and_contact_ipv4_with_ipv6(rdata);
+    if (status == PJ_SUCCESS) {
+        race_complete(race, attempt->idx);
+    } else {
+        pj_activesock_close(asock);
+        attempt->asock = NULL;
+        race->failed++;
+        if (race->failed == race->result.count) {
+            race_complete(race, -1);
+        } else {
+            //RFC 8305: a failed attempt starts the next one without waiting for the delay
+            race_start_next(race);
         }
     }
+    pj_grp_lock_release(race->grp_lock);
 
+    race_report_if_done(race);
     return PJ_FALSE;
 }
 
-pj_status_t ipv6_mod_on_tx(pjsip_tx_data *tdata)
+static void race_on_timer(pj_timer_heap_t* timer_heap, pj_timer_entry* entry)
 {
-    if (module_options & NAT64_REWRITE_OUTGOING_SDP) {
-        pjsip_cseq_hdr *cseq = (pjsip_cseq_hdr*)pjsip_msg_find_hdr( tdata->msg, PJSIP_H_CSEQ, NULL);
-        PJ_TODO(CHECK_OUTGOING_BUFFER_SIZE_HANDLING);
-        PJ_LOG(4, (THIS_FILE, "ipv6_mod_on_tx"));
+    nat64_race* race = (nat64_race*)entry->user_data;
+    PJ_UNUSED_ARG(timer_heap);
 
-        if (cseq != NULL && cseq->method.id == PJSIP_INVITE_METHOD) {
-            PJ_LOG(4, (THIS_FILE, "Outgoing INVITE or 200 OK. If it contains IPv6 addresses, we need to change to ipv4"));
-            replace_sdp_ipv6_with_ipv4(tdata);
+    pj_grp_lock_acquire(race->grp_lock);
+    if (!race->done) {
+        if (entry->id == RACE_TIMER_TIMEOUT) {
+            race_complete(race, -1);
+        } else {
+            race_start_next(race);
         }
     }
-    return PJ_SUCCESS;
-}
+    pj_grp_lock_release(race->grp_lock);
 
-/* L1 rewrite module for sdp info.*/
-static pjsip_module ipv6_module = {
-    NULL, NULL,                     /* prev, next.      */
-    { "mod-ipv6", 8},                 /* Name.        */
-    -1,                             /* Id           */
-    0,/* Priority            */
-    NULL,                           /* load()       */
-    NULL,                           /* start()      */
-    NULL,                           /* stop()       */
-    NULL,                           /* unload()     */
-    &ipv6_mod_on_rx,                /* on_rx_request()  */
-    &ipv6_mod_on_rx,                /* on_rx_response() */
-    &ipv6_mod_on_tx,                /* on_tx_request.   */
-    &ipv6_mod_on_tx,                /* on_tx_response() */
-    NULL,                           /* on_tsx_state()   */
-};
+    race_report_if_done(race);
+}
 
-pj_status_t pj_nat64_enable_rewrite_module()
+pj_status_t pj_nat64_race_connect(const pj_nat64_resolve_result* result, void* user_data, pj_nat64_resolve_cb cb)
 {
-    module_options = 0;
-    return pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &ipv6_module);
+    nat64_race* race;
+    pj_pool_t* pool;
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN(result && cb, PJ_EINVAL);
+    if (result->count == 0) {
+        return PJ_ENOTFOUND;
+    }
+
+    pool = pjsua_pool_create("nat64race", 1024, 512);
+    if (pool == NULL) {
+        return PJ_ENOMEM;
+    }
+    race = PJ_POOL_ZALLOC_T(pool, nat64_race);
+    race->pool = pool;
+    race->result = *result;
+    race->result.winner = -1;
+    order_for_happy_eyeballs(&race->result);
+    race->cb = cb;
+    race->user_data = user_data;
+    pj_timer_entry_init(&race->timer, 0, race, &race_on_timer);
+
+    status = pj_grp_lock_create(pool, NULL, &race->grp_lock);
+    if (status != PJ_SUCCESS) {
+        pj_pool_release(pool);
+        return status;
+    }
+    //This reference is dropped once the result has been reported
+    pj_grp_lock_add_ref(race->grp_lock);
+    pj_grp_lock_add_handler(race->grp_lock, pool, race, &race_on_destroy);
+
+    pj_grp_lock_acquire(race->grp_lock);
+    race_start_next(race);
+    pj_grp_lock_release(race->grp_lock);
+
+    race_report_if_done(race);
+    return PJ_SUCCESS;
 }
 
-pj_status_t pj_nat64_disable_rewrite_module()
+//Copy the statistics field by field, a new field of pj_nat64_stats has to be added here
+static void stats_copy(pj_nat64_stats* dst, const pj_nat64_stats* src)
 {
-    return pjsip_endpt_unregister_module( pjsua_get_pjsip_endpt(),
-                                          &ipv6_module);
+    unsigned i;
+
+#define NAT64_STATS_COPY(field) NAT64_ATOMIC_STORE(dst->field, NAT64_ATOMIC_LOAD(src->field))
+    NAT64_STATS_COPY(rx_inspected);
+    NAT64_STATS_COPY(rx_rewritten);
+    NAT64_STATS_COPY(tx_inspected);
+    NAT64_STATS_COPY(tx_rewritten);
+    NAT64_STATS_COPY(addresses_replaced);
+    NAT64_STATS_COPY(rewrite_failures);
+    NAT64_STATS_COPY(resolver_calls);
+    NAT64_STATS_COPY(resolver_failures);
+    NAT64_STATS_COPY(cache_hits);
+    NAT64_STATS_COPY(local_syntheses);
+    NAT64_STATS_COPY(content_length_growth);
+    NAT64_STATS_COPY(memo_hits);
+    NAT64_STATS_COPY(rx_deferred);
+    NAT64_STATS_COPY(defer_timeouts);
+    for (i = 0; i < PJ_NAT64_HISTOGRAM_BUCKETS; i++) {
+        NAT64_STATS_COPY(rewrite_usec.count[i]);
+        NAT64_STATS_COPY(resolve_usec.count[i]);
+    }
+#undef NAT64_STATS_COPY
 }
 
-void pj_nat64_set_options(nat64_options options)
+void pj_nat64_get_stats(pj_nat64_stats* stats)
 {
-    module_options = options;
+    stats_copy(stats, &module_stats);
+    if (synth_cache.mutex != NULL) {
+        pj_mutex_lock(synth_cache.mutex);
+        stats->cache_hits = synth_cache.stats.hits + synth_cache.stats.negative_hits;
+        pj_mutex_unlock(synth_cache.mutex);
+    }
 }
 
-static void replace_hostname_with_ip(char* proxy_hostname)
+void pj_nat64_reset_stats()
 {
-    pj_str_t hostname = pj_str(proxy_hostname);
-    unsigned int count = 1;
-    pj_addrinfo ai[1];
-    pj_getaddrinfo(PJ_AF_UNSPEC, &hostname, &count, ai);
+    static const pj_nat64_stats zero_stats;
+    stats_copy(&module_stats, &zero_stats);
+}
 
-    if (count > 0) {
-        if (ai[0].ai_addr.addr.sa_family == PJ_AF_INET) {
-            pj_inet_ntop(PJ_AF_INET, &ai[0].ai_addr.ipv4.sin_addr, proxy_hostname, PJ_MAX_HOSTNAME);
-        } else if (ai[0].ai_addr.addr.sa_family == PJ_AF_INET6) {
-            proxy_hostname[0] = '[';
-            pj_inet_ntop(PJ_AF_INET6, &ai[0].ai_addr.ipv6.sin6_addr, proxy_hostname+1, PJ_MAX_HOSTNAME);
-            strcat(proxy_hostname, "]");
+#if NAT64_HAS_TRACE
+//Copy the record written at pos, fails if it is being written or was already overwritten
+static pj_bool_t trace_copy(pj_uint32_t pos, pj_nat64_trace_record* record)
+{
+    const pj_uint32_t* seq = &trace_ring.slot[pos & (NAT64_TRACE_SIZE - 1)].seq;
+    if (NAT64_ATOMIC_ACQUIRE(*seq) != pos + 1) {
+        return PJ_FALSE;
+    }
+    *record = trace_ring.slot[pos & (NAT64_TRACE_SIZE - 1)].record;
+    NAT64_ATOMIC_FENCE();
+    return NAT64_ATOMIC_LOAD(*seq) == pos + 1;
+}
 
-        }
+static const char* trace_format_address(pj_uint8_t family, const pj_uint8_t* addr, char* buf, int len)
+{
+    if (family == 0 || pj_inet_ntop(family == 6 ? PJ_AF_INET6 : PJ_AF_INET, addr, buf, len) != PJ_SUCCESS) {
+        return "<hostname>";
     }
+    return buf;
 }
+#endif
 
-pj_status_t pj_nat64_get_hostname_from_proxy_string(char* proxy, char* hostname_buf)
+unsigned pj_nat64_trace_read(pj_nat64_trace_record records[], unsigned max)
 {
-    pj_bool_t proxy_is_static_ip_v6_address = strchr(proxy, ']') != NULL ? PJ_TRUE : PJ_FALSE;
-    char* addr_start = strchr(proxy, ':');
-    char* addr_end = NULL;
+#if NAT64_HAS_TRACE
+    pj_uint32_t head = NAT64_ATOMIC_ACQUIRE(trace_ring.head);
+    pj_uint32_t pos = head - PJ_MIN(PJ_MIN(head, NAT64_TRACE_SIZE), max);
+    unsigned count = 0;
 
-    if (addr_start != NULL) {
-        addr_start++;
-        if (proxy_is_static_ip_v6_address) {
-            addr_end = strstr(proxy, "]:");
-        } else {
-            addr_end = strstr(addr_start, ":");
-        }
-        if (addr_end != NULL) {
-            strncpy(hostname_buf, addr_start, addr_end-addr_start);
-            hostname_buf[addr_end - addr_start] = '\0';
-            return PJ_SUCCESS;
+    for (; pos != head; pos++) {
+        if (trace_copy(pos, &records[count])) {
+            count++;
         }
     }
-    return PJ_EIGNORED;
+    return count;
+#else
+    PJ_UNUSED_ARG(records);
+    PJ_UNUSED_ARG(max);
+    return 0;
+#endif
 }
 
-pj_status_t pj_nat64_resolve_and_replace_hostname_with_ip_if_possible(char* proxy, char* resolved_proxy_buf)
+void pj_nat64_trace_dump()
 {
-    char hostname_buf[PJ_MAX_HOSTNAME];
-    pj_bool_t proxy_is_static_ip_v6_address = strchr(proxy, ']') != NULL ? PJ_TRUE : PJ_FALSE;
-    char* addr_start = strchr(proxy, ':');
-    char* addr_end = NULL;
+#if NAT64_HAS_TRACE
+    pj_uint32_t head = NAT64_ATOMIC_ACQUIRE(trace_ring.head);
+    pj_uint32_t pos = head - PJ_MIN(head, NAT64_TRACE_SIZE);
+    pj_timestamp first;
+    pj_bool_t have_first = PJ_FALSE;
 
-    if (addr_start != NULL) {
-        addr_start++;
-        if (proxy_is_static_ip_v6_address) {
-            addr_end = strstr(proxy, "]:");
-        } else {
-            addr_end = strstr(addr_start, ":");
-        }
-        if (addr_end != NULL) {
-            size_t len_sip_sips = addr_start - proxy;
-            size_t len_port_and_tail = strlen(proxy) - (addr_end -
-                                       proxy);
-            strncpy(hostname_buf, addr_start, addr_end-addr_start);
-            hostname_buf[addr_end - addr_start] = '\0';
+    PJ_LOG(3, (THIS_FILE, "NAT64 trace, %u records", head - pos));
+    for (; pos != head; pos++) {
+        pj_nat64_trace_record record;
+        pj_timestamp ts;
+        char old_buf[PJ_INET6_ADDRSTRLEN];
+        char new_buf[PJ_INET6_ADDRSTRLEN];
+        const char* dir;
 
-            replace_hostname_with_ip(hostname_buf);
-            pj_ansi_snprintf(resolved_proxy_buf, PJ_MAX_HOSTNAME, "%.*s%s%.*s",  (int)len_sip_sips,
-                             proxy, hostname_buf, (int)len_port_and_tail, addr_end);
-            return PJ_SUCCESS;
+        if (!trace_copy(pos, &record)) {
+            continue;
+        }
+        ts.u64 = record.timestamp;
+        if (!have_first) {
+            first = ts;
+            have_first = PJ_TRUE;
+        }
+        dir = record.outgoing ? "tx" : "rx";
+        switch (record.type) {
+        case PJ_NAT64_TRACE_ADDRESS:
+            if (record.offset == PJ_NAT64_TRACE_NO_OFFSET) {
+                PJ_LOG(3, (THIS_FILE, "+%u usec msg %u %s header %s -> %s", pj_elapsed_usec(&first, &ts),
+                           record.msg_id, dir,
+                           trace_format_address(record.old_family, record.old_addr, old_buf, sizeof(old_buf)),
+                           trace_format_address(record.new_family, record.new_addr, new_buf, sizeof(new_buf))));
+            } else {
+                PJ_LOG(3, (THIS_FILE, "+%u usec msg %u %s offset %u %s -> %s", pj_elapsed_usec(&first, &ts),
+                           record.msg_id, dir, record.offset,
+                           trace_format_address(record.old_family, record.old_addr, old_buf, sizeof(old_buf)),
+                           trace_format_address(record.new_family, record.new_addr, new_buf, sizeof(new_buf))));
+            }
+            break;
+        case PJ_NAT64_TRACE_MESSAGE:
+            PJ_LOG(3, (THIS_FILE, "+%u usec msg %u %s %u bytes, %u addresses replaced in %u usec",
+                       pj_elapsed_usec(&first, &ts), record.msg_id, dir, record.offset, record.count, record.usec));
+            break;
+        case PJ_NAT64_TRACE_MEMO_HIT:
+            PJ_LOG(3, (THIS_FILE, "+%u usec msg %u %s reused an earlier rewrite", pj_elapsed_usec(&first, &ts),
+                       record.msg_id, dir));
+            break;
         }
     }
-    return PJ_EIGNORED;
-}
-
-void pj_nat64_set_active_account(pjsua_acc_id acc_id)
-{
-    active_add_id = acc_id;
+#else
+    PJ_LOG(3, (THIS_FILE, "NAT64 trace is not compiled in, build with NAT64_HAS_TRACE set to 1"));
+#endif
 }
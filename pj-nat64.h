@@ -9,7 +9,15 @@ typedef enum nat64_options {
     /** Replace incoming ipv4 with ipv6 */
     NAT64_REWRITE_INCOMING_SDP          = 0x02,
     /** Replace ipv4 address in 200 Ok for INVITE with ipv6 so ACK and BYE uses correct transport */
-    NAT64_REWRITE_ROUTE_AND_CONTACT     = 0x04
+    NAT64_REWRITE_ROUTE_AND_CONTACT     = 0x04,
+    /** Rewrite the sdp as a parsed pjmedia_sdp_session, before the outgoing message is printed and right after
+     *  the incoming message is parsed, instead of rewriting the printed buffers. An outgoing multipart body that
+     *  is neither text nor built by pjsip is still rewritten in the printed buffer. */
+    NAT64_REWRITE_PARSED_SDP            = 0x08,
+    /** Hold back an incoming message that needs the resolver, resolve its hosts on the background workers and
+     *  feed it to the endpoint again once they are known, so the SIP thread never waits for DNS. The message goes
+     *  on with its original addresses after NAT64_DEFER_TIMEOUT_MSEC. Needs pjsip 2.5 or later. */
+    NAT64_DEFER_RESOLUTION              = 0x10
 } nat64_options;
 
 /*
@@ -30,6 +38,17 @@ pj_status_t pj_nat64_disable_rewrite_module();
  */
 void pj_nat64_set_options(nat64_options options);
 
+/*
+ * Let the module decide whether rewriting is needed, per transport family. Messages on ipv4 transports are never
+ * rewritten, messages on ipv6 transports get the given options once the network is found to have a NAT64 prefix,
+ * probed in the background. Both families can be in use at the same time. Account and transport type policies
+ * still win. The network is probed right away, call pj_nat64_flush_cache on a network change to probe the new one.
+ * pj_nat64_set_options turns detection off.
+ * @param options       Bitmap of #nat64_options used on a NAT64 network, 0 turns detection off and leaves the
+ *                      global options as they are.
+ */
+pj_status_t pj_nat64_set_auto_detect(nat64_options options);
+
 /*
  * Helper function that takes an outbound proxy address, resolves and synthesizes the host or IP and writes it to
  * the buffer.
@@ -48,12 +67,301 @@ pj_status_t pj_nat64_resolve_and_replace_hostname_with_ip_if_possible(char* prox
 pj_status_t pj_nat64_get_hostname_from_proxy_string(char* proxy, char* hostname_buf);
 
 /*
- * By default the nat64 rewriting will put a non routable address 192.168.1.1 in the outgoing sdp.
- * This means that latching will be used for the inbound media.
+ * By default the nat64 rewriting will put the public ipv4 address learned from the Via of responses or from
+ * pj_nat64_set_stun_server in the outgoing sdp, and the non routable address 192.168.1.1 until one is known.
+ * The latter means that latching will be used for the inbound media.
  * If you rely on sdp_nat_rewrite to put the IP address as seen in the Via header in the outbound sdp
  * you need to pass the active account id to this function so that address can be used instead.
+ * The address is copied when this function is called and refreshed from received= in the Via of every successful
+ * REGISTER response of the account, so it can be called before the account has registered.
  *
  * @param acc_id    The active account.
  */
 void pj_nat64_set_active_account(pjsua_acc_id acc_id);
-#endif
\ No newline at end of file
+
+/**
+ * Rewrite policy for the messages of one transport type or account. Messages that match no policy use the options
+ * from pj_nat64_set_options and the address of the active account. */
+typedef struct pj_nat64_policy {
+    /** Bitmap of #nat64_options, 0 leaves the messages untouched */
+    unsigned    options;
+    /** Ipv4 address announced instead of the local ipv6 address. When empty the address from the Via header of
+     *  the account is used if sdp nat rewrite is allowed, otherwise the learned public address or 192.168.1.1 */
+    pj_str_t    mapped_addr;
+    /** NAT64 prefix to synthesize ipv4 literals with such as 64:ff9b::, empty to use the discovered prefix */
+    pj_str_t    prefix;
+    /** Length of prefix in bits, one of 32, 40, 48, 56, 64 or 96 */
+    unsigned    prefix_len;
+} pj_nat64_policy;
+
+/*
+ * Initialize a policy with its default values, no rewriting and no fixed prefix.
+ * @param policy        The policy.
+ */
+void pj_nat64_policy_default(pj_nat64_policy* policy);
+
+/*
+ * Set the policy for all messages sent or received over transports of the given type, for instance a NAT64
+ * policy for PJSIP_TRANSPORT_UDP6 only. The module must be enabled, policies are dropped when it is disabled.
+ * @param type          Transport type, PJSIP_TRANSPORT_IPV6 variants are separate types.
+ * @param policy        The policy, copied. NULL removes the policy of the type.
+ */
+pj_status_t pj_nat64_set_transport_policy(pjsip_transport_type_e type, const pj_nat64_policy* policy);
+
+/*
+ * Set the policy for the messages of an account. Messages are matched to the account through its transport so
+ * the account must be bound to one with pjsua_acc_config.transport_id, accounts sharing a transport share the
+ * policy of the one set first. Account policies take precedence over transport type policies. The mapped address
+ * is copied and refreshed like for pj_nat64_set_active_account.
+ * @param acc_id        The account.
+ * @param policy        The policy, copied. NULL removes the policy of the account.
+ * @return              PJ_EINVALIDOP if the account is not bound to a transport, PJ_ETOOMANY if
+ *                      NAT64_MAX_ACCOUNT_POLICIES accounts already have a policy.
+ */
+pj_status_t pj_nat64_set_account_policy(pjsua_acc_id acc_id, const pj_nat64_policy* policy);
+
+/**
+ * Counters for the ipv4 to ipv6 synthesis cache. */
+typedef struct pj_nat64_cache_stats {
+    /** Lookups answered from the cache */
+    unsigned hits;
+    /** Lookups answered from a cached failure */
+    unsigned negative_hits;
+    /** Lookups that had to go to the resolver */
+    unsigned misses;
+    /** Entries dropped to make room for new ones */
+    unsigned evictions;
+    /** Entries currently in the cache */
+    unsigned entries;
+} pj_nat64_cache_stats;
+
+/*
+ * Results of synthesizing media and proxy addresses are cached for NAT64_CACHE_TTL_MSEC, failed lookups for
+ * NAT64_CACHE_NEGATIVE_TTL_MSEC. Call this whenever the network changes since synthesized addresses depend
+ * on the NAT64 prefix of the current network. The cache is also flushed by pj_nat64_enable_rewrite_module.
+ */
+void pj_nat64_flush_cache();
+
+/*
+ * Get the hit/miss counters of the synthesis cache.
+ * @param stats         Filled in with the current counters.
+ */
+void pj_nat64_get_cache_stats(pj_nat64_cache_stats* stats);
+
+/*
+ * Discover the NAT64 prefix of the current network by resolving ipv4only.arpa (RFC 7050). Once a prefix is
+ * known, ipv4 literals in sdp and Contact/Route headers are synthesized locally (RFC 6052) instead of through
+ * the resolver. Discovery starts automatically on a background worker the first time it is needed after the
+ * module is enabled or the cache is flushed, until it completes ipv4 literals go to the resolver. Call this to do
+ * it up front, it blocks for the lookup. Only one discovery runs at a time, a call made while another one is
+ * running waits for it and returns its result.
+ * @return              PJ_SUCCESS if a prefix was found, PJ_ENOTFOUND if the network has no DNS64.
+ */
+pj_status_t pj_nat64_discover_prefix();
+
+/*
+ * Get the discovered NAT64 prefix.
+ * @param prefix_buf    Buffer for the prefix in text form, at least PJ_INET6_ADDRSTRLEN bytes.
+ * @param buf_len       Size of prefix_buf.
+ * @param prefix_len    Prefix length in bits, one of 32, 40, 48, 56, 64 or 96.
+ * @return              PJ_ENOTFOUND if no prefix has been discovered.
+ */
+pj_status_t pj_nat64_get_prefix(char* prefix_buf, int buf_len, unsigned* prefix_len);
+
+/*
+ * Do the lookups of the first call in the background: discover the NAT64 prefix and resolve the outbound proxies,
+ * the proxies and registrar of the active account and the media relays from pj_nat64_set_media_relays into the
+ * synthesis cache. Runs by itself when rewriting is enabled with pj_nat64_set_options, when the active account
+ * changes, on its first successful registration after the module is enabled or the cache is flushed and after
+ * pj_nat64_flush_cache, as long as some policy rewrites. The hosts are read from the pjsua configuration when the
+ * app calls this function, pj_nat64_set_options, pj_nat64_set_active_account or pj_nat64_set_media_relays, call
+ * one of them again after changing the proxies of an account. The module must be enabled.
+ * @return              PJ_ETOOMANY if the background workers are busy.
+ */
+pj_status_t pj_nat64_prewarm();
+
+/*
+ * Set the media relays that pj_nat64_prewarm resolves ahead of the first call, for instance the TURN servers.
+ * The module must be enabled.
+ * @param relays        Host names or ipv4 addresses, copied.
+ * @param count         Number of relays, at most NAT64_MAX_MEDIA_RELAYS. 0 removes them.
+ */
+pj_status_t pj_nat64_set_media_relays(const pj_str_t relays[], unsigned count);
+
+/*
+ * Learn the public ipv4 address of the device from a STUN server (RFC 5389). Binding requests go out over ipv6 to
+ * the synthesized address of the server so the NAT64 translates them, right away and then every
+ * NAT64_STUN_REFRESH_MSEC on the background workers. Without a STUN server the address is only learned from the
+ * Via of responses. The module must be enabled.
+ * @param server        host[:port] of an ipv4 STUN server, port 3478 by default. NULL or empty stops the refresh.
+ */
+pj_status_t pj_nat64_set_stun_server(const pj_str_t* server);
+
+/*
+ * Get the public ipv4 address learned for a local ipv6 address, as announced in outgoing sdp when no mapped address
+ * is set. Addresses are forgotten after NAT64_MAPPING_TTL_MSEC without a refresh and by pj_nat64_flush_cache.
+ * @param local_addr    Local ipv6 address. Without an entry for it the most recently learned address is returned.
+ * @param buf           Buffer for the address, at least PJ_INET_ADDRSTRLEN bytes.
+ * @param buf_len       Size of buf.
+ * @return              PJ_ENOTFOUND if no address has been learned.
+ */
+pj_status_t pj_nat64_get_public_address(const pj_str_t* local_addr, char* buf, int buf_len);
+
+/**
+ * Signature of pj_getaddrinfo. */
+typedef pj_status_t (*pj_nat64_getaddrinfo_cb)(int af, const pj_str_t *name, unsigned *count, pj_addrinfo ai[]);
+
+/*
+ * Replace the resolver used for all lookups done by this module, for instance with a stub resolver in tests.
+ * @param cb            The resolver, NULL restores pj_getaddrinfo.
+ */
+void pj_nat64_set_resolver(pj_nat64_getaddrinfo_cb cb);
+
+#ifndef PJ_NAT64_MAX_ADDRESSES
+#   define PJ_NAT64_MAX_ADDRESSES 8
+#endif
+
+/**
+ * Addresses of a resolved host in the order of the resolver. */
+typedef struct pj_nat64_resolve_result {
+    /** PJ_SUCCESS if at least one address was found */
+    pj_status_t status;
+    /** Number of addresses */
+    unsigned    count;
+    /** A, AAAA and synthesized addresses with the port of the proxy string, synthesized ones follow their A record */
+    pj_sockaddr addr[PJ_NAT64_MAX_ADDRESSES];
+    /** Index of the address that connected first in pj_nat64_race_connect, -1 otherwise */
+    int         winner;
+} pj_nat64_resolve_result;
+
+/**
+ * Completion callback for the asynchronous helpers. Called from the pjsip thread polling the endpoint. */
+typedef void (*pj_nat64_resolve_cb)(void* user_data, const pj_nat64_resolve_result* result);
+
+/*
+ * Asynchronous version of pj_nat64_resolve_and_replace_hostname_with_ip_if_possible that returns all addresses.
+ * The lookup runs in the background and cb is called through the pjsip timer heap. The module must be enabled.
+ * @param proxy         Outbound proxy address such as sips:my_host:443;transport=TLS
+ * @param user_data     Passed to cb.
+ * @param cb            Completion callback.
+ */
+pj_status_t pj_nat64_resolve_proxy_async(const char* proxy, void* user_data, pj_nat64_resolve_cb cb);
+
+/*
+ * Optional helper for TCP/TLS proxies. Connects to the addresses of result ordered as in RFC 8305 (Happy Eyeballs),
+ * ipv6 first then alternating, starting the next attempt every NAT64_RACE_ATTEMPT_DELAY_MSEC or as soon as one
+ * fails. The result passed to cb is in that order and the first address that connected is in the winner field. The test connections are closed again, use the winner as the outbound proxy address.
+ * @param result        Result from pj_nat64_resolve_proxy_async.
+ * @param user_data     Passed to cb.
+ * @param cb            Completion callback, winner is -1 if no address could be reached.
+ */
+pj_status_t pj_nat64_race_connect(const pj_nat64_resolve_result* result, void* user_data, pj_nat64_resolve_cb cb);
+
+#define PJ_NAT64_HISTOGRAM_BUCKETS 16
+
+/**
+ * Latency histogram. Bucket i counts durations shorter than 2^i microseconds (and not counted by a lower bucket),
+ * the last bucket counts everything longer. */
+typedef struct pj_nat64_histogram {
+    unsigned count[PJ_NAT64_HISTOGRAM_BUCKETS];
+} pj_nat64_histogram;
+
+/**
+ * Runtime statistics of the rewrite module. */
+typedef struct pj_nat64_stats {
+    /** Incoming messages considered for rewriting */
+    unsigned rx_inspected;
+    /** Incoming messages where at least one sdp address was replaced */
+    unsigned rx_rewritten;
+    /** Outgoing messages considered for rewriting */
+    unsigned tx_inspected;
+    /** Outgoing messages where at least one sdp address was replaced */
+    unsigned tx_rewritten;
+    /** Total number of sdp connection/origin addresses replaced */
+    unsigned addresses_replaced;
+    /** Rewrites that failed and left the message as is */
+    unsigned rewrite_failures;
+    /** Calls to the resolver */
+    unsigned resolver_calls;
+    /** Resolver calls that returned no address */
+    unsigned resolver_failures;
+    /** Lookups answered from the synthesis cache */
+    unsigned cache_hits;
+    /** Ipv4 literals synthesized locally from the NAT64 prefix */
+    unsigned local_syntheses;
+    /** Rewrites where the Content-Length header needed more digits */
+    unsigned content_length_growth;
+    /** Retransmitted or repeated messages that reused an earlier rewrite */
+    unsigned memo_hits;
+    /** Incoming messages held back until their hosts were resolved */
+    unsigned rx_deferred;
+    /** Held back messages that went on with their original addresses since resolution took too long */
+    unsigned defer_timeouts;
+    /** Time spent rewriting a message */
+    pj_nat64_histogram rewrite_usec;
+    /** Time spent in the resolver */
+    pj_nat64_histogram resolve_usec;
+} pj_nat64_stats;
+
+/*
+ * Get a snapshot of the runtime statistics. Safe to call from any thread.
+ * @param stats         Filled in with the current counters.
+ */
+void pj_nat64_get_stats(pj_nat64_stats* stats);
+
+/*
+ * Reset all runtime statistics to zero. The synthesis cache counters are not affected.
+ */
+void pj_nat64_reset_stats();
+
+typedef enum pj_nat64_trace_type {
+    /** An address was replaced */
+    PJ_NAT64_TRACE_ADDRESS,
+    /** A message was inspected, summary of its rewrite */
+    PJ_NAT64_TRACE_MESSAGE,
+    /** A retransmitted or repeated message reused an earlier rewrite */
+    PJ_NAT64_TRACE_MEMO_HIT
+} pj_nat64_trace_type;
+
+/** Offset of an address that was replaced in a parsed header instead of the message buffer */
+#define PJ_NAT64_TRACE_NO_OFFSET    0xffffffffu
+
+/**
+ * One record of the trace ring. Addresses are kept in binary form, family 4 or 6, or 0 for a hostname which is not
+ * recorded. */
+typedef struct pj_nat64_trace_record {
+    /** Message the record belongs to, all records of one message share it */
+    pj_uint32_t msg_id;
+    /** pj_nat64_trace_type */
+    pj_uint8_t  type;
+    /** PJ_TRUE for outgoing messages */
+    pj_uint8_t  outgoing;
+    pj_uint8_t  old_family;
+    pj_uint8_t  new_family;
+    /** Address: offset of the replaced text in the message. Message: length after the rewrite */
+    pj_uint32_t offset;
+    /** Message: number of addresses replaced */
+    pj_uint32_t count;
+    /** Message: time spent rewriting it */
+    pj_uint32_t usec;
+    /** pj_get_timestamp when the record was written */
+    pj_uint64_t timestamp;
+    pj_uint8_t  old_addr[16];
+    pj_uint8_t  new_addr[16];
+} pj_nat64_trace_record;
+
+/*
+ * Copy the most recent records of the trace ring, oldest first. The module keeps the last NAT64_TRACE_SIZE records,
+ * writing one costs a copy of a few bytes so it can stay on in production. Build with NAT64_HAS_TRACE set to 0 to
+ * remove it.
+ * @param records       Receives the records.
+ * @param max           Size of records.
+ * @return              Number of records copied, always 0 if the trace is compiled out.
+ */
+unsigned pj_nat64_trace_read(pj_nat64_trace_record records[], unsigned max);
+
+/*
+ * Log the records of the trace ring at level 3, formatting happens only here.
+ */
+void pj_nat64_trace_dump();
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Test of the batched lookups: the hosts of a message are collected once each and resolved at the same time, and the
+ * batches of a thread are reused from one message to the next.
+ *
+ * A stub resolver answers a few host names after a delay and counts how often it is asked for each. A set of hosts
+ * must cost one lookup per distinct host and about one delay in total. The module source is included directly like
+ * in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-batch-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-batch-test
+ * Run:
+ *   ./nat64-batch-test
+ */
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+#define LOOKUP_DELAY_MSEC   100
+
+static const char* hosts[] = { "audio.example.com", "video.example.com", "bfcp.example.com", "proxy.example.com" };
+
+//Number of times the stub resolver was asked for each of hosts
+static unsigned host_calls[PJ_ARRAY_SIZE(hosts)];
+
+//Host number i of hosts resolves to 64:ff9b::i+1 after the delay, every other name fails
+static pj_status_t delayed_getaddrinfo(int af, const pj_str_t *name, unsigned *count, pj_addrinfo ai[])
+{
+    char addr[PJ_INET6_ADDRSTRLEN];
+    pj_str_t addr_str;
+    unsigned i;
+
+    PJ_UNUSED_ARG(af);
+    pj_thread_sleep(LOOKUP_DELAY_MSEC);
+    for (i = 0; i < PJ_ARRAY_SIZE(hosts); i++) {
+        if (pj_stricmp2(name, hosts[i]) == 0) {
+            break;
+        }
+    }
+    if (i == PJ_ARRAY_SIZE(hosts) || *count == 0) {
+        *count = 0;
+        return PJ_ERESOLVE;
+    }
+    NAT64_ATOMIC_INC(host_calls[i]);
+    pj_ansi_snprintf(addr, sizeof(addr), "64:ff9b::%u", i + 1);
+    pj_bzero(&ai[0], sizeof(ai[0]));
+    pj_sockaddr_init(PJ_AF_INET6, &ai[0].ai_addr, NULL, 0);
+    addr_str = pj_str(addr);
+    pj_inet_pton(PJ_AF_INET6, &addr_str, &ai[0].ai_addr.ipv6.sin6_addr);
+    *count = 1;
+    return PJ_SUCCESS;
+}
+
+//Add the first count hosts to set, each once in its own case and once in upper case like a second line naming it
+static void add_hosts(nat64_host_set* set, unsigned count)
+{
+    const nat64_config* cfg = config_acquire();
+    char upper[PJ_MAX_HOSTNAME];
+    unsigned i, j;
+
+    pj_bzero(set, sizeof(*set));
+    for (i = 0; i < count; i++) {
+        pj_str_t host = pj_str((char*)hosts[i]);
+        host_set_add(&cfg->global, set, &host);
+        for (j = 0; hosts[i][j] != '\0'; j++) {
+            upper[j] = (hosts[i][j] >= 'a' && hosts[i][j] <= 'z') ? (char)(hosts[i][j] - 'a' + 'A') : hosts[i][j];
+        }
+        host = pj_str(upper);
+        host.slen = j;
+        host_set_add(&cfg->global, set, &host);
+    }
+    config_release(cfg);
+}
+
+//The workers drop the batch of a message just after its last answer, wait for it before the next message
+static void wait_batches_free()
+{
+    nat64_scratch* scratch = scratch_get();
+    nat64_lookup_batch* batch;
+
+    for (batch = scratch != NULL ? scratch->batches : NULL; batch != NULL; batch = batch->next) {
+        while (NAT64_ATOMIC_LOAD(batch->ref) > 0) {
+            pj_thread_sleep(1);
+        }
+    }
+}
+
+static unsigned batch_count()
+{
+    nat64_scratch* scratch = scratch_get();
+    nat64_lookup_batch* batch;
+    unsigned count = 0;
+
+    for (batch = scratch != NULL ? scratch->batches : NULL; batch != NULL; batch = batch->next) {
+        count++;
+    }
+    return count;
+}
+
+static pj_bool_t test_deduplication()
+{
+    nat64_host_set set;
+    unsigned i;
+
+    pj_nat64_flush_cache();
+    pj_bzero(host_calls, sizeof(host_calls));
+    add_hosts(&set, PJ_ARRAY_SIZE(hosts));
+    if (set.count != PJ_ARRAY_SIZE(hosts)) {
+        printf("deduplication: %u hosts in the set\n", set.count);
+        return PJ_FALSE;
+    }
+    resolve_host_set(&set);
+    wait_batches_free();
+    for (i = 0; i < PJ_ARRAY_SIZE(hosts); i++) {
+        pj_str_t host = pj_str((char*)hosts[i]);
+        if (host_calls[i] != 1 || !cache_contains(&host)) {
+            printf("deduplication: %s resolved %u times\n", hosts[i], host_calls[i]);
+            return PJ_FALSE;
+        }
+    }
+    //Everything is cached now, the next message has nothing to look up
+    add_hosts(&set, PJ_ARRAY_SIZE(hosts));
+    if (set.count != 0) {
+        printf("deduplication: %u cached hosts in the set\n", set.count);
+        return PJ_FALSE;
+    }
+    printf("deduplication: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_concurrency()
+{
+    nat64_host_set set;
+    pj_timestamp start, end;
+    unsigned msec;
+
+    pj_nat64_flush_cache();
+    add_hosts(&set, PJ_ARRAY_SIZE(hosts));
+    pj_get_timestamp(&start);
+    resolve_host_set(&set);
+    pj_get_timestamp(&end);
+    wait_batches_free();
+    msec = pj_elapsed_msec(&start, &end);
+    //One after the other they would take a delay each
+    if (msec >= LOOKUP_DELAY_MSEC * (PJ_ARRAY_SIZE(hosts) - 1)) {
+        printf("concurrency: %u hosts took %u msec\n", (unsigned)PJ_ARRAY_SIZE(hosts), msec);
+        return PJ_FALSE;
+    }
+    printf("concurrency: ok, %u msec\n", msec);
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_reuse()
+{
+    nat64_host_set set;
+    nat64_lookup_batch* first;
+    unsigned batches = batch_count();
+
+    //The earlier tests left one batch behind for the thread
+    if (batches != 1) {
+        printf("reuse: %u batches after the first messages\n", batches);
+        return PJ_FALSE;
+    }
+    first = scratch_get()->batches;
+    pj_nat64_flush_cache();
+    add_hosts(&set, 2);
+    resolve_host_set(&set);
+    wait_batches_free();
+    if (batch_count() != 1 || scratch_get()->batches != first) {
+        printf("reuse: free batch not reused\n");
+        return PJ_FALSE;
+    }
+    //Jobs of the last message still queued, the next message needs a batch of its own
+    first->ref = 1;
+    pj_nat64_flush_cache();
+    add_hosts(&set, 2);
+    resolve_host_set(&set);
+    first->ref = 0;
+    wait_batches_free();
+    if (batch_count() != 2) {
+        printf("reuse: %u batches with one still in use\n", batch_count());
+        return PJ_FALSE;
+    }
+    pj_nat64_flush_cache();
+    add_hosts(&set, 2);
+    resolve_host_set(&set);
+    wait_batches_free();
+    if (batch_count() != 2) {
+        printf("reuse: %u batches once both are free\n", batch_count());
+        return PJ_FALSE;
+    }
+    printf("reuse: ok\n");
+    return PJ_TRUE;
+}
+
+int main()
+{
+    unsigned failed = 0;
+
+    if (test_init(&delayed_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+
+    if (!test_deduplication()) {
+        failed++;
+    }
+    if (!test_concurrency()) {
+        failed++;
+    }
+    if (!test_reuse()) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
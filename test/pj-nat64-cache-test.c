@@ -0,0 +1,219 @@
+/*
+ * Test of the synthesis cache: hits, cached failures, expiry and eviction of the least recently used entry.
+ *
+ * A stub resolver answers a few host names and counts how often it is asked. The cache is built with short TTLs and
+ * room for four entries so expiry and eviction happen within the test. The module source is included directly like
+ * in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-cache-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-cache-test
+ * Run:
+ *   ./nat64-cache-test
+ */
+#define NAT64_CACHE_SIZE                4
+#define NAT64_CACHE_TTL_MSEC            400
+#define NAT64_CACHE_NEGATIVE_TTL_MSEC   200
+#include "../pj-nat64.c"
+
+//Number of times the stub resolver was asked
+static unsigned resolver_calls;
+
+//Hosts named hN.example.com resolve to 64:ff9b::N, every other name fails
+static pj_status_t stub_getaddrinfo(int af, const pj_str_t *name, unsigned *count, pj_addrinfo ai[])
+{
+    char addr[PJ_INET6_ADDRSTRLEN];
+    pj_str_t addr_str;
+    unsigned n;
+
+    PJ_UNUSED_ARG(af);
+    resolver_calls++;
+    if (*count == 0) {
+        return PJ_ETOOSMALL;
+    }
+    if (name->slen != (pj_ssize_t)strlen("h0.example.com") || (name->ptr[0] != 'h' && name->ptr[0] != 'H') ||
+        name->ptr[1] < '0' || name->ptr[1] > '9' ||
+        pj_ansi_strnicmp(name->ptr + 2, ".example.com", name->slen - 2) != 0) {
+        *count = 0;
+        return PJ_ERESOLVE;
+    }
+    n = (unsigned)(name->ptr[1] - '0');
+    pj_ansi_snprintf(addr, sizeof(addr), "64:ff9b::%u", n);
+    pj_bzero(&ai[0], sizeof(ai[0]));
+    pj_sockaddr_init(PJ_AF_INET6, &ai[0].ai_addr, NULL, 0);
+    addr_str = pj_str(addr);
+    pj_inet_pton(PJ_AF_INET6, &addr_str, &ai[0].ai_addr.ipv6.sin6_addr);
+    *count = 1;
+    return PJ_SUCCESS;
+}
+
+//Resolve host through the module, returns the number of resolver calls it took
+static unsigned resolve(const char* host, char* buf, int buf_len)
+{
+    pj_str_t host_str = pj_str((char*)host);
+    unsigned calls = resolver_calls;
+    const nat64_config* cfg;
+
+    cfg = config_acquire();
+    resolve_or_synthesize_ipv4_to_ipv6(&cfg->global, &host_str, buf, buf_len);
+    config_release(cfg);
+    return resolver_calls - calls;
+}
+
+static pj_bool_t test_hit()
+{
+    char buf[PJ_INET6_ADDRSTRLEN];
+    pj_nat64_cache_stats stats;
+
+    pj_nat64_flush_cache();
+    pj_bzero(&synth_cache.stats, sizeof(synth_cache.stats));
+    if (resolve("h1.example.com", buf, sizeof(buf)) != 1 || strcmp(buf, "64:ff9b::1") != 0) {
+        printf("hit: first lookup gave %s\n", buf);
+        return PJ_FALSE;
+    }
+    //Names are compared without case like DNS does
+    if (resolve("H1.EXAMPLE.COM", buf, sizeof(buf)) != 0 || strcmp(buf, "64:ff9b::1") != 0) {
+        printf("hit: second lookup went to the resolver or gave %s\n", buf);
+        return PJ_FALSE;
+    }
+    pj_nat64_get_cache_stats(&stats);
+    if (stats.hits != 1 || stats.misses != 1 || stats.entries != 1) {
+        printf("hit: %u hits, %u misses, %u entries\n", stats.hits, stats.misses, stats.entries);
+        return PJ_FALSE;
+    }
+    printf("hit: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_negative()
+{
+    char buf[PJ_INET6_ADDRSTRLEN];
+    pj_nat64_cache_stats stats;
+
+    pj_nat64_flush_cache();
+    pj_bzero(&synth_cache.stats, sizeof(synth_cache.stats));
+    if (resolve("unknown.example.com", buf, sizeof(buf)) != 1 || strcmp(buf, "unknown.example.com") != 0) {
+        printf("negative: failed lookup gave %s\n", buf);
+        return PJ_FALSE;
+    }
+    //The failure is remembered and the input kept
+    if (resolve("unknown.example.com", buf, sizeof(buf)) != 0 || strcmp(buf, "unknown.example.com") != 0) {
+        printf("negative: failure not cached, gave %s\n", buf);
+        return PJ_FALSE;
+    }
+    pj_nat64_get_cache_stats(&stats);
+    if (stats.negative_hits != 1 || stats.hits != 0) {
+        printf("negative: %u negative hits, %u hits\n", stats.negative_hits, stats.hits);
+        return PJ_FALSE;
+    }
+    printf("negative: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_expiry()
+{
+    char buf[PJ_INET6_ADDRSTRLEN];
+
+    pj_nat64_flush_cache();
+    resolve("h2.example.com", buf, sizeof(buf));
+    resolve("unknown.example.com", buf, sizeof(buf));
+    //Failures expire first
+    pj_thread_sleep(NAT64_CACHE_NEGATIVE_TTL_MSEC + 50);
+    if (resolve("h2.example.com", buf, sizeof(buf)) != 0) {
+        printf("expiry: positive entry expired with the negative one\n");
+        return PJ_FALSE;
+    }
+    if (resolve("unknown.example.com", buf, sizeof(buf)) != 1) {
+        printf("expiry: negative entry still used after its TTL\n");
+        return PJ_FALSE;
+    }
+    pj_thread_sleep(NAT64_CACHE_TTL_MSEC);
+    if (resolve("h2.example.com", buf, sizeof(buf)) != 1 || strcmp(buf, "64:ff9b::2") != 0) {
+        printf("expiry: positive entry still used after its TTL\n");
+        return PJ_FALSE;
+    }
+    printf("expiry: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_eviction()
+{
+    char buf[PJ_INET6_ADDRSTRLEN];
+    char host[32];
+    pj_nat64_cache_stats stats;
+    unsigned i;
+
+    pj_nat64_flush_cache();
+    pj_bzero(&synth_cache.stats, sizeof(synth_cache.stats));
+    for (i = 0; i < NAT64_CACHE_SIZE; i++) {
+        pj_ansi_snprintf(host, sizeof(host), "h%u.example.com", i);
+        resolve(host, buf, sizeof(buf));
+    }
+    //h0 becomes the most recently used, h1 the least
+    resolve("h0.example.com", buf, sizeof(buf));
+    resolve("h8.example.com", buf, sizeof(buf));
+    pj_nat64_get_cache_stats(&stats);
+    if (stats.evictions != 1 || stats.entries != NAT64_CACHE_SIZE) {
+        printf("eviction: %u evictions, %u entries\n", stats.evictions, stats.entries);
+        return PJ_FALSE;
+    }
+    if (resolve("h0.example.com", buf, sizeof(buf)) != 0 || resolve("h8.example.com", buf, sizeof(buf)) != 0) {
+        printf("eviction: a recently used entry was evicted\n");
+        return PJ_FALSE;
+    }
+    if (resolve("h1.example.com", buf, sizeof(buf)) != 1) {
+        printf("eviction: the least recently used entry is still cached\n");
+        return PJ_FALSE;
+    }
+    pj_nat64_flush_cache();
+    pj_nat64_get_cache_stats(&stats);
+    if (stats.entries != 0 || resolve("h0.example.com", buf, sizeof(buf)) != 1) {
+        printf("eviction: flush left %u entries\n", stats.entries);
+        return PJ_FALSE;
+    }
+    printf("eviction: ok\n");
+    return PJ_TRUE;
+}
+
+int main()
+{
+    pjsua_config cfg;
+    pjsua_logging_config log_cfg;
+    pj_status_t status;
+    unsigned failed = 0;
+
+    status = pjsua_create();
+    if (status != PJ_SUCCESS) {
+        return 1;
+    }
+    pjsua_config_default(&cfg);
+    pjsua_logging_config_default(&log_cfg);
+    log_cfg.level = 0;
+    log_cfg.console_level = 0;
+    status = pjsua_init(&cfg, &log_cfg, NULL);
+    if (status == PJ_SUCCESS) {
+        status = pj_nat64_enable_rewrite_module();
+    }
+    if (status != PJ_SUCCESS) {
+        pjsua_destroy();
+        return 1;
+    }
+    pj_nat64_set_resolver(&stub_getaddrinfo);
+
+    if (!test_hit()) {
+        failed++;
+    }
+    if (!test_negative()) {
+        failed++;
+    }
+    if (!test_expiry()) {
+        failed++;
+    }
+    if (!test_eviction()) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    pj_nat64_disable_rewrite_module();
+    pjsua_destroy();
+    return failed == 0 ? 0 : 1;
+}
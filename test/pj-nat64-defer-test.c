@@ -0,0 +1,291 @@
+/*
+ * Test of NAT64_DEFER_RESOLUTION: a held back message comes back rewritten once its lookups are done, goes on
+ * unchanged at the timeout and is dropped cleanly when the module is disabled.
+ *
+ * The stub resolver answers only once the test opens its gate, so the test decides when the lookups are done. A
+ * module registered right after mod-ipv6 takes the messages the timer feeds back to the endpoint. The messages come
+ * from a real udp transport, a held back message is a clone that keeps a reference to it. The module source is
+ * included directly like in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-defer-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-defer-test
+ * Run:
+ *   ./nat64-defer-test
+ */
+#define NAT64_DEFER_TIMEOUT_MSEC    300
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+#define WAIT_MSEC                   2000
+
+//The media host, its number and the branch are filled in
+static const char response_format[] =
+    "SIP/2.0 200 OK\r\n"
+    "Via: SIP/2.0/UDP 127.0.0.1:5060;rport;branch=z9hG4bKdefer%d\r\n"
+    "From: <sip:alice@example.com>;tag=defer1\r\n"
+    "To: <sip:bob@example.com>;tag=defer2\r\n"
+    "Call-ID: defer-test-%d\r\n"
+    "CSeq: 1 INVITE\r\n"
+    "Contact: <sip:bob@[2001:db8:1000::7]:5060>\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: %d\r\n"
+    "\r\n"
+    "%s";
+
+static const char sdp_format[] =
+    "v=0\r\n"
+    "o=- 3724394400 3724394401 IN IP4 media%d.example.com\r\n"
+    "s=-\r\n"
+    "c=IN IP4 media%d.example.com\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0\r\n";
+
+//Lookups wait until the test opens the gate
+static pj_bool_t gate_open;
+
+//Messages that went on past mod-ipv6, and how many of them were rewritten
+static unsigned captured;
+static unsigned captured_rewritten;
+
+//mediaN.example.com resolves to 64:ff9b::N once the gate is open, every other name fails
+static pj_status_t gated_getaddrinfo(int af, const pj_str_t *name, unsigned *count, pj_addrinfo ai[])
+{
+    char addr[PJ_INET6_ADDRSTRLEN];
+    pj_str_t addr_str;
+
+    PJ_UNUSED_ARG(af);
+    while (!NAT64_ATOMIC_LOAD(gate_open)) {
+        pj_thread_sleep(5);
+    }
+    if (*count == 0 || name->slen != (pj_ssize_t)strlen("media0.example.com") ||
+        pj_ansi_strnicmp(name->ptr, "media", 5) != 0 || name->ptr[5] < '0' || name->ptr[5] > '9' ||
+        pj_ansi_strnicmp(name->ptr + 6, ".example.com", name->slen - 6) != 0) {
+        *count = 0;
+        return PJ_ERESOLVE;
+    }
+    pj_ansi_snprintf(addr, sizeof(addr), "64:ff9b::%c", name->ptr[5]);
+    pj_bzero(&ai[0], sizeof(ai[0]));
+    pj_sockaddr_init(PJ_AF_INET6, &ai[0].ai_addr, NULL, 0);
+    addr_str = pj_str(addr);
+    pj_inet_pton(PJ_AF_INET6, &addr_str, &ai[0].ai_addr.ipv6.sin6_addr);
+    *count = 1;
+    return PJ_SUCCESS;
+}
+
+//Takes every response mod-ipv6 lets through, pjsip would drop them anyway as there is no transaction
+static pj_bool_t capture_on_rx_response(pjsip_rx_data* rdata)
+{
+    const pjsip_msg_body* body = rdata->msg_info.msg->body;
+    const char* data = body != NULL ? (const char*)body->data : NULL;
+
+    if (data != NULL && find_bytes(data, data + body->len, "IN IP6 64:ff9b::", 16) != NULL) {
+        NAT64_ATOMIC_INC(captured_rewritten);
+    }
+    NAT64_ATOMIC_INC(captured);
+    return PJ_TRUE;
+}
+
+static pjsip_module capture_module = {
+    NULL, NULL,                     /* prev, next.      */
+    { "mod-nat64-capture", 17},     /* Name.        */
+    -1,                             /* Id           */
+    PJSIP_MOD_PRIORITY_TRANSPORT_LAYER + 2,/* Priority            */
+    NULL,                           /* load()       */
+    NULL,                           /* start()      */
+    NULL,                           /* stop()       */
+    NULL,                           /* unload()     */
+    NULL,                           /* on_rx_request()  */
+    &capture_on_rx_response,        /* on_rx_response() */
+    NULL,                           /* on_tx_request.   */
+    NULL,                           /* on_tx_response() */
+    NULL,                           /* on_tsx_state()   */
+};
+
+//Receive the 200 OK of call number n with media host number n. Returns PJ_TRUE if mod-ipv6 held it back.
+static pj_bool_t receive(test_rx* rx, int n)
+{
+    char sdp[512];
+    char msg[PJSIP_MAX_PKT_LEN];
+    int sdp_len = pj_ansi_snprintf(sdp, sizeof(sdp), sdp_format, n, n);
+    int len = pj_ansi_snprintf(msg, sizeof(msg), response_format, n, n, sdp_len, sdp);
+    pj_bool_t held = PJ_FALSE;
+
+    test_rx_message(rx, msg, len, &held);
+    return held;
+}
+
+//Poll the endpoint until count messages were captured, PJ_FALSE after msec
+static pj_bool_t wait_captured(unsigned count, unsigned msec)
+{
+    pj_time_val timeout = {0, 10};
+    pj_timestamp start, now;
+
+    pj_get_timestamp(&start);
+    do {
+        pjsip_endpt_handle_events(pjsua_get_pjsip_endpt(), &timeout);
+        if (NAT64_ATOMIC_LOAD(captured) >= count) {
+            return PJ_TRUE;
+        }
+        pj_get_timestamp(&now);
+    } while (pj_elapsed_msec(&start, &now) < msec);
+    return PJ_FALSE;
+}
+
+//Every lookup job has let go of its message once the queue is empty
+static pj_bool_t wait_queue_empty(unsigned msec)
+{
+    unsigned waited = 0;
+
+    while (NAT64_ATOMIC_LOAD(deferred_queue.count) > 0 && waited < msec) {
+        wait_captured(~0u, 10);
+        waited += 10;
+    }
+    return NAT64_ATOMIC_LOAD(deferred_queue.count) == 0;
+}
+
+static pj_bool_t test_reinjection(test_rx* rx)
+{
+    pj_nat64_stats before, after;
+
+    gate_open = PJ_FALSE;
+    captured = captured_rewritten = 0;
+    pj_nat64_get_stats(&before);
+    if (!receive(rx, 1)) {
+        printf("reinjection: message not held back\n");
+        return PJ_FALSE;
+    }
+    //The retransmission goes no further, the held copy carries on for both
+    if (!receive(rx, 1) || deferred_queue.count != 1) {
+        printf("reinjection: retransmission not absorbed, %u messages held\n", deferred_queue.count);
+        return PJ_FALSE;
+    }
+    wait_captured(1, 50);
+    if (captured != 0) {
+        printf("reinjection: message went on before its lookups were done\n");
+        return PJ_FALSE;
+    }
+    NAT64_ATOMIC_STORE(gate_open, PJ_TRUE);
+    if (!wait_captured(1, WAIT_MSEC) || captured_rewritten != 1) {
+        printf("reinjection: %u messages came back, %u rewritten\n", captured, captured_rewritten);
+        return PJ_FALSE;
+    }
+    wait_captured(2, 100);
+    pj_nat64_get_stats(&after);
+    if (captured != 1 || !wait_queue_empty(WAIT_MSEC) || after.rx_deferred - before.rx_deferred != 1 ||
+        after.defer_timeouts != before.defer_timeouts) {
+        printf("reinjection: %u messages came back, %u still held\n", captured, deferred_queue.count);
+        return PJ_FALSE;
+    }
+    printf("reinjection: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_timeout(test_rx* rx)
+{
+    pj_nat64_stats before, after;
+
+    gate_open = PJ_FALSE;
+    captured = captured_rewritten = 0;
+    pj_nat64_get_stats(&before);
+    if (!receive(rx, 2)) {
+        printf("timeout: message not held back\n");
+        return PJ_FALSE;
+    }
+    //Goes on with its own addresses, the rewrite does not wait for the resolver on the timer thread
+    if (!wait_captured(1, NAT64_DEFER_TIMEOUT_MSEC + WAIT_MSEC) || captured_rewritten != 0) {
+        printf("timeout: %u messages came back, %u rewritten\n", captured, captured_rewritten);
+        return PJ_FALSE;
+    }
+    pj_nat64_get_stats(&after);
+    NAT64_ATOMIC_STORE(gate_open, PJ_TRUE);
+    if (after.defer_timeouts - before.defer_timeouts != 1 || !wait_queue_empty(WAIT_MSEC)) {
+        printf("timeout: %u timeouts counted, %u messages still held\n", after.defer_timeouts - before.defer_timeouts,
+               deferred_queue.count);
+        return PJ_FALSE;
+    }
+    printf("timeout: ok\n");
+    return PJ_TRUE;
+}
+
+static int open_gate_thread(void* arg)
+{
+    PJ_UNUSED_ARG(arg);
+    pj_thread_sleep(NAT64_DEFER_TIMEOUT_MSEC / 2);
+    NAT64_ATOMIC_STORE(gate_open, PJ_TRUE);
+    return 0;
+}
+
+//Disable the module while a message waits for its lookup. It must be freed without coming back.
+static pj_bool_t test_teardown(test_rx* rx)
+{
+    pj_pool_t* pool = pjsua_pool_create("defertest", 1000, 1000);
+    pj_thread_t* thread;
+
+    gate_open = PJ_FALSE;
+    captured = 0;
+    if (pool == NULL || !receive(rx, 3)) {
+        printf("teardown: message not held back\n");
+        return PJ_FALSE;
+    }
+    //Disabling waits for the workers, the lookup only returns once the gate opens
+    if (pj_thread_create(pool, "opengate", &open_gate_thread, NULL, 0, 0, &thread) != PJ_SUCCESS) {
+        NAT64_ATOMIC_STORE(gate_open, PJ_TRUE);
+        thread = NULL;
+    }
+    pj_nat64_disable_rewrite_module();
+    if (thread != NULL) {
+        pj_thread_join(thread);
+        pj_thread_destroy(thread);
+    }
+    pj_pool_release(pool);
+    //Past the timeout the timer would have fed the message back
+    wait_captured(1, NAT64_DEFER_TIMEOUT_MSEC * 2);
+    if (captured != 0 || deferred_queue.count != 0) {
+        printf("teardown: %u messages came back, %u still held\n", captured, deferred_queue.count);
+        return PJ_FALSE;
+    }
+    printf("teardown: ok\n");
+    return PJ_TRUE;
+}
+
+int main()
+{
+    pjsua_transport_config tp_cfg;
+    pjsua_transport_id tp_id;
+    test_rx rx;
+    unsigned failed = 0;
+
+    if (test_init(&gated_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+    //Held back messages are clones, they keep a reference to the transport
+    pjsua_transport_config_default(&tp_cfg);
+    tp_cfg.port = 0;
+    tp_cfg.bound_addr = pj_str("127.0.0.1");
+    if (pjsua_transport_create(PJSIP_TRANSPORT_UDP, &tp_cfg, &tp_id) != PJ_SUCCESS ||
+        pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &capture_module) != PJ_SUCCESS ||
+        test_rx_init(&rx, NULL) != PJ_SUCCESS) {
+        test_destroy();
+        return 1;
+    }
+    rx.rdata->tp_info.transport = pjsua_var.tpdata[tp_id].data.tp;
+    pj_nat64_set_options((nat64_options)(NAT64_REWRITE_INCOMING_SDP | NAT64_DEFER_RESOLUTION));
+
+    if (!test_reinjection(&rx)) {
+        failed++;
+    }
+    if (!test_timeout(&rx)) {
+        failed++;
+    }
+    //Disables the module
+    if (!test_teardown(&rx)) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_rx_destroy(&rx);
+    pjsip_endpt_unregister_module(pjsua_get_pjsip_endpt(), &capture_module);
+    pjsua_destroy();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+/*
+ * Test of the table of public addresses: learning from the Via of responses, lookup per local address, replacement
+ * of the oldest entry and expiry.
+ *
+ * The responses only carry the top Via, which is all the table learns from. The table is built with room for four
+ * entries and a short TTL so eviction and expiry happen within the test. The module source is included directly like
+ * in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-mapping-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-mapping-test
+ * Run:
+ *   ./nat64-mapping-test
+ */
+#define NAT64_MAPPING_SIZE          4
+#define NAT64_MAPPING_TTL_MSEC      300
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+static pjsip_transport transport;
+
+//A response whose top Via was sent from sent_by and received from received, NULL for none
+static void receive_via(const char* sent_by, const char* received)
+{
+    pjsip_rx_data rdata;
+    pjsip_via_hdr via;
+
+    pj_bzero(&rdata, sizeof(rdata));
+    pj_bzero(&via, sizeof(via));
+    via.sent_by.host = pj_str((char*)sent_by);
+    via.sent_by.port = 5060;
+    if (received != NULL) {
+        via.recvd_param = pj_str((char*)received);
+    }
+    rdata.msg_info.via = &via;
+    rdata.tp_info.transport = &transport;
+    mapping_learn_from_via(&rdata);
+}
+
+//The public address announced for local, or "" if there is none
+static const char* public_address(const char* local, char* buf, int buf_len)
+{
+    pj_str_t local_str = pj_str((char*)local);
+
+    if (pj_nat64_get_public_address(&local_str, buf, buf_len) != PJ_SUCCESS) {
+        buf[0] = '\0';
+    }
+    return buf;
+}
+
+static pj_bool_t expect(const char* step, const char* local, const char* public_addr)
+{
+    char buf[PJ_INET_ADDRSTRLEN];
+
+    if (strcmp(public_address(local, buf, sizeof(buf)), public_addr) != 0) {
+        printf("%s: %s is announced as \"%s\" instead of \"%s\"\n", step, local, buf, public_addr);
+        return PJ_FALSE;
+    }
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_learn()
+{
+    char buf[PJ_INET_ADDRSTRLEN];
+    pj_str_t local = pj_str("2001:db8:1000::25");
+    pj_str_t addr;
+    const nat64_config* cfg;
+
+    pj_nat64_flush_cache();
+    cfg = config_acquire();
+    get_outgoing_ipv4_address(&cfg->global, &local, buf, sizeof(buf), &addr);
+    config_release(cfg);
+    if (pj_strcmp2(&addr, "192.168.1.1") != 0) {
+        printf("learn: %.*s announced before anything was learned\n", (int)addr.slen, addr.ptr);
+        return PJ_FALSE;
+    }
+    //Nothing to learn without received= or from an ipv6 received=
+    receive_via("2001:db8:1000::25", NULL);
+    receive_via("2001:db8:1000::25", "2001:db8:2000::1");
+    if (!expect("learn", "2001:db8:1000::25", "")) {
+        return PJ_FALSE;
+    }
+    receive_via("2001:db8:1000::25", "203.0.113.10");
+    //The Via may carry the published name, the local address then comes from the transport
+    receive_via("sip.example.com", "203.0.113.11");
+    if (!expect("learn", "2001:db8:1000::25", "203.0.113.10") ||
+        !expect("learn", "2001:db8:1000::26", "203.0.113.11")) {
+        return PJ_FALSE;
+    }
+    //The NAT64 picked another address for the same local one
+    receive_via("2001:db8:1000::25", "203.0.113.12");
+    if (!expect("learn", "2001:db8:1000::25", "203.0.113.12") || mapping_table.count != 2) {
+        return PJ_FALSE;
+    }
+    //An address without an entry gets the most recent one
+    if (!expect("learn", "2001:db8:1000::99", "203.0.113.12")) {
+        return PJ_FALSE;
+    }
+    cfg = config_acquire();
+    get_outgoing_ipv4_address(&cfg->global, &local, buf, sizeof(buf), &addr);
+    config_release(cfg);
+    if (pj_strcmp2(&addr, "203.0.113.12") != 0) {
+        printf("learn: outgoing sdp gets %.*s\n", (int)addr.slen, addr.ptr);
+        return PJ_FALSE;
+    }
+    printf("learn: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_eviction()
+{
+    char local[PJ_INET6_ADDRSTRLEN];
+    char public_addr[PJ_INET_ADDRSTRLEN];
+    unsigned i;
+
+    pj_nat64_flush_cache();
+    for (i = 0; i <= NAT64_MAPPING_SIZE; i++) {
+        pj_ansi_snprintf(local, sizeof(local), "2001:db8:1000::%u", i + 1);
+        pj_ansi_snprintf(public_addr, sizeof(public_addr), "203.0.113.%u", i + 1);
+        receive_via(local, public_addr);
+        //Entries learned within the same millisecond would all be the oldest
+        pj_thread_sleep(2);
+    }
+    if (mapping_table.count != NAT64_MAPPING_SIZE) {
+        printf("eviction: %u entries\n", mapping_table.count);
+        return PJ_FALSE;
+    }
+    //The first entry was replaced, its address now gets the most recent one
+    pj_ansi_snprintf(public_addr, sizeof(public_addr), "203.0.113.%u", NAT64_MAPPING_SIZE + 1);
+    if (!expect("eviction", "2001:db8:1000::1", public_addr) ||
+        !expect("eviction", "2001:db8:1000::2", "203.0.113.2")) {
+        return PJ_FALSE;
+    }
+    printf("eviction: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_expiry()
+{
+    pj_nat64_flush_cache();
+    receive_via("2001:db8:1000::25", "203.0.113.10");
+    receive_via("2001:db8:1000::26", "203.0.113.11");
+    pj_thread_sleep(NAT64_MAPPING_TTL_MSEC * 2 / 3);
+    //Every response refreshes the entry
+    receive_via("2001:db8:1000::25", "203.0.113.10");
+    pj_thread_sleep(NAT64_MAPPING_TTL_MSEC * 2 / 3);
+    //The other one expired, its address gets the remaining one
+    if (!expect("expiry", "2001:db8:1000::25", "203.0.113.10") ||
+        !expect("expiry", "2001:db8:1000::26", "203.0.113.10")) {
+        return PJ_FALSE;
+    }
+    pj_thread_sleep(NAT64_MAPPING_TTL_MSEC);
+    if (!expect("expiry", "2001:db8:1000::25", "")) {
+        return PJ_FALSE;
+    }
+    //Flushing the cache forgets the addresses too
+    receive_via("2001:db8:1000::25", "203.0.113.10");
+    pj_nat64_flush_cache();
+    if (!expect("expiry", "2001:db8:1000::25", "")) {
+        return PJ_FALSE;
+    }
+    printf("expiry: ok\n");
+    return PJ_TRUE;
+}
+
+int main()
+{
+    unsigned failed = 0;
+
+    if (test_init(&stub_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+    stub_transport_init(&transport, "2001:db8:1000::26");
+
+    if (!test_learn()) {
+        failed++;
+    }
+    if (!test_eviction()) {
+        failed++;
+    }
+    if (!test_expiry()) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+/*
+ * Test of the rewrite memos: retransmissions of an outgoing message and repeated incoming bodies are not rewritten
+ * again, anything else is.
+ *
+ * An outgoing message is marked as rewritten by the buffer it was printed to and the print of it. Sending the same
+ * buffer again must hit the memo, a new print or another buffer must not. Incoming bodies are remembered by Call-ID,
+ * CSeq, method and body: the same 200 OK again must give the same message without a rewrite, another body, another
+ * CSeq or a new configuration must not. The module source is included directly like in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-memo-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-memo-test
+ * Run:
+ *   ./nat64-memo-test
+ */
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+static const char outgoing_head[] =
+    "SIP/2.0 200 OK\r\n"
+    "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKmemo1\r\n"
+    "From: <sip:bob@example.com>;tag=memo1\r\n"
+    "To: <sip:alice@example.com>;tag=memo2\r\n"
+    "Call-ID: memo-test-1\r\n"
+    "CSeq: 1 INVITE\r\n"
+    "Contact: <sip:alice@[2001:db8:1000::25]:5060>\r\n";
+
+static const char outgoing_sdp[] =
+    "v=0\r\n"
+    "o=- 3724394400 3724394401 IN IP6 2001:db8:1000::25\r\n"
+    "s=-\r\n"
+    "c=IN IP6 2001:db8:1000::25\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0\r\n";
+
+//CSeq number and the address of the connection line are filled in
+static const char incoming_format[] =
+    "SIP/2.0 200 OK\r\n"
+    "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKmemo2\r\n"
+    "From: <sip:alice@example.com>;tag=memo3\r\n"
+    "To: <sip:bob@example.com>;tag=memo4\r\n"
+    "Call-ID: memo-test-2\r\n"
+    "CSeq: %d INVITE\r\n"
+    "Contact: <sip:bob@198.51.100.7:5060>\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: %d\r\n"
+    "\r\n"
+    "%s";
+
+static const char incoming_sdp_format[] =
+    "v=0\r\n"
+    "o=- 3724394400 3724394401 IN IP4 198.51.100.7\r\n"
+    "s=-\r\n"
+    "c=IN IP4 %s\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0\r\n";
+
+//Send the tdata through mod-ipv6 again like a retransmission. Returns the change of the memo hits, inspected gets
+//the change of the inspected messages.
+static unsigned send_again(pjsip_tx_data* tdata, unsigned* inspected)
+{
+    pj_nat64_stats before, after;
+
+    pj_nat64_get_stats(&before);
+    ipv6_mod_on_tx(tdata);
+    pj_nat64_get_stats(&after);
+    *inspected = after.tx_inspected - before.tx_inspected;
+    return after.memo_hits - before.memo_hits;
+}
+
+static pj_bool_t test_outgoing()
+{
+    char msg[PJSIP_MAX_PKT_LEN];
+    int len = test_build_message(msg, sizeof(msg), outgoing_head, "application/sdp", outgoing_sdp);
+    pjsip_tx_data* tdata;
+    pj_size_t printed_len;
+    pjmedia_sdp_session* sdp;
+    unsigned inspected;
+    char* printed;
+    char* moved;
+    pj_bool_t ok = PJ_FALSE;
+
+    pj_nat64_set_options(NAT64_REWRITE_OUTGOING_SDP);
+    if (test_tx_message(msg, len, &tdata) != PJ_SUCCESS) {
+        printf("outgoing: message not sent\n");
+        return PJ_FALSE;
+    }
+    printed_len = tdata->buf.cur - tdata->buf.start;
+    printed = (char*)pj_pool_alloc(tdata->pool, printed_len);
+    pj_memcpy(printed, tdata->buf.start, printed_len);
+
+    //Same buffer, same print
+    if (send_again(tdata, &inspected) != 1 || inspected != 0) {
+        printf("outgoing: retransmission rewritten again\n");
+    } else if ((pj_size_t)(tdata->buf.cur - tdata->buf.start) != printed_len ||
+               pj_memcmp(tdata->buf.start, printed, printed_len) != 0) {
+        printf("outgoing: retransmission changed the buffer\n");
+    } else {
+        ok = PJ_TRUE;
+    }
+
+    //Printed again from the message, which still has the IPv6 sdp
+    pjsip_tx_data_invalidate_msg(tdata);
+    pjsip_tx_data_encode(tdata);
+    if (ok && (send_again(tdata, &inspected) != 0 || inspected != 1)) {
+        printf("outgoing: new print taken for a retransmission\n");
+        ok = PJ_FALSE;
+    }
+    sdp = ok ? test_tx_sdp(tdata) : NULL;
+    if (ok && (sdp == NULL || pj_stricmp2(&sdp->conn->addr_type, "IP4") != 0)) {
+        printf("outgoing: new print not rewritten\n");
+        ok = PJ_FALSE;
+    }
+
+    //Same print moved to another buffer
+    moved = (char*)pj_pool_alloc(tdata->pool, tdata->buf.end - tdata->buf.start);
+    pj_memcpy(moved, tdata->buf.start, tdata->buf.cur - tdata->buf.start);
+    tdata->buf.cur = moved + (tdata->buf.cur - tdata->buf.start);
+    tdata->buf.end = moved + (tdata->buf.end - tdata->buf.start);
+    tdata->buf.start = moved;
+    if (ok && (send_again(tdata, &inspected) != 0 || inspected != 1)) {
+        printf("outgoing: another buffer taken for a retransmission\n");
+        ok = PJ_FALSE;
+    }
+    if (ok && (send_again(tdata, &inspected) != 1 || inspected != 0)) {
+        printf("outgoing: retransmission of the other buffer rewritten again\n");
+        ok = PJ_FALSE;
+    }
+    pjsip_tx_data_dec_ref(tdata);
+    if (ok) {
+        printf("outgoing: ok\n");
+    }
+    return ok;
+}
+
+//Receive the 200 OK with the given CSeq and connection address. Returns the change of the memo hits, the rewritten
+//message is copied to out.
+static unsigned receive(test_rx* rx, int cseq, const char* conn_addr, char* out, int out_size)
+{
+    char sdp[512];
+    char msg[PJSIP_MAX_PKT_LEN];
+    int sdp_len = pj_ansi_snprintf(sdp, sizeof(sdp), incoming_sdp_format, conn_addr);
+    int len = pj_ansi_snprintf(msg, sizeof(msg), incoming_format, cseq, sdp_len, sdp);
+    pj_nat64_stats before, after;
+    pj_bool_t held;
+
+    pj_nat64_get_stats(&before);
+    out[0] = '\0';
+    if (test_rx_message(rx, msg, len, &held) == PJ_SUCCESS) {
+        pj_ansi_snprintf(out, out_size, "%.*s", rx->rdata->msg_info.len, rx->rdata->msg_info.msg_buf);
+    }
+    pj_nat64_get_stats(&after);
+    return after.memo_hits - before.memo_hits;
+}
+
+static pj_bool_t test_incoming(test_rx* rx)
+{
+    char first[PJSIP_MAX_PKT_LEN];
+    char again[PJSIP_MAX_PKT_LEN];
+
+    pj_nat64_set_options(NAT64_REWRITE_INCOMING_SDP);
+    rx_memo_flush();
+    if (receive(rx, 1, "198.51.100.25", first, sizeof(first)) != 0 || strstr(first, "IN IP6 ") == NULL) {
+        printf("incoming: first 200 OK not rewritten\n");
+        return PJ_FALSE;
+    }
+    //A forked or repeated 200 OK with the same sdp
+    if (receive(rx, 1, "198.51.100.25", again, sizeof(again)) != 1 || strcmp(first, again) != 0) {
+        printf("incoming: repeated 200 OK not taken from the memo\n");
+        return PJ_FALSE;
+    }
+    if (receive(rx, 1, "198.51.100.26", again, sizeof(again)) != 0 || strstr(again, "IN IP4 ") != NULL) {
+        printf("incoming: another sdp in the same transaction taken from the memo\n");
+        return PJ_FALSE;
+    }
+    if (receive(rx, 2, "198.51.100.25", again, sizeof(again)) != 0) {
+        printf("incoming: same sdp in another transaction taken from the memo\n");
+        return PJ_FALSE;
+    }
+    //A new configuration may rewrite differently
+    pj_nat64_set_options(NAT64_REWRITE_INCOMING_SDP);
+    if (receive(rx, 2, "198.51.100.25", again, sizeof(again)) != 0 || strstr(again, "IN IP6 ") == NULL) {
+        printf("incoming: memo used across a configuration change\n");
+        return PJ_FALSE;
+    }
+    printf("incoming: ok\n");
+    return PJ_TRUE;
+}
+
+int main()
+{
+    test_rx rx;
+    unsigned failed = 0;
+
+    if (test_init(&stub_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+    if (test_rx_init(&rx, NULL) != PJ_SUCCESS) {
+        test_destroy();
+        return 1;
+    }
+
+    if (!test_outgoing()) {
+        failed++;
+    }
+    if (!test_incoming(&rx)) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_rx_destroy(&rx);
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
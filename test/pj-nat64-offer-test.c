@@ -0,0 +1,299 @@
+/*
+ * Test that every offer and answer is rewritten whatever the method, multipart bodies and ICE candidates included, and
+ * that messages without sdp are left alone.
+ *
+ * Each message goes through the module once rewritten as text and once as a parsed session. Messages with sdp must
+ * come out with every address of the other family: origin, connection lines, a=rtcp and the address of each
+ * candidate. Messages without sdp must not even be inspected. The module source is included directly like in the
+ * benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-offer-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-offer-test
+ * Run:
+ *   ./nat64-offer-test
+ */
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+typedef struct offer_case {
+    const char*     name;
+    pj_bool_t       outgoing;
+    const char*     head;
+    const char*     content_type;   //NULL for a message without body
+    const char*     body;
+    pj_bool_t       has_sdp;
+} offer_case;
+
+#define INCOMING_SDP \
+    "v=0\r\n" \
+    "o=- 3724394400 3724394401 IN IP4 198.51.100.7\r\n" \
+    "s=-\r\n" \
+    "c=IN IP4 198.51.100.25\r\n" \
+    "t=0 0\r\n" \
+    "m=audio 4000 RTP/AVP 0\r\n" \
+    "a=rtcp:4001 IN IP4 198.51.100.25\r\n" \
+    "a=candidate:1 1 UDP 2130706431 198.51.100.25 4000 typ host\r\n" \
+    "a=candidate:2 1 UDP 1694498815 203.0.113.5 4000 typ srflx raddr 198.51.100.25 rport 4000\r\n"
+
+#define OUTGOING_SDP \
+    "v=0\r\n" \
+    "o=- 3724394400 3724394401 IN IP6 2001:db8:1000::25\r\n" \
+    "s=-\r\n" \
+    "c=IN IP6 2001:db8:1000::25\r\n" \
+    "t=0 0\r\n" \
+    "m=audio 4000 RTP/AVP 0\r\n" \
+    "a=rtcp:4001 IN IP6 2001:db8:1000::25\r\n" \
+    "a=candidate:1 1 UDP 2130706431 2001:db8:1000::25 4000 typ host\r\n"
+
+#define MULTIPART_TYPE  "multipart/mixed;boundary=nat64part"
+
+#define MULTIPART(sdp) \
+    "--nat64part\r\n" \
+    "Content-Type: application/sdp\r\n" \
+    "\r\n" \
+    sdp \
+    "\r\n--nat64part\r\n" \
+    "Content-Type: text/plain\r\n" \
+    "\r\n" \
+    "hello\r\n" \
+    "--nat64part--\r\n"
+
+static const offer_case cases[] = {
+    { "incoming UPDATE", PJ_FALSE,
+      "UPDATE sip:alice@[2001:db8:1000::25] SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKoffer1\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:bob@example.com>;tag=offer1\r\n"
+      "To: <sip:alice@example.com>;tag=offer2\r\n"
+      "Call-ID: offer-test-1\r\n"
+      "CSeq: 2 UPDATE\r\n",
+      "application/sdp", INCOMING_SDP, PJ_TRUE },
+    { "incoming PRACK", PJ_FALSE,
+      "PRACK sip:alice@[2001:db8:1000::25] SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKoffer2\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:bob@example.com>;tag=offer1\r\n"
+      "To: <sip:alice@example.com>;tag=offer2\r\n"
+      "Call-ID: offer-test-2\r\n"
+      "CSeq: 2 PRACK\r\n"
+      "RAck: 1 1 INVITE\r\n",
+      "application/sdp", INCOMING_SDP, PJ_TRUE },
+    { "incoming ACK", PJ_FALSE,
+      "ACK sip:alice@[2001:db8:1000::25] SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKoffer3\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:bob@example.com>;tag=offer1\r\n"
+      "To: <sip:alice@example.com>;tag=offer2\r\n"
+      "Call-ID: offer-test-3\r\n"
+      "CSeq: 1 ACK\r\n",
+      "application/sdp", INCOMING_SDP, PJ_TRUE },
+    { "incoming 183", PJ_FALSE,
+      "SIP/2.0 183 Session Progress\r\n"
+      "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKoffer4\r\n"
+      "From: <sip:alice@example.com>;tag=offer3\r\n"
+      "To: <sip:bob@example.com>;tag=offer4\r\n"
+      "Call-ID: offer-test-4\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Require: 100rel\r\n"
+      "RSeq: 1\r\n",
+      "application/sdp", INCOMING_SDP, PJ_TRUE },
+    { "incoming multipart INVITE", PJ_FALSE,
+      "INVITE sip:alice@[2001:db8:1000::25] SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKoffer5\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:bob@example.com>;tag=offer5\r\n"
+      "To: <sip:alice@example.com>\r\n"
+      "Call-ID: offer-test-5\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:bob@198.51.100.7:5060>\r\n",
+      MULTIPART_TYPE, MULTIPART(INCOMING_SDP), PJ_TRUE },
+    { "incoming 180", PJ_FALSE,
+      "SIP/2.0 180 Ringing\r\n"
+      "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKoffer6\r\n"
+      "From: <sip:alice@example.com>;tag=offer6\r\n"
+      "To: <sip:bob@example.com>;tag=offer7\r\n"
+      "Call-ID: offer-test-6\r\n"
+      "CSeq: 1 INVITE\r\n",
+      NULL, NULL, PJ_FALSE },
+    { "incoming MESSAGE", PJ_FALSE,
+      "MESSAGE sip:alice@[2001:db8:1000::25] SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKoffer7\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:bob@example.com>;tag=offer8\r\n"
+      "To: <sip:alice@example.com>\r\n"
+      "Call-ID: offer-test-7\r\n"
+      "CSeq: 1 MESSAGE\r\n",
+      "text/plain", "c=IN IP4 198.51.100.25\r\n", PJ_FALSE },
+    { "outgoing UPDATE", PJ_TRUE,
+      "UPDATE sip:bob@198.51.100.7:5060 SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKoffer8\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:alice@example.com>;tag=offer9\r\n"
+      "To: <sip:bob@example.com>;tag=offer10\r\n"
+      "Call-ID: offer-test-8\r\n"
+      "CSeq: 3 UPDATE\r\n",
+      "application/sdp", OUTGOING_SDP, PJ_TRUE },
+    { "outgoing multipart 200 OK", PJ_TRUE,
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKoffer9\r\n"
+      "From: <sip:bob@example.com>;tag=offer11\r\n"
+      "To: <sip:alice@example.com>;tag=offer12\r\n"
+      "Call-ID: offer-test-9\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:alice@[2001:db8:1000::25]:5060>\r\n",
+      MULTIPART_TYPE, MULTIPART(OUTGOING_SDP), PJ_TRUE },
+    { "outgoing BYE", PJ_TRUE,
+      "BYE sip:bob@198.51.100.7:5060 SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKoffer10\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:alice@example.com>;tag=offer13\r\n"
+      "To: <sip:bob@example.com>;tag=offer14\r\n"
+      "Call-ID: offer-test-10\r\n"
+      "CSeq: 4 BYE\r\n",
+      NULL, NULL, PJ_FALSE },
+};
+
+//The address of a candidate attribute follows foundation, component, transport and priority
+static pj_str_t candidate_address(const pj_str_t* value)
+{
+    pj_str_t addr;
+    unsigned fields = 0;
+    pj_ssize_t i = 0;
+
+    while (i < value->slen && fields < 4) {
+        if (value->ptr[i++] == ' ') {
+            fields++;
+        }
+    }
+    addr.ptr = value->ptr + i;
+    while (i < value->slen && value->ptr[i] != ' ') {
+        i++;
+    }
+    addr.slen = value->ptr + i - addr.ptr;
+    return addr;
+}
+
+//Every address of the session is of the family the rewrite gives, IPv4 for outgoing messages and IPv6 for incoming
+static pj_bool_t all_rewritten(const pjmedia_sdp_session* sdp, pj_bool_t outgoing)
+{
+    const char* type = outgoing ? "IP4" : "IP6";
+    unsigned i, j;
+
+    if (pj_stricmp2(&sdp->origin.addr_type, type) != 0 ||
+        (sdp->conn != NULL && pj_stricmp2(&sdp->conn->addr_type, type) != 0)) {
+        return PJ_FALSE;
+    }
+    for (i = 0; i < sdp->media_count; i++) {
+        const pjmedia_sdp_media* media = sdp->media[i];
+        if (media->conn != NULL && pj_stricmp2(&media->conn->addr_type, type) != 0) {
+            return PJ_FALSE;
+        }
+        for (j = 0; j < media->attr_count; j++) {
+            const pjmedia_sdp_attr* attr = media->attr[j];
+            pjmedia_sdp_rtcp_attr rtcp;
+            pj_str_t addr;
+
+            if (pj_stricmp2(&attr->name, "rtcp") == 0 && pjmedia_sdp_attr_get_rtcp(attr, &rtcp) == PJ_SUCCESS &&
+                rtcp.addr.slen > 0 && pj_stricmp2(&rtcp.addr_type, type) != 0) {
+                return PJ_FALSE;
+            }
+            if (pj_stricmp2(&attr->name, "candidate") == 0) {
+                addr = candidate_address(&attr->value);
+                if ((pj_memchr(addr.ptr, ':', addr.slen) != NULL) == outgoing) {
+                    return PJ_FALSE;
+                }
+            }
+        }
+    }
+    return PJ_TRUE;
+}
+
+//Run the message with the given options. Returns PJ_TRUE if the module inspected it, ok tells if the addresses came
+//out as expected.
+static pj_bool_t run(const offer_case* c, test_rx* rx, nat64_options options, pj_bool_t* ok)
+{
+    char msg[PJSIP_MAX_PKT_LEN];
+    int len = test_build_message(msg, sizeof(msg), c->head, c->content_type, c->body);
+    const pjmedia_sdp_session* sdp = NULL;
+    pjsip_tx_data* tdata = NULL;
+    pj_nat64_stats before, after;
+    pj_bool_t held;
+    pj_status_t status;
+
+    pj_nat64_set_options(options);
+    //A memo hit would hide the rewrite of the second run
+    rx_memo_flush();
+    pj_nat64_get_stats(&before);
+    if (c->outgoing) {
+        status = test_tx_message(msg, len, &tdata);
+        if (status == PJ_SUCCESS && c->has_sdp) {
+            sdp = test_tx_sdp(tdata);
+        }
+    } else {
+        status = test_rx_message(rx, msg, len, &held);
+        if (status == PJ_SUCCESS && c->has_sdp) {
+            sdp = test_rx_sdp(rx);
+        } else if (status == PJ_SUCCESS && c->body != NULL) {
+            //A body that is not sdp keeps its addresses
+            const pjsip_msg_body* body = rx->rdata->msg_info.msg->body;
+            const char* data = (const char*)body->data;
+            status = find_bytes(data, data + body->len, "IN IP4 ", 7) != NULL ? PJ_SUCCESS : PJ_EINVAL;
+        }
+    }
+    pj_nat64_get_stats(&after);
+    *ok = status == PJ_SUCCESS && (!c->has_sdp || (sdp != NULL && all_rewritten(sdp, c->outgoing)));
+    if (tdata != NULL) {
+        pjsip_tx_data_dec_ref(tdata);
+    }
+    return c->outgoing ? after.tx_inspected != before.tx_inspected : after.rx_inspected != before.rx_inspected;
+}
+
+static pj_bool_t test_case(const offer_case* c, test_rx* rx)
+{
+    nat64_options options = (nat64_options)(NAT64_REWRITE_INCOMING_SDP | NAT64_REWRITE_OUTGOING_SDP);
+    const char* modes[] = { "text", "parsed" };
+    unsigned i;
+
+    for (i = 0; i < PJ_ARRAY_SIZE(modes); i++) {
+        pj_bool_t ok;
+        pj_bool_t inspected = run(c, rx, i == 0 ? options : (nat64_options)(options | NAT64_REWRITE_PARSED_SDP), &ok);
+
+        if (!ok) {
+            printf("%s, %s: %s\n", c->name, modes[i], c->has_sdp ? "addresses left unchanged" : "body changed");
+            return PJ_FALSE;
+        }
+        if (inspected != c->has_sdp) {
+            printf("%s, %s: %s\n", c->name, modes[i], inspected ? "inspected without sdp" : "sdp not inspected");
+            return PJ_FALSE;
+        }
+    }
+    printf("%s: ok\n", c->name);
+    return PJ_TRUE;
+}
+
+int main()
+{
+    test_rx rx;
+    unsigned failed = 0;
+    unsigned i;
+
+    if (test_init(&stub_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+    if (test_rx_init(&rx, NULL) != PJ_SUCCESS) {
+        test_destroy();
+        return 1;
+    }
+
+    for (i = 0; i < PJ_ARRAY_SIZE(cases); i++) {
+        if (!test_case(&cases[i], &rx)) {
+            failed++;
+        }
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_rx_destroy(&rx);
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+/*
+ * Test that rewriting the parsed sdp (NAT64_REWRITE_PARSED_SDP) gives the same addresses as rewriting the printed
+ * message.
+ *
+ * Every message is run through the module twice, once rewritten as text and once as a parsed session. The resulting
+ * sessions are compared line by line: origin, connection lines and every attribute, which covers a=rtcp and the ICE
+ * candidates. The printed form may differ, pjmedia prints the session again. Both runs must also replace the same
+ * number of addresses. The module source is included directly like in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-parsed-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-parsed-test
+ * Run:
+ *   ./nat64-parsed-test
+ */
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+typedef struct parsed_case {
+    const char*     name;
+    pj_bool_t       outgoing;
+    const char*     head;
+    const char*     sdp;
+} parsed_case;
+
+static const char incoming_sdp[] =
+    "v=0\r\n"
+    "o=- 3724394400 3724394401 IN IP4 198.51.100.7\r\n"
+    "s=-\r\n"
+    "c=IN IP4 198.51.100.25\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0 101\r\n"
+    "c=IN IP4 198.51.100.26\r\n"
+    "a=rtcp:4001 IN IP4 198.51.100.26\r\n"
+    "a=candidate:1 1 UDP 2130706431 198.51.100.26 4000 typ host\r\n"
+    "a=candidate:2 1 UDP 1694498815 203.0.113.5 4000 typ srflx raddr 198.51.100.26 rport 4000\r\n"
+    "a=rtpmap:101 telephone-event/8000\r\n"
+    "m=video 4002 RTP/AVP 96\r\n"
+    "a=rtcp:4003\r\n"
+    "a=rtpmap:96 H264/90000\r\n";
+
+static const char outgoing_sdp[] =
+    "v=0\r\n"
+    "o=- 3724394400 3724394401 IN IP6 2001:db8:1000::25\r\n"
+    "s=-\r\n"
+    "c=IN IP6 2001:db8:1000::25\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0 101\r\n"
+    "a=rtcp:4001 IN IP6 2001:db8:1000::25\r\n"
+    "a=candidate:1 1 UDP 2130706431 2001:db8:1000::25 4000 typ host\r\n"
+    "a=candidate:2 1 UDP 2130706175 198.51.100.9 4000 typ host\r\n"
+    "a=rtpmap:101 telephone-event/8000\r\n"
+    "m=video 4002 RTP/AVP 96\r\n"
+    "c=IN IP6 2001:db8:1000::26\r\n"
+    "a=rtpmap:96 H264/90000\r\n";
+
+static const parsed_case cases[] = {
+    { "incoming INVITE", PJ_FALSE,
+      "INVITE sip:alice@[2001:db8:1000::25] SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKparsed1\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:bob@example.com>;tag=parsed1\r\n"
+      "To: <sip:alice@example.com>\r\n"
+      "Call-ID: parsed-test-1\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:bob@198.51.100.7:5060>\r\n",
+      incoming_sdp },
+    { "incoming 183", PJ_FALSE,
+      "SIP/2.0 183 Session Progress\r\n"
+      "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKparsed2\r\n"
+      "From: <sip:alice@example.com>;tag=parsed2\r\n"
+      "To: <sip:bob@example.com>;tag=parsed3\r\n"
+      "Call-ID: parsed-test-2\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Require: 100rel\r\n"
+      "RSeq: 1\r\n",
+      incoming_sdp },
+    { "outgoing INVITE", PJ_TRUE,
+      "INVITE sip:bob@example.com SIP/2.0\r\n"
+      "Via: SIP/2.0/UDP [2001:db8:1000::25]:5060;rport;branch=z9hG4bKparsed4\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:alice@example.com>;tag=parsed4\r\n"
+      "To: <sip:bob@example.com>\r\n"
+      "Call-ID: parsed-test-3\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:alice@[2001:db8:1000::25]:5060>\r\n",
+      outgoing_sdp },
+    { "outgoing 200 OK", PJ_TRUE,
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/UDP 198.51.100.7:5060;rport;branch=z9hG4bKparsed5\r\n"
+      "From: <sip:bob@example.com>;tag=parsed5\r\n"
+      "To: <sip:alice@example.com>;tag=parsed6\r\n"
+      "Call-ID: parsed-test-4\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:alice@[2001:db8:1000::25]:5060>\r\n",
+      outgoing_sdp },
+};
+
+static pj_bool_t same_conn(const pjmedia_sdp_conn* a, const pjmedia_sdp_conn* b)
+{
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return pj_strcmp(&a->addr_type, &b->addr_type) == 0 && pj_strcmp(&a->addr, &b->addr) == 0;
+}
+
+//Addresses and attributes of both sessions are the same, whatever the formatting
+static pj_bool_t same_sdp(const pjmedia_sdp_session* a, const pjmedia_sdp_session* b)
+{
+    unsigned i, j;
+
+    if (pj_strcmp(&a->origin.addr_type, &b->origin.addr_type) != 0 ||
+        pj_strcmp(&a->origin.addr, &b->origin.addr) != 0 || !same_conn(a->conn, b->conn) ||
+        a->media_count != b->media_count) {
+        return PJ_FALSE;
+    }
+    for (i = 0; i < a->media_count; i++) {
+        const pjmedia_sdp_media* media_a = a->media[i];
+        const pjmedia_sdp_media* media_b = b->media[i];
+        if (!same_conn(media_a->conn, media_b->conn) || media_a->attr_count != media_b->attr_count) {
+            return PJ_FALSE;
+        }
+        for (j = 0; j < media_a->attr_count; j++) {
+            if (pj_strcmp(&media_a->attr[j]->name, &media_b->attr[j]->name) != 0 ||
+                pj_strcmp(&media_a->attr[j]->value, &media_b->attr[j]->value) != 0) {
+                return PJ_FALSE;
+            }
+        }
+    }
+    return PJ_TRUE;
+}
+
+//Run the message with the given options. The session is cloned into pool, replaced gets the number of addresses.
+static pjmedia_sdp_session* rewrite(const parsed_case* c, test_rx* rx, pj_pool_t* pool, nat64_options options,
+                                    unsigned* replaced)
+{
+    char msg[PJSIP_MAX_PKT_LEN];
+    int len = test_build_message(msg, sizeof(msg), c->head, "application/sdp", c->sdp);
+    const pjmedia_sdp_session* sdp = NULL;
+    pjsip_tx_data* tdata = NULL;
+    pj_nat64_stats before, after;
+    pjmedia_sdp_session* copy;
+    pj_bool_t held;
+
+    pj_nat64_set_options(options);
+    //A memo hit would hide the rewrite of the second run
+    rx_memo_flush();
+    pj_nat64_get_stats(&before);
+    if (c->outgoing) {
+        if (test_tx_message(msg, len, &tdata) == PJ_SUCCESS) {
+            sdp = test_tx_sdp(tdata);
+        }
+    } else if (test_rx_message(rx, msg, len, &held) == PJ_SUCCESS) {
+        sdp = test_rx_sdp(rx);
+    }
+    pj_nat64_get_stats(&after);
+    *replaced = after.addresses_replaced - before.addresses_replaced;
+    copy = sdp != NULL ? pjmedia_sdp_session_clone(pool, sdp) : NULL;
+    if (tdata != NULL) {
+        pjsip_tx_data_dec_ref(tdata);
+    }
+    return copy;
+}
+
+static pj_bool_t test_case(const parsed_case* c, test_rx* rx, pj_pool_t* pool)
+{
+    nat64_options options = c->outgoing ? NAT64_REWRITE_OUTGOING_SDP : NAT64_REWRITE_INCOMING_SDP;
+    pjmedia_sdp_session* text;
+    pjmedia_sdp_session* parsed;
+    unsigned text_replaced, parsed_replaced;
+
+    text = rewrite(c, rx, pool, options, &text_replaced);
+    parsed = rewrite(c, rx, pool, (nat64_options)(options | NAT64_REWRITE_PARSED_SDP), &parsed_replaced);
+    if (text == NULL || parsed == NULL) {
+        printf("%s: no sdp after the rewrite\n", c->name);
+        return PJ_FALSE;
+    }
+    if (pj_stricmp2(&text->origin.addr_type, c->outgoing ? "IP4" : "IP6") != 0) {
+        printf("%s: the origin was not rewritten\n", c->name);
+        return PJ_FALSE;
+    }
+    if (!same_sdp(text, parsed)) {
+        printf("%s: parsed rewrite differs from the text rewrite\n", c->name);
+        return PJ_FALSE;
+    }
+    if (text_replaced != parsed_replaced) {
+        printf("%s: %u addresses replaced in the text, %u in the parsed sdp\n", c->name, text_replaced,
+               parsed_replaced);
+        return PJ_FALSE;
+    }
+    printf("%s: %u addresses\n", c->name, parsed_replaced);
+    return PJ_TRUE;
+}
+
+int main()
+{
+    pj_pool_t* pool;
+    test_rx rx;
+    unsigned failed = 0;
+    unsigned i;
+
+    if (test_init(&stub_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+    pool = pjsua_pool_create("parsedtest", 4000, 4000);
+    if (pool == NULL || test_rx_init(&rx, NULL) != PJ_SUCCESS) {
+        test_destroy();
+        return 1;
+    }
+
+    for (i = 0; i < PJ_ARRAY_SIZE(cases); i++) {
+        if (!test_case(&cases[i], &rx, pool)) {
+            failed++;
+        }
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_rx_destroy(&rx);
+    pj_pool_release(pool);
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
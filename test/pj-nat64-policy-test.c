@@ -0,0 +1,163 @@
+/*
+ * Test of the policy lookup: account policy, then the policy of the transport type, then detection and finally the
+ * global options.
+ *
+ * Each step changes one setting and checks the options a message gets on three transports: the udp transport of a
+ * local account, another udp transport and a udp6 transport. It also checks that a policy brings its own NAT64
+ * prefix and mapped address and that an invalid prefix is refused. The module source is included directly like in
+ * the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-policy-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-policy-test
+ * Run:
+ *   ./nat64-policy-test
+ */
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+#define GLOBAL_OPTIONS  NAT64_REWRITE_OUTGOING_SDP
+#define UDP6_OPTIONS    NAT64_REWRITE_INCOMING_SDP
+#define UDP_OPTIONS     (NAT64_REWRITE_INCOMING_SDP | NAT64_REWRITE_ROUTE_AND_CONTACT)
+#define ACCOUNT_OPTIONS NAT64_REWRITE_ROUTE_AND_CONTACT
+#define AUTO_OPTIONS    (NAT64_REWRITE_OUTGOING_SDP | NAT64_REWRITE_INCOMING_SDP)
+
+static pjsip_transport* account_tp;
+static pjsip_transport udp_tp;
+static pjsip_transport udp6_tp;
+
+static unsigned options_for(const pjsip_transport* tp)
+{
+    const nat64_config* cfg = config_acquire();
+    unsigned options = policy_for_transport(cfg, tp)->options;
+    config_release(cfg);
+    return options;
+}
+
+//The options on the account transport, the other udp transport and the udp6 transport
+static pj_bool_t expect(const char* step, unsigned account, unsigned udp, unsigned udp6)
+{
+    unsigned got_account = options_for(account_tp);
+    unsigned got_udp = options_for(&udp_tp);
+    unsigned got_udp6 = options_for(&udp6_tp);
+
+    if (got_account != account || got_udp != udp || got_udp6 != udp6) {
+        printf("%s: options %x/%x/%x, expected %x/%x/%x\n", step, got_account, got_udp, got_udp6, account, udp,
+               udp6);
+        return PJ_FALSE;
+    }
+    printf("%s: ok\n", step);
+    return PJ_TRUE;
+}
+
+static pj_status_t set_policy(pjsip_transport_type_e type, pjsua_acc_id acc_id, unsigned options)
+{
+    pj_nat64_policy policy;
+
+    pj_nat64_policy_default(&policy);
+    policy.options = options;
+    return acc_id != PJSUA_INVALID_ID ? pj_nat64_set_account_policy(acc_id, &policy) :
+                                        pj_nat64_set_transport_policy(type, &policy);
+}
+
+static pj_bool_t test_precedence(pjsua_acc_id acc_id)
+{
+    pj_bool_t ok = PJ_TRUE;
+
+    pj_nat64_set_options(GLOBAL_OPTIONS);
+    ok &= expect("global", GLOBAL_OPTIONS, GLOBAL_OPTIONS, GLOBAL_OPTIONS);
+    set_policy(PJSIP_TRANSPORT_UDP6, PJSUA_INVALID_ID, UDP6_OPTIONS);
+    ok &= expect("udp6 policy", GLOBAL_OPTIONS, GLOBAL_OPTIONS, UDP6_OPTIONS);
+    set_policy(PJSIP_TRANSPORT_UDP, acc_id, ACCOUNT_OPTIONS);
+    ok &= expect("account policy", ACCOUNT_OPTIONS, GLOBAL_OPTIONS, UDP6_OPTIONS);
+    set_policy(PJSIP_TRANSPORT_UDP, PJSUA_INVALID_ID, UDP_OPTIONS);
+    ok &= expect("account over udp policy", ACCOUNT_OPTIONS, UDP_OPTIONS, UDP6_OPTIONS);
+    pj_nat64_set_account_policy(acc_id, NULL);
+    ok &= expect("account policy removed", UDP_OPTIONS, UDP_OPTIONS, UDP6_OPTIONS);
+    pj_nat64_set_transport_policy(PJSIP_TRANSPORT_UDP, NULL);
+
+    //The stub resolver answers ipv4only.arpa, detection turns rewriting on for ipv6 transports only
+    pj_nat64_set_auto_detect(AUTO_OPTIONS);
+    pj_nat64_discover_prefix();
+    ok &= expect("detection under udp6 policy", 0, 0, UDP6_OPTIONS);
+    pj_nat64_set_transport_policy(PJSIP_TRANSPORT_UDP6, NULL);
+    ok &= expect("detection", 0, 0, AUTO_OPTIONS);
+    pj_nat64_set_options(GLOBAL_OPTIONS);
+    ok &= expect("detection turned off", GLOBAL_OPTIONS, GLOBAL_OPTIONS, GLOBAL_OPTIONS);
+    return ok;
+}
+
+static pj_bool_t test_policy_settings()
+{
+    pj_str_t ipv4 = pj_str("192.0.2.33");
+    pj_str_t local = pj_str("2001:db8:1000::25");
+    char synthesized[PJ_INET6_ADDRSTRLEN];
+    char buf[PJ_INET6_ADDRSTRLEN];
+    pj_str_t mapped;
+    pj_nat64_policy policy;
+    const nat64_config* cfg;
+    const nat64_policy* found;
+    pj_bool_t ok;
+
+    pj_nat64_policy_default(&policy);
+    policy.options = UDP6_OPTIONS;
+    policy.prefix = pj_str("2001:db8:64::");
+    policy.prefix_len = 33;
+    if (pj_nat64_set_transport_policy(PJSIP_TRANSPORT_UDP6, &policy) != PJ_EINVAL) {
+        printf("settings: prefix length 33 accepted\n");
+        return PJ_FALSE;
+    }
+    policy.prefix_len = 96;
+    policy.mapped_addr = pj_str("203.0.113.77");
+    if (pj_nat64_set_transport_policy(PJSIP_TRANSPORT_UDP6, &policy) != PJ_SUCCESS) {
+        printf("settings: policy refused\n");
+        return PJ_FALSE;
+    }
+    cfg = config_acquire();
+    found = policy_for_transport(cfg, &udp6_tp);
+    ok = synthesize_from_prefix(found, &ipv4, synthesized, sizeof(synthesized)) &&
+         strcmp(synthesized, "2001:db8:64::c000:221") == 0;
+    get_outgoing_ipv4_address(found, &local, buf, sizeof(buf), &mapped);
+    ok = ok && pj_strcmp2(&mapped, "203.0.113.77") == 0;
+    //The global policy keeps its own settings
+    ok = ok && !policy_for_transport(cfg, &udp_tp)->has_prefix;
+    config_release(cfg);
+    pj_nat64_set_transport_policy(PJSIP_TRANSPORT_UDP6, NULL);
+    printf("settings: %s\n", ok ? "ok" : "prefix or mapped address of the policy not used");
+    return ok;
+}
+
+int main()
+{
+    pjsua_transport_config tp_cfg;
+    pjsua_transport_id tp_id;
+    pjsua_acc_id acc_id;
+    unsigned failed = 0;
+
+    if (test_init(&stub_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+    //Account policies find messages through the transport of the account, it has to be a real one
+    pjsua_transport_config_default(&tp_cfg);
+    tp_cfg.port = 0;
+    tp_cfg.bound_addr = pj_str("127.0.0.1");
+    if (pjsua_transport_create(PJSIP_TRANSPORT_UDP, &tp_cfg, &tp_id) != PJ_SUCCESS ||
+        pjsua_acc_add_local(tp_id, PJ_FALSE, &acc_id) != PJ_SUCCESS) {
+        test_destroy();
+        return 1;
+    }
+    account_tp = pjsua_var.tpdata[tp_id].data.tp;
+    stub_transport_init(&udp_tp, "192.0.2.1");
+    stub_transport_init(&udp6_tp, "2001:db8:1000::25");
+
+    if (!test_precedence(acc_id)) {
+        failed++;
+    }
+    if (!test_policy_settings()) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+/*
+ * Test of the NAT64 prefix discovery (RFC 7050) for every prefix length of RFC 6052.
+ *
+ * A stub resolver answers ipv4only.arpa with 192.0.0.170 embedded in a /32, /40, /48, /56, /64 and /96 prefix. For
+ * each of them the test checks the discovered prefix and that 192.0.0.170 is synthesized back to the same answer. It
+ * also checks that a network without DNS64 is reported as such. The module source is included directly like in the
+ * benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-prefix-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-prefix-test
+ * Run:
+ *   ./nat64-prefix-test
+ */
+#include "../pj-nat64.c"
+
+typedef struct prefix_case {
+    unsigned        prefix_len;
+    const char*     answer;
+    const char*     prefix;
+} prefix_case;
+
+//192.0.0.170 embedded as in the examples of RFC 6052 section 2.4
+static const prefix_case cases[] = {
+    { 32,   "2001:db8:c000:aa::",           "2001:db8::" },
+    { 40,   "2001:db8:1c0:0:aa::",          "2001:db8:100::" },
+    { 48,   "2001:db8:122:c000:0:aa00::",   "2001:db8:122::" },
+    { 56,   "2001:db8:122:3c0:0:aa::",      "2001:db8:122:300::" },
+    { 64,   "2001:db8:122:344:c0:0:aa00::", "2001:db8:122:344::" },
+    { 96,   "2001:db8:122:344::c000:aa",    "2001:db8:122:344::" },
+};
+
+//Answer of the stub resolver for ipv4only.arpa, NULL for a network without DNS64
+static const char* ipv4only_answer;
+
+static pj_status_t stub_getaddrinfo(int af, const pj_str_t *name, unsigned *count, pj_addrinfo ai[])
+{
+    pj_str_t answer;
+
+    PJ_UNUSED_ARG(af);
+    if (*count == 0) {
+        return PJ_ETOOSMALL;
+    }
+    if (pj_stricmp2(name, "ipv4only.arpa") != 0 || ipv4only_answer == NULL) {
+        *count = 0;
+        return PJ_ERESOLVE;
+    }
+    pj_bzero(&ai[0], sizeof(ai[0]));
+    pj_sockaddr_init(PJ_AF_INET6, &ai[0].ai_addr, NULL, 0);
+    answer = pj_str((char*)ipv4only_answer);
+    pj_inet_pton(PJ_AF_INET6, &answer, &ai[0].ai_addr.ipv6.sin6_addr);
+    *count = 1;
+    return PJ_SUCCESS;
+}
+
+//Both addresses in text form, compared as addresses so the formatting does not matter
+static pj_bool_t same_ipv6(const char* a, const char* b)
+{
+    pj_str_t a_str = pj_str((char*)a);
+    pj_str_t b_str = pj_str((char*)b);
+    pj_in6_addr a_addr, b_addr;
+
+    return pj_inet_pton(PJ_AF_INET6, &a_str, &a_addr) == PJ_SUCCESS &&
+           pj_inet_pton(PJ_AF_INET6, &b_str, &b_addr) == PJ_SUCCESS &&
+           pj_memcmp(&a_addr, &b_addr, sizeof(a_addr)) == 0;
+}
+
+static pj_bool_t test_prefix(const prefix_case* c)
+{
+    pj_str_t ipv4 = pj_str("192.0.0.170");
+    char prefix_buf[PJ_INET6_ADDRSTRLEN];
+    char synthesized[PJ_INET6_ADDRSTRLEN];
+    unsigned prefix_len = 0;
+    const nat64_config* cfg;
+    pj_bool_t ok;
+
+    ipv4only_answer = c->answer;
+    pj_nat64_flush_cache();
+    if (pj_nat64_discover_prefix() != PJ_SUCCESS) {
+        printf("/%u: no prefix discovered in %s\n", c->prefix_len, c->answer);
+        return PJ_FALSE;
+    }
+    if (pj_nat64_get_prefix(prefix_buf, sizeof(prefix_buf), &prefix_len) != PJ_SUCCESS ||
+        prefix_len != c->prefix_len || !same_ipv6(prefix_buf, c->prefix)) {
+        printf("/%u: discovered %s/%u, expected %s/%u\n", c->prefix_len, prefix_buf, prefix_len, c->prefix,
+               c->prefix_len);
+        return PJ_FALSE;
+    }
+    cfg = config_acquire();
+    ok = synthesize_from_prefix(&cfg->global, &ipv4, synthesized, sizeof(synthesized));
+    config_release(cfg);
+    if (!ok || !same_ipv6(synthesized, c->answer)) {
+        printf("/%u: 192.0.0.170 not synthesized to %s\n", c->prefix_len, c->answer);
+        return PJ_FALSE;
+    }
+    printf("/%u: %s/%u\n", c->prefix_len, prefix_buf, prefix_len);
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_no_dns64()
+{
+    char prefix_buf[PJ_INET6_ADDRSTRLEN];
+    unsigned prefix_len;
+
+    ipv4only_answer = NULL;
+    pj_nat64_flush_cache();
+    if (pj_nat64_discover_prefix() != PJ_ENOTFOUND ||
+        pj_nat64_get_prefix(prefix_buf, sizeof(prefix_buf), &prefix_len) != PJ_ENOTFOUND) {
+        printf("no DNS64: a prefix was reported\n");
+        return PJ_FALSE;
+    }
+    printf("no DNS64: no prefix\n");
+    return PJ_TRUE;
+}
+
+int main()
+{
+    pjsua_config cfg;
+    pjsua_logging_config log_cfg;
+    pj_status_t status;
+    unsigned failed = 0;
+    unsigned i;
+
+    status = pjsua_create();
+    if (status != PJ_SUCCESS) {
+        return 1;
+    }
+    pjsua_config_default(&cfg);
+    pjsua_logging_config_default(&log_cfg);
+    log_cfg.level = 0;
+    log_cfg.console_level = 0;
+    status = pjsua_init(&cfg, &log_cfg, NULL);
+    if (status == PJ_SUCCESS) {
+        status = pj_nat64_enable_rewrite_module();
+    }
+    if (status != PJ_SUCCESS) {
+        pjsua_destroy();
+        return 1;
+    }
+    pj_nat64_set_resolver(&stub_getaddrinfo);
+
+    for (i = 0; i < PJ_ARRAY_SIZE(cases); i++) {
+        if (!test_prefix(&cases[i])) {
+            failed++;
+        }
+    }
+    if (!test_no_dns64()) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    pj_nat64_disable_rewrite_module();
+    pjsua_destroy();
+    return failed == 0 ? 0 : 1;
+}
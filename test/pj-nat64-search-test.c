@@ -0,0 +1,148 @@
+/*
+ * Test of the vectorized byte search against a plain reference.
+ *
+ * Every search the cpu supports (scalar, SSE2, AVX2 or NEON) looks for the needles the rewrite uses in generated
+ * buffers of every length up to a few blocks, at every alignment, with the needle at every position or missing. The
+ * filler is made of the first and the last byte of the needle so most blocks hold candidates that fail to match.
+ * The bytes after the end of the buffer hold another copy of the needle, a search that looks past the end finds it.
+ * The module source is included directly like in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-search-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-search-test
+ * Run:
+ *   ./nat64-search-test
+ */
+#include "../pj-nat64.c"
+
+#define SEARCH_MAX_LEN      100
+#define SEARCH_MAX_ALIGN    32
+
+typedef struct search_impl {
+    const char*     name;
+    find_bytes_func func;
+} search_impl;
+
+static const char* needles[] = { "\r\n\r\n", "IN IP4 ", "IN IP6 ", "a=candidate:", "Content-Length", ":" };
+
+static const char* reference_search(const char* begin, const char* end, const char* needle, pj_size_t needle_len)
+{
+    const char* p;
+
+    for (p = begin; p + needle_len <= end; p++) {
+        if (pj_memcmp(p, needle, needle_len) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static unsigned available_impls(search_impl impls[])
+{
+    unsigned count = 0;
+
+    impls[count].name = "scalar";
+    impls[count++].func = &find_bytes_scalar;
+#if NAT64_SIMD_X86
+    impls[count].name = "sse2";
+    impls[count++].func = &find_bytes_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impls[count].name = "avx2";
+        impls[count++].func = &find_bytes_avx2;
+    }
+#elif NAT64_SIMD_NEON
+    impls[count].name = "neon";
+    impls[count++].func = &find_bytes_neon;
+#endif
+    return count;
+}
+
+//Fill len bytes with a mix of the first and last byte of the needle and other text, put the needle at pos unless it
+//is negative and another copy right after the end
+static void fill_buffer(char* buf, int len, int pos, const char* needle, pj_size_t needle_len, pj_uint32_t* seed)
+{
+    static const char other[] = "x \r\n";
+    int i;
+
+    for (i = 0; i < len; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        switch ((*seed >> 16) % 4) {
+        case 0:
+            buf[i] = needle[0];
+            break;
+        case 1:
+            buf[i] = needle[needle_len - 1];
+            break;
+        default:
+            buf[i] = other[(*seed >> 20) % (sizeof(other) - 1)];
+            break;
+        }
+    }
+    if (pos >= 0) {
+        pj_memcpy(buf + pos, needle, needle_len);
+    }
+    pj_memcpy(buf + len, needle, needle_len);
+}
+
+static pj_bool_t test_needle(const search_impl impls[], unsigned impl_cnt, const char* needle, unsigned* checks)
+{
+    char storage[SEARCH_MAX_ALIGN + SEARCH_MAX_LEN + 32];
+    pj_size_t needle_len = strlen(needle);
+    pj_uint32_t seed = 1;
+    int align, len, pos;
+    unsigned i;
+
+    for (align = 0; align < SEARCH_MAX_ALIGN; align++) {
+        char* buf = storage + align;
+        for (len = 0; len <= SEARCH_MAX_LEN; len++) {
+            for (pos = -1; pos + (int)needle_len <= len; pos++) {
+                const char* expected;
+                const char* found;
+
+                fill_buffer(buf, len, pos, needle, needle_len, &seed);
+                expected = reference_search(buf, buf + len, needle, needle_len);
+                found = find_bytes(buf, buf + len, needle, needle_len);
+                if (found != expected) {
+                    printf("\"%s\": find_bytes gave %d instead of %d, length %d, alignment %d\n", needle,
+                           found ? (int)(found - buf) : -1, expected ? (int)(expected - buf) : -1, len, align);
+                    return PJ_FALSE;
+                }
+                if (len < (int)needle_len) {
+                    continue;
+                }
+                for (i = 0; i < impl_cnt; i++) {
+                    found = impls[i].func(buf, buf + len, needle, needle_len);
+                    if (found != expected) {
+                        printf("\"%s\": %s gave %d instead of %d, length %d, alignment %d\n", needle, impls[i].name,
+                               found ? (int)(found - buf) : -1, expected ? (int)(expected - buf) : -1, len, align);
+                        return PJ_FALSE;
+                    }
+                    (*checks)++;
+                }
+            }
+        }
+    }
+    return PJ_TRUE;
+}
+
+int main()
+{
+    search_impl impls[4];
+    unsigned impl_cnt = available_impls(impls);
+    unsigned failed = 0;
+    unsigned checks = 0;
+    unsigned i;
+
+    for (i = 0; i < impl_cnt; i++) {
+        printf("%s%s", i > 0 ? ", " : "searches: ", impls[i].name);
+    }
+    printf("\n");
+    for (i = 0; i < PJ_ARRAY_SIZE(needles); i++) {
+        if (!test_needle(impls, impl_cnt, needles[i], &checks)) {
+            failed++;
+        }
+    }
+    printf("%u searches compared\n", checks);
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+/*
+ * Shared by the tests that run whole messages through the module. Like the replay tool they parse a message, call the
+ * callbacks of the module the way pjsip does and look at what pjsip would send or pass on. Include it after the module
+ * source and tools/pj-nat64-stubs.h.
+ */
+#ifndef __PJ_NAT64_TEST_H__
+#define __PJ_NAT64_TEST_H__
+
+//Minimal pjsua endpoint with the module enabled and lookups answered by resolver
+static pj_status_t test_init(pj_nat64_getaddrinfo_cb resolver)
+{
+    pjsua_config cfg;
+    pjsua_logging_config log_cfg;
+    pj_status_t status;
+
+    status = pjsua_create();
+    if (status != PJ_SUCCESS) {
+        return status;
+    }
+    pjsua_config_default(&cfg);
+    pjsua_logging_config_default(&log_cfg);
+    log_cfg.level = 0;
+    log_cfg.console_level = 0;
+    status = pjsua_init(&cfg, &log_cfg, NULL);
+    if (status == PJ_SUCCESS) {
+        status = pj_nat64_enable_rewrite_module();
+    }
+    if (status != PJ_SUCCESS) {
+        pjsua_destroy();
+        return status;
+    }
+    pj_nat64_set_resolver(resolver);
+    return PJ_SUCCESS;
+}
+
+static void test_destroy()
+{
+    pj_nat64_disable_rewrite_module();
+    pjsua_destroy();
+}
+
+//Print head, the start line and headers each ended by CRLF, followed by body. Without a content type the message
+//has no body.
+static int test_build_message(char* buf, int size, const char* head, const char* content_type, const char* body)
+{
+    if (content_type == NULL) {
+        return pj_ansi_snprintf(buf, size, "%sContent-Length: 0\r\n\r\n", head);
+    }
+    return pj_ansi_snprintf(buf, size, "%sContent-Type: %s\r\nContent-Length: %d\r\n\r\n%s", head, content_type,
+                            (int)strlen(body), body);
+}
+
+//Incoming messages as the transport hands them to the module, the rdata and its pool are reused for each one
+typedef struct test_rx {
+    pj_pool_t*      pool;
+    pjsip_rx_data*  rdata;
+    pjsip_transport transport;
+} test_rx;
+
+static pj_status_t test_rx_init(test_rx* rx, const char* local_ip)
+{
+    pj_pool_t* pool = pjsua_pool_create("testrdata", 1000, 1000);
+
+    if (pool == NULL) {
+        return PJ_ENOMEM;
+    }
+    rx->rdata = PJ_POOL_ZALLOC_T(pool, pjsip_rx_data);
+    rx->pool = pool;
+    rx->rdata->tp_info.pool = pjsua_pool_create("testrx", 8000, 4000);
+    if (rx->rdata->tp_info.pool == NULL) {
+        pj_pool_release(pool);
+        return PJ_ENOMEM;
+    }
+    stub_transport_init(&rx->transport, local_ip);
+    rx->rdata->tp_info.transport = &rx->transport;
+    return PJ_SUCCESS;
+}
+
+static void test_rx_destroy(test_rx* rx)
+{
+    pj_pool_release(rx->rdata->tp_info.pool);
+    pj_pool_release(rx->pool);
+}
+
+//Parse msg into the rdata and hand it to mod-ipv6. held is set if the module kept the message from going on.
+static pj_status_t test_rx_message(test_rx* rx, const char* msg, int len, pj_bool_t* held)
+{
+    pjsip_rx_data* rdata = rx->rdata;
+    char* buf = rdata->pkt_info.packet;
+
+    pj_pool_reset(rdata->tp_info.pool);
+    pj_bzero(&rdata->msg_info, sizeof(rdata->msg_info));
+    pj_bzero(&rdata->endpt_info, sizeof(rdata->endpt_info));
+    if (len >= (int)sizeof(rdata->pkt_info.packet)) {
+        buf = (char*)pj_pool_alloc(rdata->tp_info.pool, len + 1);
+    }
+    pj_memcpy(buf, msg, len);
+    buf[len] = '\0';
+    rdata->pkt_info.len = len;
+    rdata->msg_info.msg_buf = buf;
+    rdata->msg_info.len = len;
+    if (pjsip_parse_rdata(buf, len, rdata) == NULL) {
+        return PJSIP_EINVALIDMSG;
+    }
+    *held = ipv6_mod_on_rx(rdata);
+    return PJ_SUCCESS;
+}
+
+//The sdp the invite session would see for the last incoming message, NULL if there is none
+static pjmedia_sdp_session* test_rx_sdp(test_rx* rx)
+{
+    pjsip_rdata_sdp_info* sdp_info = pjsip_rdata_get_sdp_info(rx->rdata);
+    return sdp_info != NULL ? sdp_info->sdp : NULL;
+}
+
+//Parse msg into a new tdata and print it with the module in place. The parsed sdp module runs before the message is
+//printed, mod-ipv6 after. The caller releases the tdata with pjsip_tx_data_dec_ref.
+static pj_status_t test_tx_message(const char* msg, int len, pjsip_tx_data** p_tdata)
+{
+    pjsip_tx_data* tdata;
+    pj_status_t status;
+    char* copy;
+
+    status = pjsip_endpt_create_tdata(pjsua_get_pjsip_endpt(), &tdata);
+    if (status != PJ_SUCCESS) {
+        return status;
+    }
+    pjsip_tx_data_add_ref(tdata);
+    copy = (char*)pj_pool_alloc(tdata->pool, len + 1);
+    pj_memcpy(copy, msg, len);
+    copy[len] = '\0';
+    tdata->msg = pjsip_parse_msg(tdata->pool, copy, len, NULL);
+    if (tdata->msg == NULL) {
+        pjsip_tx_data_dec_ref(tdata);
+        return PJSIP_EINVALIDMSG;
+    }
+    ipv6_sdp_mod_on_tx(tdata);
+    status = pjsip_tx_data_encode(tdata);
+    if (status != PJ_SUCCESS) {
+        pjsip_tx_data_dec_ref(tdata);
+        return status;
+    }
+    ipv6_mod_on_tx(tdata);
+    *p_tdata = tdata;
+    return PJ_SUCCESS;
+}
+
+//Parse the sdp of the printed message, NULL if there is none. Of a multipart body only the sdp part is parsed.
+static pjmedia_sdp_session* test_tx_sdp(pjsip_tx_data* tdata)
+{
+    const char* body = find_bytes(tdata->buf.start, tdata->buf.cur, "\r\n\r\n", 4);
+    pjmedia_sdp_session* sdp;
+    pj_size_t len;
+    char* copy;
+
+    if (body == NULL || tdata->msg->body == NULL) {
+        return NULL;
+    }
+    body += 4;
+    len = tdata->buf.cur - body;
+    copy = (char*)pj_pool_alloc(tdata->pool, len + 1);
+    pj_memcpy(copy, body, len);
+    copy[len] = '\0';
+    if (pj_stricmp2(&tdata->msg->body->content_type.type, "multipart") == 0) {
+        pjsip_media_type sdp_type;
+        pjsip_msg_body* multipart;
+        pjsip_multipart_part* part;
+
+        pjsip_media_type_init2(&sdp_type, "application", "sdp");
+        multipart = pjsip_multipart_parse(tdata->pool, copy, len, &tdata->msg->body->content_type, 0);
+        part = multipart != NULL ? pjsip_multipart_find_part(multipart, &sdp_type, NULL) : NULL;
+        if (part == NULL) {
+            return NULL;
+        }
+        copy = (char*)part->body->data;
+        len = part->body->len;
+    }
+    return pjmedia_sdp_parse(tdata->pool, copy, len, &sdp) == PJ_SUCCESS ? sdp : NULL;
+}
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Test of the trace ring: wraparound, order of the records read back and records that are being written.
+ *
+ * The ring is built with room for 16 records so it wraps many times within the test. After every wrap the last
+ * records must come back oldest first and complete, a slot being written must be skipped, and readers running
+ * while several threads write must never get a record mixed from two writes. The module source is included directly
+ * like in the benchmark.
+ *
+ * Build:
+ *   cc -I. test/pj-nat64-trace-test.c $(pkg-config --cflags --libs libpjproject) -o nat64-trace-test
+ * Run:
+ *   ./nat64-trace-test
+ */
+#define NAT64_TRACE_SIZE    16
+#include "../pj-nat64.c"
+#include "../tools/pj-nat64-stubs.h"
+#include "pj-nat64-test.h"
+
+#define WRITER_COUNT        4
+#define WRITER_RECORDS      50000
+#define WRITER_FIRST_ID     1000000
+
+//Every field of a record written by the test is derived from its msg_id, a torn copy does not match
+static void write_record(pj_uint32_t msg_id)
+{
+    pj_nat64_trace_record record;
+
+    pj_bzero(&record, sizeof(record));
+    record.msg_id = msg_id;
+    record.type = PJ_NAT64_TRACE_MESSAGE;
+    record.offset = msg_id * 3;
+    record.count = msg_id ^ 0xa5a5a5a5;
+    record.usec = ~msg_id;
+    record.timestamp = (pj_uint64_t)msg_id << 20;
+    trace_add(&record);
+}
+
+static pj_bool_t record_is_whole(const pj_nat64_trace_record* record)
+{
+    return record->type == PJ_NAT64_TRACE_MESSAGE && record->offset == record->msg_id * 3 &&
+           record->count == (record->msg_id ^ 0xa5a5a5a5) && record->usec == ~record->msg_id &&
+           record->timestamp == (pj_uint64_t)record->msg_id << 20;
+}
+
+//Read with room for max records, the ones written last must come back in order ending with last_id
+static pj_bool_t expect_last(const char* step, unsigned max, pj_uint32_t last_id)
+{
+    pj_nat64_trace_record records[NAT64_TRACE_SIZE * 2];
+    unsigned expected = PJ_MIN(max, NAT64_TRACE_SIZE);
+    unsigned count = pj_nat64_trace_read(records, max);
+    unsigned i;
+
+    if (count != expected) {
+        printf("%s: %u records read, expected %u\n", step, count, expected);
+        return PJ_FALSE;
+    }
+    for (i = 0; i < count; i++) {
+        if (records[i].msg_id != last_id - (count - 1 - i) || !record_is_whole(&records[i])) {
+            printf("%s: record %u has msg_id %u, expected %u\n", step, i, records[i].msg_id,
+                   last_id - (count - 1 - i));
+            return PJ_FALSE;
+        }
+    }
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_wraparound()
+{
+    pj_uint32_t msg_id = 0;
+    unsigned round;
+
+    for (round = 0; round < 5; round++) {
+        unsigned i;
+        //Not a multiple of the size so the head ends up anywhere in the ring
+        for (i = 0; i < NAT64_TRACE_SIZE + 3; i++) {
+            write_record(++msg_id);
+        }
+        if (!expect_last("wraparound", NAT64_TRACE_SIZE * 2, msg_id) || !expect_last("wraparound", 5, msg_id) ||
+            !expect_last("wraparound", 1, msg_id)) {
+            return PJ_FALSE;
+        }
+    }
+    printf("wraparound: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_sequence()
+{
+    pj_nat64_trace_record records[NAT64_TRACE_SIZE];
+    pj_uint32_t head = trace_ring.head;
+    pj_uint32_t pos;
+    pj_uint32_t* seq;
+    unsigned count, i;
+
+    //Every slot holds the record of its last position
+    for (pos = head - NAT64_TRACE_SIZE; pos != head; pos++) {
+        if (trace_ring.slot[pos & (NAT64_TRACE_SIZE - 1)].seq != pos + 1) {
+            printf("sequence: slot of position %u has seq %u\n", pos,
+                   trace_ring.slot[pos & (NAT64_TRACE_SIZE - 1)].seq);
+            return PJ_FALSE;
+        }
+    }
+    //A slot a writer is filling is skipped, the others still come back
+    seq = &trace_ring.slot[(head - 3) & (NAT64_TRACE_SIZE - 1)].seq;
+    *seq = 0;
+    count = pj_nat64_trace_read(records, NAT64_TRACE_SIZE);
+    *seq = head - 2;
+    if (count != NAT64_TRACE_SIZE - 1) {
+        printf("sequence: %u records read with one being written\n", count);
+        return PJ_FALSE;
+    }
+    for (i = 0; i < count; i++) {
+        if (records[i].msg_id == trace_ring.slot[(head - 3) & (NAT64_TRACE_SIZE - 1)].record.msg_id) {
+            printf("sequence: record being written was read\n");
+            return PJ_FALSE;
+        }
+    }
+    //Message ids are handed out once
+    if (NAT64_TRACE_MSG_ID() == NAT64_TRACE_MSG_ID()) {
+        printf("sequence: same message id twice\n");
+        return PJ_FALSE;
+    }
+    printf("sequence: ok\n");
+    return PJ_TRUE;
+}
+
+static pj_bool_t test_address()
+{
+    pj_nat64_trace_record record;
+    pj_str_t old_addr = pj_str("192.0.2.1");
+    pj_str_t host = pj_str("sip.example.com");
+    const char new_addr[] = "64:ff9b::c000:201";
+    char old_buf[PJ_INET6_ADDRSTRLEN];
+    char new_buf[PJ_INET6_ADDRSTRLEN];
+
+    trace_address(77, PJ_FALSE, 42, &old_addr, new_addr, strlen(new_addr));
+    if (pj_nat64_trace_read(&record, 1) != 1 || record.msg_id != 77 || record.offset != 42 ||
+        record.type != PJ_NAT64_TRACE_ADDRESS || record.old_family != 4 || record.new_family != 6 ||
+        strcmp(trace_format_address(record.old_family, record.old_addr, old_buf, sizeof(old_buf)), "192.0.2.1") != 0 ||
+        strcmp(trace_format_address(record.new_family, record.new_addr, new_buf, sizeof(new_buf)), new_addr) != 0) {
+        printf("address: record does not hold the replaced addresses\n");
+        return PJ_FALSE;
+    }
+    //Host names are not kept
+    trace_address(78, PJ_FALSE, PJ_NAT64_TRACE_NO_OFFSET, &host, new_addr, strlen(new_addr));
+    if (pj_nat64_trace_read(&record, 1) != 1 || record.msg_id != 78 || record.old_family != 0) {
+        printf("address: host name recorded as an address\n");
+        return PJ_FALSE;
+    }
+    printf("address: ok\n");
+    return PJ_TRUE;
+}
+
+static int writer_thread(void* arg)
+{
+    pj_uint32_t first = (pj_uint32_t)(pj_ssize_t)arg;
+    unsigned i;
+
+    for (i = 0; i < WRITER_RECORDS; i++) {
+        write_record(first + i);
+    }
+    return 0;
+}
+
+static pj_bool_t test_concurrent()
+{
+    pj_pool_t* pool = pjsua_pool_create("tracetest", 1000, 1000);
+    pj_thread_t* threads[WRITER_COUNT];
+    pj_nat64_trace_record records[NAT64_TRACE_SIZE];
+    pj_uint32_t end = trace_ring.head + WRITER_COUNT * WRITER_RECORDS;
+    unsigned reads = 0;
+    pj_bool_t ok = PJ_TRUE;
+    unsigned i;
+
+    if (pool == NULL) {
+        return PJ_FALSE;
+    }
+    for (i = 0; i < WRITER_COUNT; i++) {
+        if (pj_thread_create(pool, "tracewriter", &writer_thread, (void*)(pj_ssize_t)(WRITER_FIRST_ID * (i + 1)), 0, 0,
+                             &threads[i]) != PJ_SUCCESS) {
+            printf("concurrent: writer not started\n");
+            return PJ_FALSE;
+        }
+    }
+    while (ok && NAT64_ATOMIC_LOAD(trace_ring.head) != end) {
+        unsigned count = pj_nat64_trace_read(records, NAT64_TRACE_SIZE);
+        for (i = 0; i < count; i++) {
+            //Records of the earlier tests may still be in the ring
+            if (records[i].msg_id >= WRITER_FIRST_ID && !record_is_whole(&records[i])) {
+                printf("concurrent: torn record of msg_id %u\n", records[i].msg_id);
+                ok = PJ_FALSE;
+                break;
+            }
+        }
+        reads++;
+    }
+    for (i = 0; i < WRITER_COUNT; i++) {
+        pj_thread_join(threads[i]);
+        pj_thread_destroy(threads[i]);
+    }
+    pj_pool_release(pool);
+    if (ok) {
+        printf("concurrent: ok, %u reads\n", reads);
+    }
+    return ok;
+}
+
+int main()
+{
+    unsigned failed = 0;
+
+    if (test_init(&stub_getaddrinfo) != PJ_SUCCESS) {
+        return 1;
+    }
+
+    if (!test_wraparound()) {
+        failed++;
+    }
+    if (!test_sequence()) {
+        failed++;
+    }
+    if (!test_address()) {
+        failed++;
+    }
+    if (!test_concurrent()) {
+        failed++;
+    }
+    printf("%s\n", failed == 0 ? "All tests passed" : "Tests failed");
+
+    test_destroy();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,698 @@
+/*
+ * Offline replay of captured SIP traffic through the rewrite paths of pj-nat64.
+ *
+ * Reads a pcap capture or a pjsip log, shards the messages over worker threads and runs every message through the
+ * same callbacks pjsip calls for it, with a stub resolver so no network is needed. Reports messages/second and
+ * latency percentiles, writes the rewritten messages and compares them against the output of an earlier run, for
+ * instance of another build.
+ *
+ * Input:
+ *   - pcap (libpcap format, ethernet, linux cooked or raw ip). Every UDP datagram and every TCP segment holding a
+ *     SIP message is used, TCP streams are not reassembled. Packets sent from the -l address are outgoing, all
+ *     others incoming.
+ *   - pjsip logs with "RX/TX <n> bytes ...:" message dumps ending with "--end msg--", as written by -w, and the
+ *     "Incoming message" dumps of earlier versions of this module. pjsip logs incoming messages after the module
+ *     has rewritten them, so take rx messages from a log captured with the module disabled or from those dumps.
+ *
+ * Build:
+ *   cc -O2 -I. tools/pj-nat64-replay.c $(pkg-config --cflags --libs libpjproject) -o nat64-replay
+ * Run:
+ *   ./nat64-replay [-t threads] [-n repeat] [-m options] [-l local_ip] [-w rewritten.log] [-e expected.log] capture
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../pj-nat64.c"
+#include "pj-nat64-stubs.h"
+
+#define REPLAY_MAX_THREADS          64
+#define REPLAY_MAX_REPORTED_DIFFS   10
+
+typedef struct replay_msg {
+    pj_bool_t   outgoing;
+    char*       data;
+    int         len;
+    //Rewritten message from the first pass, NULL if it could not be parsed
+    char*       output;
+    int         output_len;
+} replay_msg;
+
+typedef struct replay_set {
+    pj_pool_t*  pool;
+    replay_msg* msg;
+    unsigned    count;
+    unsigned    cap;
+} replay_set;
+
+typedef struct replay_worker {
+    unsigned        index;
+    pj_thread_t*    thread;
+    pj_pool_t*      pool;
+    pj_uint32_t*    latency_nsec;
+    unsigned        latency_cnt;
+    unsigned        parse_failures;
+} replay_worker;
+
+static struct replay_config {
+    unsigned    threads;
+    unsigned    repeat;
+    unsigned    options;
+    const char* local_ip;
+    const char* output_file;
+    const char* expected_file;
+} config;
+
+static replay_set messages;
+
+static void set_add(replay_set* set, pj_bool_t outgoing, const char* data, int len)
+{
+    replay_msg* msg;
+    if (set->count == set->cap) {
+        unsigned new_cap = set->cap ? set->cap * 2 : 256;
+        replay_msg* new_msg = (replay_msg*)pj_pool_calloc(set->pool, new_cap, sizeof(replay_msg));
+        if (set->count > 0) {
+            pj_memcpy(new_msg, set->msg, set->count * sizeof(replay_msg));
+        }
+        set->msg = new_msg;
+        set->cap = new_cap;
+    }
+    msg = &set->msg[set->count++];
+    msg->outgoing = outgoing;
+    msg->data = (char*)pj_pool_alloc(set->pool, len + 1);
+    pj_memcpy(msg->data, data, len);
+    msg->data[len] = '\0';
+    msg->len = len;
+}
+
+static char* read_file(const char* path, pj_size_t* len)
+{
+    FILE* f = fopen(path, "rb");
+    char* data;
+    long size;
+
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (char*)malloc(size + 1);
+    if (data != NULL && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (data != NULL) {
+        data[size] = '\0';
+        *len = size;
+    }
+    return data;
+}
+
+static pj_bool_t looks_like_sip(const char* data, pj_size_t len)
+{
+    const char* line_end = (const char*)memchr(data, '\n', len);
+    if (len >= 8 && pj_memcmp(data, "SIP/2.0 ", 8) == 0) {
+        return PJ_TRUE;
+    }
+    return line_end != NULL && line_end - data > 9 && pj_memcmp(line_end - 8, "SIP/2.0\r", 8) == 0;
+}
+
+static pj_uint32_t pcap_u32(const pj_uint8_t* p, pj_bool_t swapped)
+{
+    if (swapped) {
+        return ((pj_uint32_t)p[0] << 24) | ((pj_uint32_t)p[1] << 16) | ((pj_uint32_t)p[2] << 8) | p[3];
+    }
+    return ((pj_uint32_t)p[3] << 24) | ((pj_uint32_t)p[2] << 16) | ((pj_uint32_t)p[1] << 8) | p[0];
+}
+
+//Extract the SIP payload of one captured ip packet
+static void pcap_add_packet(replay_set* set, const pj_uint8_t* ip, pj_size_t len)
+{
+    char src[PJ_INET6_ADDRSTRLEN];
+    const pj_uint8_t* l4;
+    pj_size_t l4_len;
+    unsigned proto;
+    pj_size_t payload_offset;
+
+    if (len < 20) {
+        return;
+    }
+    if ((ip[0] >> 4) == 4) {
+        unsigned hdr_len = (ip[0] & 0x0f) * 4;
+        pj_size_t total_len = (ip[2] << 8) | ip[3];
+        //Fragments are not reassembled
+        if (hdr_len < 20 || PJ_MIN(len, total_len) < hdr_len || ((ip[6] & 0x3f) | ip[7]) != 0) {
+            return;
+        }
+        proto = ip[9];
+        pj_inet_ntop(PJ_AF_INET, ip + 12, src, sizeof(src));
+        l4 = ip + hdr_len;
+        l4_len = PJ_MIN(len, total_len) - hdr_len;
+    } else if ((ip[0] >> 4) == 6) {
+        if (len < 40) {
+            return;
+        }
+        proto = ip[6];
+        pj_inet_ntop(PJ_AF_INET6, ip + 8, src, sizeof(src));
+        l4 = ip + 40;
+        l4_len = PJ_MIN(len - 40, (pj_size_t)((ip[4] << 8) | ip[5]));
+    } else {
+        return;
+    }
+
+    if (proto == 17 && l4_len >= 8) {
+        payload_offset = 8;
+    } else if (proto == 6 && l4_len >= 20) {
+        payload_offset = (l4[12] >> 4) * 4;
+    } else {
+        return;
+    }
+    if (payload_offset >= l4_len || !looks_like_sip((const char*)l4 + payload_offset, l4_len - payload_offset)) {
+        return;
+    }
+    set_add(set, config.local_ip != NULL && strcmp(src, config.local_ip) == 0,
+            (const char*)l4 + payload_offset, (int)(l4_len - payload_offset));
+}
+
+static pj_status_t parse_pcap(replay_set* set, const pj_uint8_t* data, pj_size_t len)
+{
+    pj_uint32_t magic = pcap_u32(data, PJ_FALSE);
+    pj_bool_t swapped;
+    pj_uint32_t link_type;
+    pj_size_t pos = 24;
+
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+        swapped = PJ_FALSE;
+    } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+        swapped = PJ_TRUE;
+    } else {
+        return PJ_EINVAL;
+    }
+    link_type = pcap_u32(data + 20, swapped);
+
+    while (pos + 16 <= len) {
+        pj_uint32_t incl_len = pcap_u32(data + pos + 8, swapped);
+        const pj_uint8_t* frame = data + pos + 16;
+        pj_size_t offset;
+        unsigned ether_type = 0;
+
+        pos += 16;
+        if (pos + incl_len > len) {
+            break;
+        }
+        pos += incl_len;
+        switch (link_type) {
+        case 1:
+            //Ethernet, with or without one vlan tag
+            offset = 14;
+            if (incl_len >= 18 && frame[12] == 0x81 && frame[13] == 0x00) {
+                offset = 18;
+            }
+            ether_type = incl_len >= offset ? ((frame[offset - 2] << 8) | frame[offset - 1]) : 0;
+            break;
+        case 113:
+            //Linux cooked capture
+            offset = 16;
+            ether_type = incl_len >= 16 ? ((frame[14] << 8) | frame[15]) : 0;
+            break;
+        case 12:
+        case 101:
+            offset = 0;
+            ether_type = 0x0800;
+            break;
+        default:
+            return PJ_ENOTSUP;
+        }
+        if ((ether_type == 0x0800 || ether_type == 0x86dd) && incl_len > offset) {
+            pcap_add_packet(set, frame + offset, incl_len - offset);
+        }
+    }
+    return PJ_SUCCESS;
+}
+
+//Take one dumped message, the log has lost the CR of every line
+static void log_add_message(replay_set* set, pj_bool_t outgoing, const char* start, const char* end)
+{
+    char* msg = (char*)malloc((end - start) * 2 + 4);
+    const char* line = start;
+    int len = 0;
+    pj_bool_t has_body_separator = PJ_FALSE;
+
+    while (line < end) {
+        const char* line_end = (const char*)memchr(line, '\n', end - line);
+        const char* text_end;
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        text_end = line_end;
+        if (text_end > line && *(text_end - 1) == '\r') {
+            text_end--;
+        }
+        if (text_end == line && !has_body_separator) {
+            has_body_separator = PJ_TRUE;
+        } else if (text_end == line && line_end + 1 >= end) {
+            //pjsip adds a newline after the final CRLF of the message
+            break;
+        }
+        pj_memcpy(msg + len, line, text_end - line);
+        len += (int)(text_end - line);
+        msg[len++] = '\r';
+        msg[len++] = '\n';
+        line = line_end + 1;
+    }
+    if (!has_body_separator) {
+        msg[len++] = '\r';
+        msg[len++] = '\n';
+    }
+    if (looks_like_sip(msg, len)) {
+        set_add(set, outgoing, msg, len);
+    }
+    free(msg);
+}
+
+static pj_status_t parse_log(replay_set* set, const char* data, pj_size_t len)
+{
+    const char* end = data + len;
+    const char* line = data;
+
+    while (line < end) {
+        const char* line_end = (const char*)memchr(line, '\n', end - line);
+        const char* marker;
+        const char* msg_end = NULL;
+        pj_bool_t outgoing = PJ_FALSE;
+        pj_size_t line_len;
+
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        line_len = line_end - line;
+
+        //pjsip: "RX 1024 bytes Request msg INVITE/cseq=1 (rdata0x1) from UDP 192.0.2.1:5060:"
+        if ((marker = find_bytes(line, line_end, "X ", 2)) != NULL && marker > line &&
+            (marker[-1] == 'R' || marker[-1] == 'T') && marker + 2 < line_end &&
+            pj_isdigit(marker[2]) && find_bytes(marker, line_end, " bytes ", 7) != NULL &&
+            (*(line_end - 1) == ':' || (line_len > 1 && *(line_end - 2) == ':'))) {
+            outgoing = marker[-1] == 'T';
+            msg_end = find_bytes(line_end, end, "\n--end msg--", 12);
+        } else if (find_bytes(line, line_end, "**********Incoming ", 19) != NULL) {
+            //Incoming message dumped by earlier versions of this module before it was rewritten
+            msg_end = find_bytes(line_end, end, "\n**********", 11);
+        }
+
+        if (msg_end != NULL && line_end < end) {
+            log_add_message(set, outgoing, line_end + 1, msg_end + 1);
+            line = msg_end + 1;
+            line_end = (const char*)memchr(line, '\n', end - line);
+            if (line_end == NULL) {
+                break;
+            }
+        }
+        line = line_end + 1;
+    }
+    return PJ_SUCCESS;
+}
+
+static pj_status_t load_messages(replay_set* set, const char* path)
+{
+    pj_size_t len = 0;
+    char* data = read_file(path, &len);
+    pj_status_t status;
+
+    if (data == NULL) {
+        printf("Can not read %s\n", path);
+        return PJ_ENOTFOUND;
+    }
+    if (len >= 24 && parse_pcap(set, (const pj_uint8_t*)data, len) == PJ_SUCCESS) {
+        status = PJ_SUCCESS;
+    } else {
+        status = parse_log(set, data, len);
+    }
+    free(data);
+    return status;
+}
+
+static char* copy_output(pj_pool_t* pool, const char* data, pj_size_t len, int* out_len)
+{
+    char* out = (char*)pj_pool_alloc(pool, len + 1);
+    pj_memcpy(out, data, len);
+    out[len] = '\0';
+    *out_len = (int)len;
+    return out;
+}
+
+//Same order as pjsip: the parsed sdp module runs before the message is printed, mod-ipv6 after
+static pj_status_t replay_tx(replay_worker* worker, replay_msg* msg, pj_bool_t keep_output, pj_uint32_t* nsec)
+{
+    pjsip_tx_data* tdata;
+    pj_timestamp t0, t1;
+    char* copy;
+    pj_status_t status;
+
+    status = pjsip_endpt_create_tdata(pjsua_get_pjsip_endpt(), &tdata);
+    if (status != PJ_SUCCESS) {
+        return status;
+    }
+    pjsip_tx_data_add_ref(tdata);
+    copy = (char*)pj_pool_alloc(tdata->pool, msg->len + 1);
+    pj_memcpy(copy, msg->data, msg->len + 1);
+    tdata->msg = pjsip_parse_msg(tdata->pool, copy, msg->len, NULL);
+    if (tdata->msg == NULL) {
+        pjsip_tx_data_dec_ref(tdata);
+        return PJSIP_EINVALIDMSG;
+    }
+
+    pj_get_timestamp(&t0);
+    ipv6_sdp_mod_on_tx(tdata);
+    status = pjsip_tx_data_encode(tdata);
+    ipv6_mod_on_tx(tdata);
+    pj_get_timestamp(&t1);
+    *nsec = pj_elapsed_nanosec(&t0, &t1);
+
+    if (keep_output && status == PJ_SUCCESS) {
+        msg->output = copy_output(worker->pool, tdata->buf.start, tdata->buf.cur - tdata->buf.start, &msg->output_len);
+    }
+    pjsip_tx_data_dec_ref(tdata);
+    return status;
+}
+
+static pj_status_t replay_rx(replay_worker* worker, pjsip_rx_data* rdata, replay_msg* msg, pj_bool_t keep_output,
+                             pj_uint32_t* nsec)
+{
+    pj_timestamp t0, t1;
+    char* buf = rdata->pkt_info.packet;
+
+    pj_pool_reset(rdata->tp_info.pool);
+    pj_bzero(&rdata->msg_info, sizeof(rdata->msg_info));
+    pj_bzero(&rdata->endpt_info, sizeof(rdata->endpt_info));
+    //Captures may hold messages above the receive buffer of pjsip, keep them so the large message paths run too
+    if (msg->len >= (int)sizeof(rdata->pkt_info.packet)) {
+        buf = (char*)pj_pool_alloc(rdata->tp_info.pool, msg->len + 1);
+    }
+    pj_memcpy(buf, msg->data, msg->len + 1);
+    rdata->pkt_info.len = msg->len;
+    rdata->msg_info.msg_buf = buf;
+    rdata->msg_info.len = msg->len;
+    if (pjsip_parse_rdata(buf, msg->len, rdata) == NULL) {
+        return PJSIP_EINVALIDMSG;
+    }
+
+    pj_get_timestamp(&t0);
+    ipv6_mod_on_rx(rdata);
+    pj_get_timestamp(&t1);
+    *nsec = pj_elapsed_nanosec(&t0, &t1);
+
+    if (keep_output) {
+        //Print the parsed message so Contact/Route changes and a rewritten parsed sdp show up as well
+        pjsip_msg* parsed = rdata->msg_info.msg;
+        pjsip_rdata_sdp_info* sdp_info = (config.options & NAT64_REWRITE_PARSED_SDP) ?
+                                         pjsip_rdata_get_sdp_info(rdata) : NULL;
+        pj_size_t size = rdata->msg_info.len * 2 + 1024;
+        pj_ssize_t len;
+        char* buf;
+
+        if (sdp_info != NULL && sdp_info->sdp != NULL && is_sdp_body(parsed->body)) {
+            pjsip_create_sdp_body(rdata->tp_info.pool, sdp_info->sdp, &parsed->body);
+        }
+        buf = (char*)pj_pool_alloc(rdata->tp_info.pool, size);
+        len = pjsip_msg_print(parsed, buf, size);
+        if (len > 0) {
+            msg->output = copy_output(worker->pool, buf, len, &msg->output_len);
+        }
+    }
+    return PJ_SUCCESS;
+}
+
+static int worker_main(void* arg)
+{
+    replay_worker* worker = (replay_worker*)arg;
+    pjsip_rx_data* rdata = PJ_POOL_ZALLOC_T(worker->pool, pjsip_rx_data);
+    pjsip_transport transport;
+    unsigned rep, i;
+
+    stub_transport_init(&transport, config.local_ip);
+    rdata->tp_info.pool = pjsua_pool_create("replayrx", 8000, 4000);
+    rdata->tp_info.transport = &transport;
+    for (rep = 0; rep < config.repeat; rep++) {
+        for (i = worker->index; i < messages.count; i += config.threads) {
+            replay_msg* msg = &messages.msg[i];
+            pj_uint32_t nsec = 0;
+            pj_status_t status;
+
+            status = msg->outgoing ? replay_tx(worker, msg, rep == 0, &nsec) :
+                                     replay_rx(worker, rdata, msg, rep == 0, &nsec);
+            if (status != PJ_SUCCESS) {
+                if (rep == 0) {
+                    worker->parse_failures++;
+                }
+                continue;
+            }
+            worker->latency_nsec[worker->latency_cnt++] = nsec;
+        }
+    }
+    pj_pool_release(rdata->tp_info.pool);
+    return 0;
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    pj_uint32_t x = *(const pj_uint32_t*)a;
+    pj_uint32_t y = *(const pj_uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void report_latency(replay_worker* workers, unsigned msg_count, pj_uint32_t wall_msec)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    pj_uint32_t* all = (pj_uint32_t*)malloc((msg_count + 1) * sizeof(pj_uint32_t));
+    unsigned count = 0;
+    unsigned i;
+
+    for (i = 0; i < config.threads; i++) {
+        pj_memcpy(all + count, workers[i].latency_nsec, workers[i].latency_cnt * sizeof(pj_uint32_t));
+        count += workers[i].latency_cnt;
+    }
+    printf("%u messages in %u ms on %u threads: %.0f messages/second\n", count, wall_msec, config.threads,
+           wall_msec ? count * 1000.0 / wall_msec : 0.0);
+    if (count > 0) {
+        qsort(all, count, sizeof(pj_uint32_t), &compare_u32);
+        printf("latency ns:");
+        for (i = 0; i < PJ_ARRAY_SIZE(percentiles); i++) {
+            printf(" p%g=%u", percentiles[i], all[(unsigned)((count - 1) * percentiles[i] / 100)]);
+        }
+        printf(" max=%u\n", all[count - 1]);
+    }
+    free(all);
+}
+
+static pj_status_t write_output(const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    unsigned i;
+
+    if (f == NULL) {
+        return PJ_ENOTFOUND;
+    }
+    for (i = 0; i < messages.count; i++) {
+        const replay_msg* msg = &messages.msg[i];
+        if (msg->output != NULL) {
+            fprintf(f, "%s %d bytes replayed msg %u:\n%.*s\n--end msg--\n", msg->outgoing ? "TX" : "RX",
+                    msg->output_len, i, msg->output_len, msg->output);
+        }
+    }
+    fclose(f);
+    return PJ_SUCCESS;
+}
+
+//Print the first line that differs between the two messages
+static void report_diff(unsigned index, const replay_msg* msg, const replay_msg* expected)
+{
+    const char* a = msg->output;
+    const char* b = expected->data;
+    int line = 1;
+    int i = 0;
+
+    while (i < msg->output_len && i < expected->len && a[i] == b[i]) {
+        if (a[i] == '\n') {
+            line++;
+        }
+        i++;
+    }
+    while (i > 0 && a[i - 1] != '\n') {
+        i--;
+    }
+    printf("message %u (%s) differs at line %d:\n  got:      %.*s\n  expected: %.*s\n", index,
+           msg->outgoing ? "tx" : "rx", line,
+           (int)strcspn(a + i, "\r\n"), a + i, (int)strcspn(b + i, "\r\n"), b + i);
+}
+
+static unsigned compare_output(const char* path)
+{
+    replay_set expected;
+    unsigned mismatches = 0;
+    unsigned i, j;
+
+    pj_bzero(&expected, sizeof(expected));
+    expected.pool = pjsua_pool_create("replayexp", 64000, 64000);
+    if (load_messages(&expected, path) != PJ_SUCCESS) {
+        pj_pool_release(expected.pool);
+        return 1;
+    }
+    for (i = 0, j = 0; i < messages.count; i++) {
+        const replay_msg* msg = &messages.msg[i];
+        if (msg->output == NULL) {
+            continue;
+        }
+        if (j >= expected.count) {
+            printf("message %u has no expected counterpart\n", i);
+            mismatches++;
+            continue;
+        }
+        if (msg->output_len != expected.msg[j].len || pj_memcmp(msg->output, expected.msg[j].data, msg->output_len)) {
+            if (mismatches < REPLAY_MAX_REPORTED_DIFFS) {
+                report_diff(i, msg, &expected.msg[j]);
+            }
+            mismatches++;
+        }
+        j++;
+    }
+    if (j < expected.count) {
+        printf("%u expected messages were not produced\n", expected.count - j);
+        mismatches += expected.count - j;
+    }
+    printf("%u of %u messages differ from %s\n", mismatches, j, path);
+    pj_pool_release(expected.pool);
+    return mismatches;
+}
+
+static void usage()
+{
+    printf("Usage: nat64-replay [options] capture.pcap|pjsip.log\n"
+           "  -t threads      Worker threads (default 4)\n"
+           "  -n repeat       Replay every message this many times (default 1)\n"
+           "  -m options      nat64_options bitmap (default 7), without NAT64_DEFER_RESOLUTION\n"
+           "  -l local_ip     Packets from this address are outgoing, pcap only\n"
+           "  -w file         Write the rewritten messages as a pjsip log\n"
+           "  -e file         Compare the rewritten messages with the ones in file\n");
+}
+
+int main(int argc, char* argv[])
+{
+    replay_worker workers[REPLAY_MAX_THREADS];
+    pjsua_config cfg;
+    pjsua_logging_config log_cfg;
+    pj_timestamp start, end;
+    pj_nat64_stats stats;
+    unsigned failures = 0;
+    unsigned mismatches = 0;
+    unsigned i;
+    int c;
+    pj_status_t status;
+
+    pj_bzero(&config, sizeof(config));
+    config.threads = 4;
+    config.repeat = 1;
+    config.options = NAT64_REWRITE_OUTGOING_SDP | NAT64_REWRITE_INCOMING_SDP | NAT64_REWRITE_ROUTE_AND_CONTACT;
+    while ((c = pj_getopt(argc, argv, "t:n:m:l:w:e:h")) != -1) {
+        switch (c) {
+        case 't':
+            config.threads = (unsigned)atoi(pj_optarg);
+            break;
+        case 'n':
+            config.repeat = (unsigned)atoi(pj_optarg);
+            break;
+        case 'm':
+            config.options = (unsigned)strtoul(pj_optarg, NULL, 0);
+            break;
+        case 'l':
+            config.local_ip = pj_optarg;
+            break;
+        case 'w':
+            config.output_file = pj_optarg;
+            break;
+        case 'e':
+            config.expected_file = pj_optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (pj_optind != argc - 1 || config.threads == 0 || config.threads > REPLAY_MAX_THREADS || config.repeat == 0) {
+        usage();
+        return 1;
+    }
+    //A held back message is cloned and injected into pjsip, its stub transport must never get there
+    if (config.options & NAT64_DEFER_RESOLUTION) {
+        printf("NAT64_DEFER_RESOLUTION can not be replayed, messages are only rewritten in place\n");
+        return 1;
+    }
+
+    status = pjsua_create();
+    if (status != PJ_SUCCESS) {
+        return 1;
+    }
+    pjsua_config_default(&cfg);
+    pjsua_logging_config_default(&log_cfg);
+    log_cfg.level = 0;
+    log_cfg.console_level = 0;
+    status = pjsua_init(&cfg, &log_cfg, NULL);
+    if (status == PJ_SUCCESS) {
+        status = pj_nat64_enable_rewrite_module();
+    }
+    if (status != PJ_SUCCESS) {
+        pjsua_destroy();
+        return 1;
+    }
+    pj_nat64_set_resolver(&stub_getaddrinfo);
+    pj_nat64_set_options((nat64_options)config.options);
+
+    messages.pool = pjsua_pool_create("replay", 64000, 64000);
+    if (load_messages(&messages, argv[pj_optind]) != PJ_SUCCESS || messages.count == 0) {
+        printf("No SIP messages found in %s\n", argv[pj_optind]);
+        pj_pool_release(messages.pool);
+        pj_nat64_disable_rewrite_module();
+        pjsua_destroy();
+        return 1;
+    }
+
+    pj_bzero(workers, sizeof(workers));
+    for (i = 0; i < config.threads; i++) {
+        workers[i].index = i;
+        workers[i].pool = pjsua_pool_create("replayworker", 64000, 64000);
+        workers[i].latency_nsec = (pj_uint32_t*)pj_pool_calloc(workers[i].pool,
+                                                               (messages.count / config.threads + 1) * config.repeat,
+                                                               sizeof(pj_uint32_t));
+    }
+    pj_get_timestamp(&start);
+    for (i = 0; i < config.threads; i++) {
+        pj_thread_create(workers[i].pool, "replay", &worker_main, &workers[i], 0, 0, &workers[i].thread);
+    }
+    for (i = 0; i < config.threads; i++) {
+        if (workers[i].thread != NULL) {
+            pj_thread_join(workers[i].thread);
+            pj_thread_destroy(workers[i].thread);
+        }
+        failures += workers[i].parse_failures;
+    }
+    pj_get_timestamp(&end);
+
+    report_latency(workers, messages.count * config.repeat, pj_elapsed_msec(&start, &end));
+    pj_nat64_get_stats(&stats);
+    printf("%u messages, %u not parsed, %u rewritten, %u addresses replaced, %u memo hits\n", messages.count,
+           failures, stats.rx_rewritten + stats.tx_rewritten, stats.addresses_replaced, stats.memo_hits);
+
+    if (config.output_file != NULL && write_output(config.output_file) != PJ_SUCCESS) {
+        printf("Can not write %s\n", config.output_file);
+    }
+    if (config.expected_file != NULL) {
+        mismatches = compare_output(config.expected_file);
+    }
+
+    for (i = 0; i < config.threads; i++) {
+        pj_pool_release(workers[i].pool);
+    }
+    pj_pool_release(messages.pool);
+    pj_nat64_disable_rewrite_module();
+    pjsua_destroy();
+    return mismatches > 0 ? 2 : 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Stand-ins for the network parts of pjsip, shared by the replay tool and the benchmark which include the module
+ * source and drive its callbacks directly.
+ */
+#ifndef __PJ_NAT64_STUBS_H__
+#define __PJ_NAT64_STUBS_H__
+
+//Answers every lookup as if behind a NAT64 with the well known prefix, ipv4 literals are synthesized
+static pj_status_t stub_getaddrinfo(int af, const pj_str_t *name, unsigned *count, pj_addrinfo ai[])
+{
+    pj_in_addr ipv4;
+    pj_in6_addr ipv6;
+    pj_str_t ipv4only_answer = pj_str("192.0.0.170");
+    pj_str_t hostname_answer = pj_str("203.0.113.10");
+    static const pj_uint8_t well_known_prefix[] = { 0x00, 0x64, 0xff, 0x9b };
+
+    PJ_UNUSED_ARG(af);
+    if (*count == 0) {
+        return PJ_ETOOSMALL;
+    }
+    if (pj_stricmp2(name, "ipv4only.arpa") == 0) {
+        pj_inet_pton(PJ_AF_INET, &ipv4only_answer, &ipv4);
+    } else if (pj_inet_pton(PJ_AF_INET, name, &ipv4) != PJ_SUCCESS) {
+        pj_inet_pton(PJ_AF_INET, &hostname_answer, &ipv4);
+    }
+    pj_bzero(&ipv6, sizeof(ipv6));
+    pj_memcpy(ipv6.s6_addr, well_known_prefix, sizeof(well_known_prefix));
+    pj_memcpy(&ipv6.s6_addr[12], &ipv4.s_addr, 4);
+
+    pj_bzero(&ai[0], sizeof(ai[0]));
+    pj_sockaddr_init(PJ_AF_INET6, &ai[0].ai_addr, NULL, 0);
+    ai[0].ai_addr.ipv6.sin6_addr = ipv6;
+    *count = 1;
+    return PJ_SUCCESS;
+}
+
+//Transport an incoming message is handed to the module on. It only carries what the module reads: the type and the
+//local address, udp6 unless local_ip is an ipv4 address. Never pass it to pjsip, it is not reference counted.
+static void stub_transport_init(pjsip_transport* tp, const char* local_ip)
+{
+    pj_str_t host = pj_str((char*)(local_ip != NULL ? local_ip : "::1"));
+    pj_in_addr ipv4;
+
+    pj_bzero(tp, sizeof(*tp));
+    if (pj_inet_pton(PJ_AF_INET, &host, &ipv4) == PJ_SUCCESS) {
+        tp->key.type = PJSIP_TRANSPORT_UDP;
+        tp->type_name = (char*)"UDP";
+    } else {
+        tp->key.type = PJSIP_TRANSPORT_UDP6;
+        tp->type_name = (char*)"UDP6";
+    }
+    pj_ansi_snprintf(tp->obj_name, sizeof(tp->obj_name), "stubtp");
+    tp->local_name.host = host;
+    tp->local_name.port = 5060;
+    tp->flag = pjsip_transport_get_flag_from_type((pjsip_transport_type_e)tp->key.type);
+}
+
+#endif